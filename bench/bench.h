@@ -0,0 +1,43 @@
+/*
+ * Helpers shared by the benchmarks: a xorshift generator with a fixed
+ * seed, so that every run draws the same numbers, and a monotonic clock.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <time.h>
+
+#define BENCH_SEED 88172645463325252UL
+
+static unsigned long rng = BENCH_SEED;
+
+/*
+ * Advance a xorshift generator.
+ *
+ * @param state  The generator's state, which must not be 0.
+ * @return  The next number.
+ */
+static unsigned long xorshift(unsigned long *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/*
+ * @return  The next number from the shared generator.
+ */
+static unsigned long next_random(void){
+	return xorshift(&rng);
+}
+
+/*
+ * @return  The monotonic clock, in nanoseconds.
+ */
+static double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif
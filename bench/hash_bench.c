@@ -0,0 +1,211 @@
+/*
+ * Key hash speed and distribution, and key comparison speed.
+ *
+ * For each corpus of keys, times the old djb2 hash (which stops at the
+ * first NUL byte) and hash_bytes(), and shows how evenly each spreads
+ * the keys over a power-of-two table at least as large as the corpus,
+ * by the low bits of the int a key keeps, as the store does:
+ *
+ *   distinct  Keys with a hash of their own
+ *   max       Longest chain
+ *   quality   Expected probes against a uniform hash; 1.00 is ideal
+ *
+ * The built-in corpora are sequential names, UUIDs, URL paths and binary
+ * keys that share a prefix ending in a NUL byte; a file named on the
+ * command line is used as one more, one key per line.  Then times
+ * memcmp() against bytes_equal() on equal keys of several lengths.
+ *
+ * Usage: hash_bench [keys [corpus_file]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+#include "bench.h"
+
+typedef struct corpus {
+	const char *name;
+	char **keys;
+	size_t *lens;
+	size_t n;
+} CORPUS;
+
+static volatile uint64_t sink;  // Keeps the timed loops from being optimized away
+
+/*
+ * The hash the store used before, kept here for comparison.
+ */
+static uint64_t djb2(const void *data, size_t len){
+	const unsigned char *p = data;
+	unsigned long h = 5381;
+	for(size_t i = 0; i < len && p[i] != '\0'; i++){
+		h = ((h << 5) + h) + p[i];
+	}
+	return h;
+}
+
+static void corpus_add(CORPUS *c, const char *key, size_t len){
+	c->keys[c->n] = malloc(len + 1);
+	memcpy(c->keys[c->n], key, len);
+	c->keys[c->n][len] = '\0';
+	c->lens[c->n++] = len;
+}
+
+static CORPUS *corpus_new(const char *name, size_t n){
+	CORPUS *c = calloc(1, sizeof(CORPUS));
+	c->name = name;
+	c->keys = malloc(n * sizeof(char *));
+	c->lens = malloc(n * sizeof(size_t));
+	return c;
+}
+
+static CORPUS *corpus_make(const char *name, size_t n){
+	CORPUS *c = corpus_new(name, n);
+	char buf[64];
+	int len;
+	for(size_t i = 0; i < n; i++){
+		unsigned long r = next_random(), s = next_random();
+		if(strcmp(name, "sequential") == 0){
+			len = snprintf(buf, sizeof(buf), "key%zu", i);
+		}
+		else if(strcmp(name, "uuid") == 0){
+			len = snprintf(buf, sizeof(buf), "%08lx-%04lx-4%03lx-%04lx-%012lx",
+				r & 0xffffffff, (r >> 32) & 0xffff, (r >> 48) & 0xfff,
+				s & 0xffff, (s >> 16) & 0xffffffffffff);
+		}
+		else if(strcmp(name, "path") == 0){
+			len = snprintf(buf, sizeof(buf), "/api/v1/users/%lu/orders/%lu",
+				r % 100000, s % 1000);
+		}
+		else{
+			//a two-byte tag, a NUL, then a big-endian counter
+			buf[0] = 'b';
+			buf[1] = 'k';
+			buf[2] = '\0';
+			for(int j = 0; j < 8; j++){
+				buf[3 + j] = (char)(i >> (8 * (7 - j)));
+			}
+			len = 11;
+		}
+		corpus_add(c, buf, len);
+	}
+	return c;
+}
+
+static CORPUS *corpus_read(const char *path, size_t max){
+	FILE *f = fopen(path, "r");
+	CORPUS *c;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	if(f == NULL){
+		perror(path);
+		return NULL;
+	}
+	c = corpus_new(path, max);
+	while(c->n < max && (len = getline(&line, &size, f)) > 0){
+		if(line[len - 1] == '\n'){
+			len--;
+		}
+		corpus_add(c, line, len);
+	}
+	free(line);
+	fclose(f);
+	return c;
+}
+
+static void corpus_free(CORPUS *c){
+	for(size_t i = 0; i < c->n; i++){
+		free(c->keys[i]);
+	}
+	free(c->keys);
+	free(c->lens);
+	free(c);
+}
+
+static int compare_uint(const void *a, const void *b){
+	unsigned int x = *(unsigned int *)a, y = *(unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(CORPUS *c, const char *name, uint64_t (*fn)(const void *, size_t)){
+	size_t buckets = 1, distinct = 0, max = 0;
+	unsigned int *hashes = malloc(c->n * sizeof(unsigned int));
+	unsigned int *chain;
+	double t0, ns, probes = 0, ideal;
+	while(buckets < c->n){
+		buckets <<= 1;
+	}
+	chain = calloc(buckets, sizeof(unsigned int));
+	t0 = now_ns();
+	for(size_t i = 0; i < c->n; i++){
+		sink = fn(c->keys[i], c->lens[i]);
+	}
+	ns = (now_ns() - t0) / c->n;
+	for(size_t i = 0; i < c->n; i++){
+		hashes[i] = (unsigned int)fn(c->keys[i], c->lens[i]);
+		chain[hashes[i] & (buckets - 1)]++;
+	}
+	for(size_t i = 0; i < buckets; i++){
+		probes += chain[i] * (chain[i] + 1.0) / 2;
+		if(chain[i] > max){
+			max = chain[i];
+		}
+	}
+	ideal = (c->n / (2.0 * buckets)) * (c->n + 2.0 * buckets - 1);
+	qsort(hashes, c->n, sizeof(unsigned int), compare_uint);
+	for(size_t i = 0; i < c->n; i++){
+		distinct += (i == 0 || hashes[i] != hashes[i - 1])
+			&& (i + 1 == c->n || hashes[i] != hashes[i + 1]);
+	}
+	printf("%-12s %8s %10zu %8.1f %10zu %6zu %8.2f\n", c->name, name, c->n, ns,
+		distinct, max, probes / ideal);
+	free(chain);
+	free(hashes);
+}
+
+static void compare_speed(void){
+	static const size_t lens[] = { 8, 16, 32, 64, 256 };
+	int rounds = 2000000;
+	char *a = malloc(256), *b = malloc(256);
+	memset(a, 'x', 256);
+	memset(b, 'x', 256);
+	printf("\n%6s %12s %12s\n", "len", "memcmp_ns", "equal_ns");
+	for(size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++){
+		//a volatile length keeps the calls from being specialized away
+		volatile size_t len = lens[i];
+		double t0 = now_ns(), t1;
+		for(int r = 0; r < rounds; r++){
+			sink = memcmp(a, b, len) == 0;
+		}
+		t1 = now_ns();
+		for(int r = 0; r < rounds; r++){
+			sink = bytes_equal(a, b, len);
+		}
+		printf("%6zu %12.2f %12.2f\n", lens[i], (t1 - t0) / rounds,
+			(now_ns() - t1) / rounds);
+	}
+	free(a);
+	free(b);
+}
+
+int main(int argc, char *argv[]){
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	static const char *names[] = { "sequential", "uuid", "path", "binary" };
+	CORPUS *c;
+	printf("%-12s %8s %10s %8s %10s %6s %8s\n", "corpus", "hash", "keys", "ns/key",
+		"distinct", "max", "quality");
+	for(int i = 0; i < 5; i++){
+		if(i < 4){
+			c = corpus_make(names[i], n);
+		}
+		else if(argc < 3 || (c = corpus_read(argv[2], n)) == NULL){
+			break;
+		}
+		report(c, "djb2", djb2);
+		report(c, "seeded", hash_bytes);
+		corpus_free(c);
+	}
+	compare_speed();
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * How long the store's locks are held while large values are replaced.
+ *
+ * Puts values of the given size to random keys from a small keyset, in
+ * transactions of a hundred operations, with every version collected as
+ * soon as it is replaced (no sweeper), so that every put throws away the
+ * value before it.  Every fourth transaction also has an older one try
+ * to write one of its keys, which aborts it and throws its value away
+ * unstored.  With lock hold times kept, prints the bounds under which
+ * the median and the tail of them fall, for a single map mutex and for
+ * lock stripes.
+ *
+ * Usage: hold_bench [value_size [keys [operations]]]
+ */
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "map.h"
+#include "bench.h"
+
+#define BATCH 100
+
+static void put(TRANSACTION *tp, unsigned long k, char *content, size_t size){
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "bigkey-%lu", k);
+	store_put(tp, key_create(blob_create(buf, len)), blob_create(content, size));
+}
+
+/*
+ * @return  Nanoseconds per operation.
+ */
+static double run(unsigned long keys, unsigned long ops, char *content, size_t size){
+	TRANSACTION *tp, *older;
+	unsigned long k = 0;
+	double t0 = now_ns();
+	for(unsigned long i = 0; i < ops; i += BATCH){
+		older = (i / BATCH) % 4 == 0 ? trans_create() : NULL;
+		tp = trans_create();
+		for(int j = 0; j < BATCH; j++){
+			k = next_random() % keys;
+			put(tp, k, content, size);
+		}
+		if(older != NULL){
+			//finds the later transaction's version in the way
+			put(older, k, content, size);
+			trans_abort(older);
+		}
+		trans_commit(tp);
+	}
+	return (now_ns() - t0) / ops;
+}
+
+int main(int argc, char *argv[]){
+	size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : 65536;
+	unsigned long keys = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+	unsigned long ops = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+	static const double tails[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+	unsigned long counts[MAP_HOLD_BUCKETS], total, seen;
+	char *content = calloc(1, size);
+	double ns;
+	int b;
+	server_config.sweep = 0;
+	server_config.lockstats = 1;
+	trans_init();
+	printf("%8s %8s %8s %10s %10s %10s %10s %10s %10s\n", "size", "keys", "stripes", "ns_per_op",
+		"p50_ns", "p90_ns", "p99_ns", "p99.9_ns", "max_ns");
+	for(int stripes = 0; stripes <= 64; stripes += 64){
+		server_config.stripes = stripes;
+		store_init();
+		ns = run(keys, ops, content, size);
+		total = map_hold_times(counts);
+		printf("%8zu %8lu %8d %10.1f", size, keys, stripes, ns);
+		//the bound of the bucket in which each share of the times ends
+		for(int t = 0; t < 5; t++){
+			for(b = 0, seen = counts[0]; b < MAP_HOLD_BUCKETS - 1 && seen < tails[t] * total; seen += counts[++b]);
+			printf(" %10lu", 2UL << b);
+		}
+		printf("\n");
+		fflush(stdout);
+		store_fini();
+	}
+	trans_fini();
+	free(content);
+	return 0;
+}
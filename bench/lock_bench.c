@@ -0,0 +1,101 @@
+/*
+ * Store throughput against the number of threads, with one lock over
+ * the whole store and with lock striping.
+ *
+ * Each thread runs transactions of a PUT and some GETs (one by default)
+ * on keys of its own, so no two transactions conflict and any waiting
+ * is for locks.  GETs of keys already written find a committed value
+ * and go through the lock-free read path.  For
+ * 1, 2, 4, ... up to the given number of threads, prints the operations
+ * per second with a single lock and with the given number of stripes.
+ *
+ * Usage: lock_bench [max_threads [stripes [seconds [keys_per_thread [gets_per_put]]]]]
+ */
+#include <stdatomic.h>
+#include <time.h>
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "map.h"
+
+static atomic_int stop;
+static int keys_per_thread = 1000;
+static int gets_per_put = 1;
+
+typedef struct worker {
+	pthread_t tid;
+	int id;
+	unsigned long ops;
+} WORKER;
+
+static KEY *make_key(int thread, int i){
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "t%d-key%d", thread, i);
+	return key_create(blob_create(buf, len));
+}
+
+static void *worker_thread(void *arg){
+	WORKER *w = arg;
+	BLOB *value = blob_create("value", 5), *got;
+	unsigned long i = 0;
+	while(!stop){
+		TRANSACTION *tp = trans_create();
+		store_put(tp, make_key(w->id, i % keys_per_thread), blob_ref(value, "put"));
+		for(int j = 1; j <= gets_per_put; j++){
+			if(store_get(tp, make_key(w->id, (i + j) % keys_per_thread), &got) != TRANS_ABORTED)
+				blob_unref(got, "get");
+		}
+		trans_commit(tp);
+		w->ops += 1 + gets_per_put;
+		i++;
+	}
+	blob_unref(value, "worker");
+	return NULL;
+}
+
+/*
+ * @return  Operations per second for the given thread count.
+ */
+static double run(int nthreads, int stripes, double seconds){
+	WORKER *workers = calloc(nthreads, sizeof(WORKER));
+	struct timespec pause = { (time_t)seconds, (seconds - (time_t)seconds) * 1e9 };
+	unsigned long ops = 0;
+	server_config.stripes = stripes;
+	store_init();
+	stop = 0;
+	for(int i = 0; i < nthreads; i++){
+		workers[i].id = i;
+		Pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+	}
+	nanosleep(&pause, NULL);
+	stop = 1;
+	for(int i = 0; i < nthreads; i++){
+		Pthread_join(workers[i].tid, NULL);
+		ops += workers[i].ops;
+	}
+	store_fini();
+	free(workers);
+	return ops / seconds;
+}
+
+int main(int argc, char *argv[]){
+	int max = argc > 1 ? atoi(argv[1]) : 64;
+	int stripes = argc > 2 ? atoi(argv[2]) : 64;
+	double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+	double single, striped;
+	if(argc > 4)
+		keys_per_thread = atoi(argv[4]);
+	if(argc > 5)
+		gets_per_put = atoi(argv[5]);
+	trans_init();
+	printf("%8s %14s %14s %8s\n", "threads", "single_ops/s", "striped_ops/s", "speedup");
+	for(int n = 1; n <= max; n *= 2){
+		single = run(n, 0, seconds);
+		striped = run(n, stripes, seconds);
+		printf("%8d %14.0f %14.0f %8.2f\n", n, single, striped, striped / single);
+		fflush(stdout);
+	}
+	trans_fini();
+	return 0;
+}
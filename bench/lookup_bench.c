@@ -0,0 +1,77 @@
+/*
+ * GETs and PUTs with owned keys against borrowed key views.
+ *
+ * Fills the store with a hot keyset of committed keys, then times GETs
+ * and PUTs of random keys from it, in transactions of a hundred
+ * operations, the way the server used to make their keys (a blob and a
+ * key of their own for every operation, inherited by store_get() and
+ * store_put()) and the way it makes them now (a key_view() of the bytes
+ * where they lie, borrowed by store_get_borrowed() and
+ * store_put_borrowed()).  The key bytes are formatted into a buffer for
+ * each operation either way, as if they had just been received.
+ *
+ * Usage: lookup_bench [keys [operations]]
+ */
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "map.h"
+#include "bench.h"
+
+#define BATCH 100
+
+/*
+ * @return  Nanoseconds per operation.
+ */
+static double run(unsigned long keys, unsigned long ops, int put, int view){
+	TRANSACTION *tp = NULL;
+	BLOB *value = blob_create("value", 5), *got;
+	KEY_VIEW kv;
+	char buf[32];
+	int len;
+	double t0 = now_ns();
+	for(unsigned long i = 0; i < ops; i++){
+		if(i % BATCH == 0){
+			if(tp != NULL)
+				trans_commit(tp);
+			tp = trans_create();
+		}
+		len = snprintf(buf, sizeof(buf), "hotkey-%lu", next_random() % keys);
+		if(put && view)
+			store_put_borrowed(tp, key_view(&kv, buf, len), blob_ref(value, "put"));
+		else if(put)
+			store_put(tp, key_create(blob_create(buf, len)), blob_ref(value, "put"));
+		else if((view ? store_get_borrowed(tp, key_view(&kv, buf, len), &got)
+				: store_get(tp, key_create(blob_create(buf, len)), &got)) != TRANS_ABORTED)
+			blob_unref(got, "get");
+	}
+	trans_commit(tp);
+	blob_unref(value, "run");
+	return (now_ns() - t0) / ops;
+}
+
+int main(int argc, char *argv[]){
+	unsigned long keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+	unsigned long ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+	static const char *names[] = { "chained", "open" };
+	trans_init();
+	printf("%8s %8s %12s %12s %12s %12s\n", "keys", "table", "get_owned", "get_view", "put_owned", "put_view");
+	for(int table = TABLE_CHAINED; table <= TABLE_OPEN; table++){
+		server_config.table = table;
+		store_init();
+		//the keyset is there before the timing starts
+		run(keys, keys * 4, 1, 0);
+		printf("%8lu %8s", keys, names[table]);
+		for(int put = 0; put <= 1; put++){
+			for(int view = 0; view <= 1; view++){
+				printf(" %12.1f", run(keys, ops, put, view));
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+		store_fini();
+	}
+	trans_fini();
+	return 0;
+}
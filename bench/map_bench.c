@@ -0,0 +1,75 @@
+/*
+ * Store lookup latency against the number of keys.
+ *
+ * For each store size (1k, 10k, ... up to the given maximum), fills an
+ * empty store with that many committed keys and then times GETs of
+ * random existing keys, each in a transaction of its own.  With the
+ * table growing along with the store, the time per lookup should not
+ * depend on the number of keys.
+ *
+ * Usage: map_bench [max_keys [initial_buckets [lookups]]]
+ */
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "map.h"
+#include "bench.h"
+
+static int compare_double(const void *a, const void *b){
+	double x = *(double *)a, y = *(double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static KEY *make_key(unsigned long i){
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "key%lu", i);
+	return key_create(blob_create(buf, len));
+}
+
+/*
+ * Fill the store with n committed keys, all sharing one value.
+ */
+static void fill(unsigned long n){
+	TRANSACTION *tp = trans_create();
+	BLOB *value = blob_create("value", 5);
+	for(unsigned long i = 0; i < n; i++){
+		store_put(tp, make_key(i), blob_ref(value, "fill"));
+	}
+	blob_unref(value, "fill");
+	trans_commit(tp);
+}
+
+int main(int argc, char *argv[]){
+	unsigned long max = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+	int lookups = argc > 3 ? atoi(argv[3]) : 200000;
+	double *lat = malloc(lookups * sizeof(double));
+	server_config.buckets = argc > 2 ? atoi(argv[2]) : server_config.buckets;
+	trans_init();
+	printf("%10s %10s %10s %10s %10s\n", "keys", "buckets", "mean_ns", "p50_ns", "p99_ns");
+	for(unsigned long n = 1000; n <= max; n *= 10){
+		double total = 0, t0;
+		BLOB *value;
+		store_init();
+		fill(n);
+		for(int i = 0; i < lookups; i++){
+			TRANSACTION *tp = trans_create();
+			KEY *kp = make_key(next_random() % n);
+			t0 = now_ns();
+			store_get(tp, kp, &value);
+			lat[i] = now_ns() - t0;
+			total += lat[i];
+			if(value != NULL)
+				blob_unref(value, "lookup");
+			trans_commit(tp);
+		}
+		qsort(lat, lookups, sizeof(double), compare_double);
+		printf("%10lu %10d %10.0f %10.0f %10.0f\n", n, the_map.num_buckets,
+			total / lookups, lat[lookups / 2], lat[lookups * 99 / 100]);
+		fflush(stdout);
+		store_fini();
+	}
+	trans_fini();
+	free(lat);
+	return 0;
+}
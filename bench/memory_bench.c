@@ -0,0 +1,98 @@
+/*
+ * Heap bytes per key held by the store.
+ *
+ * For a few key and value sizes, fills an empty store with committed
+ * keys, each with one value, in transactions of a thousand puts (or as
+ * many as given), collects every entry once, as a pass of the sweeper
+ * would, and reports the growth of the heap in use (from mallinfo2(), so malloc's
+ * own per-allocation overhead is counted, plus the objects allocated
+ * from slabs) divided by the number of keys.
+ * The hash table is included.  The sweeper is off, so that nothing is
+ * freed behind the measurement's back.
+ *
+ * Usage: memory_bench [keys [puts_per_transaction]]
+ */
+#include <malloc.h>
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "epoch.h"
+#include "slab.h"
+#include "map.h"
+
+static unsigned long batch = 1000;
+
+static void collect(MAP_ENTRY *mp){
+	garbage_collect(mp, version_retire);
+}
+
+/*
+ * @return  Bytes of heap in use, counting the objects allocated from
+ *   slabs, but not the free ones or the rest of the slabs.
+ */
+static size_t heap_in_use(void){
+	struct mallinfo2 mi = mallinfo2();
+	size_t n = mi.uordblks + mi.hblkhd;
+	SLAB_STATS st;
+	for(int type = 0; type < SLAB_NTYPES; type++){
+		slab_stats(type, &st);
+		n += st.live * st.size;
+	}
+	return n;
+}
+
+/*
+ * Fill the store with n keys and values of the given sizes, the way
+ * the server makes them from incoming packets.
+ *
+ * @return  Heap bytes per key.
+ */
+static double fill(unsigned long n, int key_size, int value_size){
+	char key[256], value[256];
+	size_t before;
+	TRANSACTION *tp = NULL;
+	memset(value, 'v', sizeof(value));
+	store_init();
+	before = heap_in_use();
+	for(unsigned long i = 0; i < n; i++){
+		if(i % batch == 0){
+			if(tp != NULL){
+				trans_commit(tp);
+			}
+			tp = trans_create();
+		}
+		//a counter, padded out to the key size
+		memset(key, 'k', key_size);
+		snprintf(key, key_size + 1, "%0*lu", key_size, i);
+		store_put(tp, key_create(blob_create(key, key_size)), blob_create(value, value_size));
+	}
+	trans_commit(tp);
+	for(MAP_CURSOR cursor = { 0, 0 }; !map_sweep(&cursor, 1024, collect); );
+	//deferred frees of the table's growth are not part of the store
+	epoch_poll();
+	epoch_poll();
+	return (double)(heap_in_use() - before) / n;
+}
+
+int main(int argc, char *argv[]){
+	unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	if(argc > 2)
+		batch = strtoul(argv[2], NULL, 10);
+	static const int sizes[][2] = { { 8, 8 }, { 16, 8 }, { 16, 32 }, { 32, 100 } };
+	static const char *names[] = { "chained", "open" };
+	trans_init();
+	server_config.sweep = 0;
+	printf("%10s %8s %8s %8s %14s\n", "keys", "table", "key", "value", "bytes_per_key");
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+		for(int table = TABLE_CHAINED; table <= TABLE_OPEN; table++){
+			server_config.table = table;
+			printf("%10lu %8s %8d %8d %14.1f\n", n, names[table], sizes[i][0], sizes[i][1],
+				fill(n, sizes[i][0], sizes[i][1]));
+			fflush(stdout);
+			store_fini();
+		}
+	}
+	trans_fini();
+	return 0;
+}
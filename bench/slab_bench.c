@@ -0,0 +1,133 @@
+/*
+ * Slab allocation against plain malloc().
+ *
+ * For each type of object allocated from slabs, and for 1, 2, 4, ... up
+ * to the given number of threads, each thread keeps a window of objects
+ * allocated and, over and over, frees one at random and allocates
+ * another in its place, as the store does with its versions and keys.
+ * Every other round, a thread frees the objects its neighbour allocated
+ * instead of its own, so that objects also move between threads.
+ * Prints the nanoseconds per allocation and free, with malloc() and
+ * with slab_alloc(), and the slab counters at the end.
+ *
+ * Usage: slab_bench [max_threads [window [rounds]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "csapp.h"
+#include "bench.h"
+
+static int window = 1000;
+static int rounds = 2000;
+static pthread_barrier_t barrier;
+
+typedef struct worker {
+	pthread_t tid;
+	int id;
+	int slab;                   // Allocate from slabs, rather than malloc()
+	SLAB_TYPE type;
+	size_t size;
+	void **objs;                // The window
+	void **incoming;            // The window passed on by the previous worker
+	struct worker *neighbour;
+	double ns;
+} WORKER;
+
+static void *alloc_one(WORKER *w){
+	return w->slab ? slab_alloc(w->type) : malloc(w->size);
+}
+
+static void free_one(WORKER *w, void *p){
+	if(w->slab){
+		slab_free(w->type, p);
+	}
+	else{
+		free(p);
+	}
+}
+
+static void *worker_thread(void *arg){
+	WORKER *w = arg;
+	unsigned long state = BENCH_SEED + w->id;
+	double t0;
+	for(int i = 0; i < window; i++){
+		w->objs[i] = alloc_one(w);
+	}
+	pthread_barrier_wait(&barrier);
+	t0 = now_ns();
+	for(int r = 0; r < rounds; r++){
+		for(int i = 0; i < window; i++){
+			int j = xorshift(&state) % window;
+			free_one(w, w->objs[j]);
+			w->objs[j] = alloc_one(w);
+			//touch it, as its user would
+			*(long *)w->objs[j] = r;
+		}
+		//pass the window on to the neighbour, once it is done with its own
+		if(r % 2 == 0){
+			pthread_barrier_wait(&barrier);
+			w->neighbour->incoming = w->objs;
+			pthread_barrier_wait(&barrier);
+			w->objs = w->incoming;
+		}
+	}
+	w->ns = now_ns() - t0;
+	for(int i = 0; i < window; i++){
+		free_one(w, w->objs[i]);
+	}
+	return NULL;
+}
+
+/*
+ * @return  Nanoseconds per allocation and free.
+ */
+static double run(int nthreads, SLAB_TYPE type, size_t size, int slab){
+	WORKER *workers = calloc(nthreads, sizeof(WORKER));
+	double ns = 0;
+	pthread_barrier_init(&barrier, NULL, nthreads);
+	for(int i = 0; i < nthreads; i++){
+		workers[i].id = i;
+		workers[i].slab = slab;
+		workers[i].type = type;
+		workers[i].size = size;
+		workers[i].objs = malloc(window * sizeof(void *));
+		workers[i].neighbour = &workers[(i + 1) % nthreads];
+	}
+	for(int i = 0; i < nthreads; i++){
+		Pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+	}
+	for(int i = 0; i < nthreads; i++){
+		Pthread_join(workers[i].tid, NULL);
+		ns += workers[i].ns;
+	}
+	pthread_barrier_destroy(&barrier);
+	for(int i = 0; i < nthreads; i++){
+		free(workers[i].objs);
+	}
+	free(workers);
+	return ns / ((double)nthreads * rounds * window);
+}
+
+int main(int argc, char *argv[]){
+	int max = argc > 1 ? atoi(argv[1]) : 8;
+	SLAB_STATS st;
+	double plain, slab;
+	if(argc > 2)
+		window = atoi(argv[2]);
+	if(argc > 3)
+		rounds = atoi(argv[3]);
+	printf("%12s %6s %8s %10s %10s %8s\n", "type", "size", "threads", "malloc_ns", "slab_ns", "speedup");
+	for(int type = 0; type < SLAB_NTYPES; type++){
+		slab_stats(type, &st);
+		for(int n = 1; n <= max; n *= 2){
+			plain = run(n, type, st.size, 0);
+			slab = run(n, type, st.size, 1);
+			printf("%12s %6zu %8d %10.1f %10.1f %8.2f\n", st.name, st.size, n, plain, slab, plain / slab);
+			fflush(stdout);
+		}
+	}
+	printf("\n");
+	slab_show();
+	return 0;
+}
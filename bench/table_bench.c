@@ -0,0 +1,116 @@
+/*
+ * Chained against open-addressing table: insert and lookup cost against
+ * the number of keys.
+ *
+ * For each store size (1k, 10k, ... up to the given maximum) and each
+ * table, fills an empty store with that many committed keys and then
+ * times lookups of random existing keys (hits) and of keys that are not
+ * there (misses) through the lock-free lookup, and whole GETs of random
+ * existing keys.  Keys for the lookups are made beforehand, so that the
+ * times are the table's alone.
+ *
+ * Usage: table_bench [max_keys [lookups]]
+ */
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "map.h"
+#include "epoch.h"
+#include "bench.h"
+
+static KEY *make_key(const char *prefix, unsigned long i){
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%s%lu", prefix, i);
+	return key_create(blob_create(buf, len));
+}
+
+/*
+ * Fill the store with n committed keys, all sharing one value.
+ *
+ * @return  Nanoseconds per key.
+ */
+static double fill(unsigned long n){
+	TRANSACTION *tp = trans_create();
+	BLOB *value = blob_create("value", 5);
+	double t0 = now_ns();
+	for(unsigned long i = 0; i < n; i++){
+		store_put(tp, make_key("key", i), blob_ref(value, "fill"));
+	}
+	t0 = now_ns() - t0;
+	blob_unref(value, "fill");
+	trans_commit(tp);
+	return t0 / n;
+}
+
+/*
+ * @return  Nanoseconds per lock-free lookup of the given keys.
+ */
+static double lookup(KEY **keys, int n){
+	unsigned long found = 0;
+	double t0 = now_ns();
+	epoch_enter();
+	for(int i = 0; i < n; i++){
+		found += map_find_entry(keys[i]) != NULL;
+	}
+	epoch_exit();
+	t0 = now_ns() - t0;
+	//keep the loop from being optimized away
+	if(found > (unsigned long)n)
+		abort();
+	return t0 / n;
+}
+
+/*
+ * @return  Nanoseconds per GET of random existing keys, in one
+ *   transaction.
+ */
+static double get(unsigned long n, int lookups){
+	TRANSACTION *tp = trans_create();
+	BLOB *value;
+	double total = 0, t0;
+	for(int i = 0; i < lookups; i++){
+		KEY *kp = make_key("key", next_random() % n);
+		t0 = now_ns();
+		store_get(tp, kp, &value);
+		total += now_ns() - t0;
+		blob_unref(value, "get");
+	}
+	trans_commit(tp);
+	return total / lookups;
+}
+
+int main(int argc, char *argv[]){
+	unsigned long max = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	int lookups = argc > 2 ? atoi(argv[2]) : 200000;
+	KEY **hits = malloc(lookups * sizeof(KEY *)), **misses = malloc(lookups * sizeof(KEY *));
+	static const char *names[] = { "chained", "open" };
+	trans_init();
+	printf("%10s %8s %10s %10s %10s %10s\n", "keys", "table", "insert_ns", "hit_ns", "miss_ns", "get_ns");
+	for(unsigned long n = 1000; n <= max; n *= 10){
+		for(int i = 0; i < lookups; i++){
+			hits[i] = make_key("key", next_random() % n);
+			misses[i] = make_key("absent", next_random() % n);
+		}
+		for(int table = TABLE_CHAINED; table <= TABLE_OPEN; table++){
+			double insert, hit, miss;
+			server_config.table = table;
+			store_init();
+			insert = fill(n);
+			hit = lookup(hits, lookups);
+			miss = lookup(misses, lookups);
+			printf("%10lu %8s %10.0f %10.1f %10.1f %10.0f\n", n, names[table],
+				insert, hit, miss, get(n, lookups));
+			fflush(stdout);
+			store_fini();
+		}
+		for(int i = 0; i < lookups; i++){
+			key_dispose(hits[i]);
+			key_dispose(misses[i]);
+		}
+	}
+	trans_fini();
+	free(hits);
+	free(misses);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Cost of operations on one hot key against the number of transactions
+ * with a version of it pending.
+ *
+ * For each count (1, 10, 100, ... up to the given maximum), that many
+ * transactions each put the key, one after the other, and none of them
+ * finishes.  Then the newest of them puts the key again and gets it,
+ * over and over, and a new transaction puts it once more.  All of them
+ * are then aborted and the store starts afresh.  Columns:
+ *
+ *   append_ns    Mean time of the puts that built up the pending versions
+ *   put_ns       Put by the newest transaction, replacing its own version
+ *   get_ns       Get by the newest transaction
+ *   newest_ns    Put by yet another transaction, at the end of the line
+ *
+ * Usage: version_bench [max_pending [rounds]]
+ */
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "bench.h"
+
+static KEY *hot_key(void){
+	return key_create(blob_create("hot", 3));
+}
+
+int main(int argc, char *argv[]){
+	int max = argc > 1 ? atoi(argv[1]) : 10000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 100000;
+	TRANSACTION **pending = malloc((max + 1) * sizeof(TRANSACTION *));
+	BLOB *value = blob_create("value", 5), *got;
+	trans_init();
+	printf("%10s %10s %10s %10s %10s\n", "pending", "append_ns", "put_ns", "get_ns", "newest_ns");
+	for(int n = 1; n <= max; n *= 10){
+		double t0, append, put, get, newest;
+		store_init();
+		t0 = now_ns();
+		for(int i = 0; i < n; i++){
+			pending[i] = trans_create();
+			store_put(pending[i], hot_key(), blob_ref(value, "append"));
+		}
+		append = (now_ns() - t0) / n;
+		t0 = now_ns();
+		for(int r = 0; r < rounds; r++){
+			store_put(pending[n - 1], hot_key(), blob_ref(value, "put"));
+		}
+		put = (now_ns() - t0) / rounds;
+		t0 = now_ns();
+		for(int r = 0; r < rounds; r++){
+			store_get(pending[n - 1], hot_key(), &got);
+			blob_unref(got, "get");
+		}
+		get = (now_ns() - t0) / rounds;
+		pending[n] = trans_create();
+		t0 = now_ns();
+		store_put(pending[n], hot_key(), blob_ref(value, "newest"));
+		newest = now_ns() - t0;
+		if(trans_get_status(pending[n - 1]) != TRANS_PENDING){
+			fprintf(stderr, "a pending transaction was aborted\n");
+			return 1;
+		}
+		printf("%10d %10.0f %10.0f %10.0f %10.0f\n", n, append, put, get, newest);
+		fflush(stdout);
+		for(int i = n; i >= 0; i--){
+			trans_abort(pending[i]);
+		}
+		store_fini();
+	}
+	blob_unref(value, "bench");
+	trans_fini();
+	free(pending);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Bump allocation of request-scoped scratch.
+ *
+ * A connection keeps an arena for whatever it needs only while one
+ * request is being handled: the keys it looks up and the arrays of a
+ * batch.  Allocation moves a pointer along the arena's block; nothing
+ * is freed on its own, and arena_reset() gives everything back at once
+ * when the request is done.  A request that needs more than the block
+ * holds gets extra blocks from malloc(), and the reset then replaces the
+ * block with one large enough for that (up to ARENA_KEEP_MAX bytes), so
+ * that a connection settles into never calling malloc() at all.
+ *
+ * Anything that outlives the request, such as a key that the store
+ * keeps, must be copied out of the arena.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "data.h"
+
+#define ARENA_BLOCK 4096        // Starting size of an arena's block
+#define ARENA_KEEP_MAX 65536    // Largest block kept across a reset
+
+/*
+ * A block from malloc() that did not fit in the arena's own.
+ */
+typedef struct arena_extra {
+	struct arena_extra *next;
+	char data[];
+} ARENA_EXTRA;
+
+typedef struct arena {
+	char *block;
+	size_t size;                // Of the block
+	size_t used;                // Of the block
+	ARENA_EXTRA *extra;         // Blocks allocated since the last reset
+	size_t peak;                // Bytes asked for since the last reset
+} ARENA;
+
+/*
+ * Set up an empty arena.
+ *
+ * @param ap  The arena.
+ */
+void arena_init(ARENA *ap);
+
+/*
+ * Release all the storage held by an arena.
+ *
+ * @param ap  The arena.
+ */
+void arena_fini(ARENA *ap);
+
+/*
+ * Allocate storage that lasts until the next reset, aligned for any
+ * type.
+ *
+ * @param ap  The arena.
+ * @param size  Bytes wanted.
+ * @return  The storage, which is uninitialized.
+ */
+void *arena_alloc(ARENA *ap, size_t size);
+
+/*
+ * Give back everything allocated from an arena.
+ *
+ * @param ap  The arena.
+ */
+void arena_reset(ARENA *ap);
+
+/*
+ * Make a key of a copy of some content, with the key, its blob and the
+ * copy all in an arena: a key_view() of content that has to outlast the
+ * buffer it came in.  Such a key may only be passed where a key is
+ * borrowed, not inherited, and must not be disposed of.
+ *
+ * @param ap  The arena.
+ * @param content  The content.
+ * @param size  Its size in bytes.
+ * @return  The key.
+ */
+KEY *arena_key(ARENA *ap, char *content, size_t size);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Server configuration, filled in by option processing in main().
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+ * How client connections are serviced.
+ *
+ *   SERVER_THREAD:  One detached thread per accepted connection, running
+ *                   xacto_client_service() (the original model).
+ *   SERVER_POOL:    A pre-spawned pool of workers, each servicing one
+ *                   connection at a time, fed by the accepting thread.
+ *   SERVER_EVENT:   A small fixed set of epoll loops, each multiplexing
+ *                   many non-blocking connections.
+ */
+typedef enum { SERVER_THREAD, SERVER_POOL, SERVER_EVENT } SERVER_MODE;
+
+/*
+ * How the store's hash table is laid out.
+ *
+ *   TABLE_CHAINED:  Buckets of linked map entries (see map.h).
+ *   TABLE_OPEN:     Open addressing with a control byte per slot,
+ *                   probed a group at a time (see optable.h).
+ */
+typedef enum { TABLE_CHAINED, TABLE_OPEN } TABLE_KIND;
+
+typedef struct server_config {
+    SERVER_MODE mode;       // Connection servicing model.
+    int nthreads;           // Pool workers or event loops (0 means one per core).
+    int uring;              // Send replies through io_uring (pool and event modes), and
+                            // receive requests through it (event mode).
+    int listeners;          // SO_REUSEPORT listeners with their own accept threads (0 means
+                            // the single accept loop in main()).
+    int pin;                // Pin accept threads to cores.
+    int persist;            // Keep connections open for further transactions.
+    int buckets;            // Starting size of the store's hash table.
+    int stripes;            // Lock stripes for the store (0 means a single lock).
+    TABLE_KIND table;       // Layout of the store's hash table.
+    int sweep;              // Microseconds of background garbage collection per sweeper
+                            // wakeup (0 means no sweeper, operations collect every time).
+    int hugepages;          // Map the slabs of small objects with huge pages.
+    int lockstats;          // Time how long the store's locks are held.
+} SERVER_CONFIG;
+
+/*
+ * The configuration in effect for this server.
+ */
+extern SERVER_CONFIG server_config;
+
+#endif
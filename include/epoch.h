@@ -0,0 +1,105 @@
+/*
+ * Epoch-based reclamation, for data that is read without locks.
+ *
+ * A reader brackets its lock-free traversal with epoch_enter() and
+ * epoch_exit().  A writer that unlinks an object a reader might still be
+ * looking at hands it to epoch_defer() instead of freeing it; the object
+ * is freed once every thread that was inside a read section at the time
+ * has left it.
+ *
+ * There is a global epoch counter.  Each thread announces the epoch it
+ * saw on entering a read section, and objects are filed under the epoch
+ * in which they were unlinked.  The global epoch only moves on when every
+ * thread that is reading has seen the current one, so objects unlinked
+ * in epoch e cannot be seen by anyone once the global epoch is e + 2.
+ * Reclamation is done by the thread that deferred the objects, every
+ * EPOCH_BATCH deferrals, with no lock taken.
+ *
+ * Freeing can take a while (a large value, a transaction with a long
+ * dependency list), so it is kept out of critical sections: a thread
+ * brackets its work under locks with epoch_hold() and epoch_unhold(), and
+ * in between nothing is freed on it.  Reclamation that falls due waits
+ * for the unhold, and so do objects handed to epoch_retire(), which need
+ * no grace period but should not be freed with a lock held.  The unhold
+ * then frees them all in one batch.
+ *
+ * Pointers that lock-free readers follow must be written with
+ * SHARED_STORE() and read with SHARED_LOAD(); writers holding the lock
+ * that guards them may still read them directly.
+ */
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#define EPOCH_BATCH 64         // Deferrals between attempts to reclaim
+
+#define SHARED_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_SEQ_CST)
+#define SHARED_LOAD(p) __atomic_load_n(&(p), __ATOMIC_SEQ_CST)
+
+/*
+ * Set up the global epoch.  Must be called before any other epoch
+ * function.
+ */
+void epoch_init(void);
+
+/*
+ * Free everything still waiting to be reclaimed.  No thread may be in a
+ * read section.
+ */
+void epoch_fini(void);
+
+/*
+ * Enter a read section on the calling thread.  Read sections do not nest.
+ */
+void epoch_enter(void);
+
+/*
+ * Leave the read section entered by epoch_enter().
+ */
+void epoch_exit(void);
+
+/*
+ * Arrange for an object to be freed once no reader can still see it.
+ * The object must already be unreachable for new readers.
+ *
+ * @param fn  The function that frees it.
+ * @param arg  The object.
+ */
+void epoch_defer(void (*fn)(void *), void *arg);
+
+/*
+ * Free what the calling thread has deferred and no reader can still see,
+ * without waiting for EPOCH_BATCH more deferrals.  For threads that defer
+ * in bursts and then go quiet; it takes two calls, with the readers of
+ * the time gone in between, for all of a burst to go.
+ */
+void epoch_poll(void);
+
+/*
+ * Start a stretch of work under locks on the calling thread: until the
+ * matching epoch_unhold(), nothing is freed on it.  Holds nest.
+ */
+void epoch_hold(void);
+
+/*
+ * End the stretch started by epoch_hold(), and once out of the outermost
+ * one, free what was put off during it.  Must be called with the locks
+ * let go.
+ */
+void epoch_unhold(void);
+
+/*
+ * Arrange for an object that no reader can see to be freed as soon as
+ * the calling thread is out of its holds: straight away, if it is in
+ * none.
+ *
+ * @param fn  The function that frees it.
+ * @param arg  The object.
+ */
+void epoch_retire(void (*fn)(void *), void *arg);
+
+/*
+ * Print the reclamation counters to stderr.
+ */
+void epoch_show(void);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Event-driven connection servicing.
+ *
+ * Instead of dedicating a thread to every client, a small fixed set of
+ * epoll loops multiplex all connections.  Each connection is non-blocking
+ * and its PUT/GET/COMMIT handling is driven as a state machine by whatever
+ * bytes have arrived, so an idle client costs a small CONN structure and
+ * no thread or stack.
+ */
+#ifndef EVENT_H
+#define EVENT_H
+
+/*
+ * Start the event loops.
+ *
+ * @param nloops  Number of loop threads to start (0 means one per core).
+ */
+void event_init(int nloops);
+
+/*
+ * Hand a newly accepted connection to one of the event loops.
+ * The loop takes over the file descriptor and registers it with the
+ * client registry; transactions are created by the first request
+ * that needs one.
+ *
+ * @param connfd  The connected file descriptor.
+ */
+void event_dispatch(int connfd);
+
+/*
+ * Stop the event loops and wait for their threads to exit.
+ * Should only be called once all client connections have been shut down.
+ */
+void event_fini(void);
+
+#endif
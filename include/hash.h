@@ -0,0 +1,46 @@
+/*
+ * Hashing and comparison of key bytes.
+ *
+ * hash_bytes() is a seeded 64-bit hash in the style of wyhash: it reads
+ * the whole key, eight or sixteen bytes at a time, whatever they are
+ * (NUL bytes included), and folds them together with 64x64->128-bit
+ * multiplies.  The seed is drawn from the kernel on first use, so that
+ * nobody can work out ahead of time which keys will collide.
+ *
+ * bytes_equal() compares two byte strings of the same length for
+ * equality, sixteen bytes at a time with SSE2 where it is available.
+ */
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Set the seed instead of drawing a random one, for reproducible runs.
+ * Must be called before the first hash.
+ *
+ * @param seed  The seed.
+ */
+void hash_seed(uint64_t seed);
+
+/*
+ * Hash a string of bytes.
+ *
+ * @param data  The bytes (may be NULL if len is 0).
+ * @param len  Their number.
+ * @return  The hash.
+ */
+uint64_t hash_bytes(const void *data, size_t len);
+
+/*
+ * Compare two strings of bytes of the same length.
+ *
+ * @param a  The first string.
+ * @param b  The second string.
+ * @param len  Their length.
+ * @return  Nonzero if they are equal.
+ */
+int bytes_equal(const void *a, const void *b, size_t len);
+
+#endif
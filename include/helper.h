@@ -6,13 +6,27 @@
 #include "csapp.h"
 #include "store.h"
 int string_to_int(char *string);
-unsigned long hash(void *str);
 void add_transaction_to_LL(TRANSACTION *z);
 void remove_transaction_from_LL(TRANSACTION *z);
 void trans_destroy(TRANSACTION *tp);
+extern TRANSACTION trans_committed;
 MAP_ENTRY *map_entry_create(KEY *kp);
 void map_entry_destroy(MAP_ENTRY *mp);
 MAP_ENTRY *find_map_entry(KEY *kp);
 VERSION *add_version(MAP_ENTRY *mp, TRANSACTION *tp, BLOB *value);
-void garbage_collect(MAP_ENTRY *mp);
-VERSION *remove_version_from_LL(VERSION *vp, VERSION *head);
\ No newline at end of file
+int garbage_collect(MAP_ENTRY *mp, void (*retire)(VERSION *vp));
+void remove_version_from_LL(MAP_ENTRY *mp, VERSION *vp);
+void version_retire(VERSION *vp);
+VERSION *latest_version(MAP_ENTRY *mp);
+BLOB *blob_alloc(size_t size);
+BLOB *blob_adopt(char *content, size_t size);
+void block_server_signals(void);
+void xacto_serve(int connfd);
+void xacto_dispatch(int connfd);
+void xacto_session_done(unsigned long ntrans);
+void xacto_show(void);
+TRANS_STATUS trans_commit_timed(TRANSACTION *tp, long usec);
+TRANS_STATUS store_put_borrowed(TRANSACTION *tp, KEY *key, BLOB *value);
+TRANS_STATUS store_get_borrowed(TRANSACTION *tp, KEY *key, BLOB **valuep);
+TRANS_STATUS store_put_multi(TRANSACTION *tp, KEY **keys, BLOB **values, int n);
+TRANS_STATUS store_get_multi(TRANSACTION *tp, KEY **keys, BLOB **values, int n);
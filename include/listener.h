@@ -0,0 +1,34 @@
+/*
+ * Sharded accept.
+ *
+ * Opens several listening sockets on the same port with SO_REUSEPORT,
+ * each with its own accept thread, so that the kernel spreads incoming
+ * connections across them instead of funnelling every connection through
+ * a single accept loop.  Accept threads may be pinned to cores.
+ */
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * Open the listening sockets and start their accept threads.
+ * Accepted connections are handed to xacto_dispatch().
+ *
+ * @param port  The port to listen on.
+ * @param nlisteners  Number of listening sockets and accept threads.
+ * @param pin  Nonzero to pin accept thread i to core i (modulo the
+ *   number of cores).
+ */
+void listener_start(char *port, int nlisteners, int pin);
+
+/*
+ * Close the listening sockets and wait for the accept threads to exit.
+ * The listeners themselves are kept, for the counts in the final report.
+ */
+void listener_stop(void);
+
+/*
+ * Print per-listener accept counts and rates to stderr.
+ */
+void listener_show(void);
+
+#endif
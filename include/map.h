@@ -0,0 +1,237 @@
+/*
+ * Resizable, lock-striped hash table behind the store.
+ *
+ * The table of map entries (the_map, see store.h) starts with a size set
+ * at startup and then doubles when there are more entries than buckets,
+ * and halves when there are fewer than one per MAP_SHRINK_RATIO buckets
+ * (but never below the starting size).  A resize does not move every
+ * entry at once: the old table is kept, and each operation on the map
+ * moves a few of its buckets over, so that no single request pays for a
+ * whole rehash.  A lookup moves the key's old bucket first.
+ *
+ * Instead of one lock for the whole map, buckets are guarded by a fixed
+ * set of lock stripes, and each map entry has a lock of its own for its
+ * version list, so that operations on unrelated keys do not wait for
+ * each other.  A stripe is only held while a key is looked up; the
+ * version list is then worked on under the entry's lock alone.  Swapping
+ * tables at the start and end of a resize excludes all operations
+ * through a reader/writer lock.  With no stripes, the map mutex guards
+ * everything, as it did before.
+ *
+ * A group of operations is bracketed by map_begin() and map_end(); each
+ * operation takes the entry for its key with map_lock_entry() and gives
+ * it back with map_unlock_entry().
+ *
+ * Chains and version lists can also be walked with no lock at all, from
+ * inside an epoch read section (see epoch.h): entries and tables that
+ * are dropped are freed through epoch_defer(), and a reader that runs
+ * into a resize swapping tables just gives up.
+ *
+ * The chained table can be swapped for the open-addressing table in
+ * optable.h, behind the same functions.
+ *
+ * A group of operations is also an epoch hold (see epoch.h): what its
+ * operations throw away is freed at map_end(), with the locks let go.
+ * With server_config.lockstats set, the time each entry lock is held
+ * (or, with no stripes, the map mutex) goes into a histogram, see
+ * map_hold_times().
+ */
+#ifndef MAP_H
+#define MAP_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "store.h"
+#include "config.h"
+
+#define MAP_REHASH_STEP 4      // Old buckets moved per operation during a resize
+#define MAP_SHRINK_RATIO 8     // Shrink below one entry per this many buckets
+#define MAP_SLOT_KEY_MAX 32    // Longest key whose entry comes from a slab
+#define MAP_HOLD_BUCKETS 32    // Powers of two of nanoseconds in the lock histogram
+
+/*
+ * A map entry together with the lock for its version list.  MAP_ENTRY
+ * is fixed by store.h, so the lock lives next to it rather than in it,
+ * and so does the tail of the version list, which is linked both ways
+ * through the versions' next and prev pointers.  The latest version is
+ * therefore the tail, and (after garbage_collect()) the only committed
+ * version, if there is one, is the head.
+ *
+ * The entry's key, its blob and the key bytes live at the end of the
+ * same allocation, so an entry is a single block of memory.  The key's
+ * blob belongs to the entry and is never referenced or unreferenced, so
+ * the mutex it has for its reference count is free to serve as the lock
+ * for the version list.  Entries with keys of up to MAP_SLOT_KEY_MAX
+ * bytes all have the same size, and are allocated from a slab.
+ */
+typedef struct map_slot {
+	MAP_ENTRY entry;            // Must come first
+	VERSION *tail;              // Latest version, or NULL
+	unsigned int nversions;     // Length of the version list
+	atomic_uint reader;         // Highest ID of a transaction that read the
+	                            // committed value without the lock
+	KEY key;                    // What entry.key points to
+	BLOB key_blob;              // Its blob, whose mutex guards entry.versions
+	                            // and tail
+	char key_bytes[];           // Its content, with a null terminator
+} MAP_SLOT;
+
+#define SLOT(mp) ((MAP_SLOT *)(mp))
+#define SLOT_LOCK(mp) (&SLOT(mp)->key_blob.mutex)
+
+/*
+ * A key borrowed for a lookup: the key and its blob, to be set up by
+ * key_view() wherever the caller keeps them (on its stack, normally),
+ * around content that stays where it is.  The lookup functions only
+ * borrow their keys, and a new entry takes a copy, so a view can be
+ * passed to them, but never to anything that inherits its key.
+ */
+typedef struct key_view {
+	KEY key;
+	BLOB blob;                  // Its mutex is unused
+} KEY_VIEW;
+
+/*
+ * Position of map_sweep() in the table: the shard (of the open-addressing
+ * table, always 0 for the chained table) and the bucket or slot in it.
+ */
+typedef struct map_cursor {
+	size_t shard;
+	size_t pos;
+} MAP_CURSOR;
+
+/*
+ * Make a view of some content as a key, without copying it.
+ *
+ * @param vp  Storage for the view.
+ * @param content  The content, which must remain valid, and unchanged,
+ *   for as long as the key is used.
+ * @param size  Its size in bytes.
+ * @return  The key.
+ */
+KEY *key_view(KEY_VIEW *vp, char *content, size_t size);
+
+/*
+ * Set up an empty table.
+ *
+ * @param buckets  Starting number of buckets, rounded up to a power of
+ *   two (and to at least NUM_BUCKETS and the number of stripes).
+ * @param stripes  Number of lock stripes, rounded up to a power of two,
+ *   or 0 to guard the whole map with the map mutex.
+ * @param table  Which kind of table to keep the entries in.
+ */
+void map_init(size_t buckets, int stripes, TABLE_KIND table);
+
+/*
+ * Destroy every map entry and free the table.
+ */
+void map_fini(void);
+
+/*
+ * Begin a group of map operations.  Nothing is locked against other
+ * groups, except in an unstriped map, which is locked as a whole.
+ */
+void map_begin(void);
+
+/*
+ * End a group of map operations, seeing to a resize if one is due.
+ */
+void map_end(void);
+
+/*
+ * Find the entry for a key, creating it if there is none, and lock its
+ * version list.  Must be called between map_begin() and map_end().
+ *
+ * @param kp  The key, which is not inherited: a new entry gets a copy.
+ * @return  The entry, locked.
+ */
+MAP_ENTRY *map_lock_entry(KEY *kp);
+
+/*
+ * Unlock the version list of an entry locked by map_lock_entry().
+ *
+ * @param mp  The entry.
+ */
+void map_unlock_entry(MAP_ENTRY *mp);
+
+/*
+ * Find the entry for a key without taking any lock.  Must be called in
+ * an epoch read section, and the entry may only be used until the end
+ * of it.  An entry that is moving between tables may be missed.
+ *
+ * @param kp  The key, which is not inherited.
+ * @return  The entry, or NULL if none was found.
+ */
+MAP_ENTRY *map_find_entry(KEY *kp);
+
+/*
+ * Record that a transaction read the committed value of an entry
+ * without its lock.  A transaction with a lower ID that then tries to
+ * write the entry must abort, just as if it had found a version of the
+ * reader's in the way.
+ *
+ * @param mp  The entry, found by map_find_entry().
+ * @param tp  The reading transaction.
+ */
+void map_note_reader(MAP_ENTRY *mp, TRANSACTION *tp);
+
+/*
+ * @param mp  An entry.
+ * @return  The highest ID passed to map_note_reader() for it, or 0.
+ */
+unsigned int map_last_reader(MAP_ENTRY *mp);
+
+/*
+ * Report whether an entry has no versions and nobody is working on it,
+ * so that it can be dropped from the table.  The caller must hold the
+ * entry's stripe.
+ *
+ * @param mp  The entry.
+ * @return  Nonzero if the entry is unused.
+ */
+int map_entry_unused(MAP_ENTRY *mp);
+
+/*
+ * Destroy an entry that has been unlinked from the table, once no
+ * lock-free reader can still be looking at it.
+ *
+ * @param mp  The entry.
+ */
+void map_entry_retire(MAP_ENTRY *mp);
+
+/*
+ * Visit a few of the entries in the table, carrying on from where the
+ * last call left off, and run a function on each one, with its version
+ * list locked.  Entries that someone else has locked are passed over.
+ * Entries of the chained table that have no versions left afterwards
+ * are dropped, as they are when a lookup passes them.  Entries that are
+ * moving between tables in a resize may be missed.
+ *
+ * @param cursor  Where to carry on from, zeroed to start at the
+ *   beginning; updated.
+ * @param n  How many buckets (or open-addressed slots) to look at.
+ * @param fn  The function.
+ * @return  Nonzero if the end of the table was reached, in which case
+ *   the cursor is back at the beginning.
+ */
+int map_sweep(MAP_CURSOR *cursor, size_t n, void (*fn)(MAP_ENTRY *mp));
+
+/*
+ * Read the histogram of lock hold times, kept since map_init() while
+ * server_config.lockstats is set.
+ *
+ * @param counts  Array of MAP_HOLD_BUCKETS counters, into which the
+ *   number of times a lock was held for at least 2^i and under 2^(i+1)
+ *   nanoseconds is stored at index i; the last one counts all longer
+ *   times as well.
+ * @return  The total number of times.
+ */
+unsigned long map_hold_times(unsigned long counts[MAP_HOLD_BUCKETS]);
+
+/*
+ * Print the size and load of the table to stderr.
+ * No locking is performed, so the figures may be slightly stale.
+ */
+void map_show(void);
+
+#endif
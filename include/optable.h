@@ -0,0 +1,88 @@
+/*
+ * Open-addressing table of map entries, an alternative to the chained
+ * table in map.c (see server_config.table).
+ *
+ * The table is split into shards, one per lock stripe, picked by the
+ * same bits of the key hash as the stripe, so a stripe guards its shard
+ * the way it guards its buckets in the chained table.  Each shard is a
+ * power-of-two number of groups of OPTABLE_GROUP slots.  A slot holds
+ * the entry pointer together with the key's hash and length, and a
+ * separate control array holds one byte per slot: 7 bits of a remixed
+ * hash for a full slot, or OPTABLE_EMPTY.  A lookup compares a whole
+ * group of control bytes against the tag at once (with SSE2 where it is
+ * available) and only looks at slots whose tag matches, and then only
+ * follows the entry's key if the hash and length match as well.  Groups
+ * are probed triangularly until one with an empty slot turns up.
+ *
+ * Entries are never removed in place.  A shard is rebuilt into a new
+ * table once it is OPTABLE_MAX_LOAD eighths full, and entries with no
+ * versions that nobody is using are dropped then.  The new table is
+ * sized for a load of at most half of that, and never smaller than
+ * the starting size, so a shard that has emptied out shrinks at its
+ * next rebuild.  Rebuilds move only pointers, and the old table and
+ * dropped entries are freed through epoch_defer(), so lookups need no
+ * lock.
+ */
+#ifndef OPTABLE_H
+#define OPTABLE_H
+
+#include <stddef.h>
+#include "store.h"
+
+#define OPTABLE_GROUP 16       // Slots probed together
+#define OPTABLE_EMPTY 0x80     // Control byte of an empty slot
+#define OPTABLE_MAX_LOAD 7     // Rebuild when this many eighths full
+
+/*
+ * Set up empty shards.
+ *
+ * @param slots  Starting number of slots in all, rounded up so that
+ *   every shard has a power-of-two number of groups.
+ * @param shards  Number of shards, a power of two.
+ */
+void optable_init(size_t slots, int shards);
+
+/*
+ * Destroy every map entry and free the shards.
+ */
+void optable_fini(void);
+
+/*
+ * Find the entry for a key without taking any lock.  Must be called in
+ * an epoch read section.
+ *
+ * @param kp  The key, which is not inherited.
+ * @return  The entry, or NULL.
+ */
+MAP_ENTRY *optable_find(KEY *kp);
+
+/*
+ * Find the entry for a key, creating it if there is none.  The caller
+ * must hold the key's lock stripe (or the map mutex, if the map is not
+ * striped).
+ *
+ * @param kp  The key, which is not inherited: a new entry gets a copy.
+ * @return  The entry.
+ */
+MAP_ENTRY *optable_find_or_add(KEY *kp);
+
+/*
+ * Run a function on the entries in a range of slots of one shard.  The
+ * caller must hold the shard's lock stripe (or the map mutex).
+ *
+ * @param shard  The shard.
+ * @param pos  The first slot.
+ * @param n  Number of slots.
+ * @param fn  The function.
+ * @param arg  Passed on to it.
+ * @return  The slot after the last one looked at, or 0 if that was the
+ *   end of the shard.
+ */
+size_t optable_sweep(int shard, size_t pos, size_t n, void (*fn)(MAP_ENTRY *mp, void *arg), void *arg);
+
+/*
+ * Print the size and load of the shards to stderr.
+ */
+void optable_show(void);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Pre-spawned pool of service workers.
+ *
+ * Rather than creating a detached thread for every accepted connection,
+ * the acceptor hands connections to a fixed set of workers.  Each worker
+ * owns a bounded lock-free MPMC queue; the acceptor spreads connections
+ * over the queues round-robin and a worker whose own queue is empty
+ * steals from the others.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_QUEUE_SIZE 256    // Slots per worker queue (a power of two)
+
+/*
+ * Start the worker pool.
+ *
+ * @param nworkers  Number of workers to start (0 means one per core).
+ */
+void pool_init(int nworkers);
+
+/*
+ * Hand a newly accepted connection to the pool.  Blocks while every
+ * worker queue is full.  The connection is in the client registry from
+ * here on, so a shutdown reaches it while it is still queued.
+ *
+ * @param connfd  The connected file descriptor.
+ */
+void pool_submit(int connfd);
+
+/*
+ * Stop the workers and wait for them to exit.
+ * Should only be called once all client connections have been shut down.
+ */
+void pool_fini(void);
+
+/*
+ * Print queue depth and handoff latency counters to stderr.
+ */
+void pool_show(void);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Connection-level I/O for the Xacto protocol, layered on the
+ * single-packet functions declared in protocol.h.
+ */
+#ifndef PROTO_IO_H
+#define PROTO_IO_H
+
+#include "protocol.h"
+#include "data.h"
+#include "arena.h"
+#include "csapp.h"
+
+/*
+ * Batched requests.  The header of a MULTI_GET or MULTI_PUT packet
+ * carries, as its payload, the number N of keys in the batch as a
+ * 32-bit count in network byte order.  A MULTI_GET is followed by N
+ * DATA packets holding keys, and is answered by a REPLY followed by N
+ * DATA packets holding the values (with the null flag set for keys that
+ * have no value).  A MULTI_PUT is followed by N pairs of DATA packets
+ * holding a key and its value, and is answered by a single REPLY.
+ * The whole batch runs in the connection's transaction.
+ */
+#define XACTO_MULTI_GET_PKT 6
+#define XACTO_MULTI_PUT_PKT 7
+#define XACTO_MULTI_MAX 4096        // Most keys accepted in one batch
+#define XACTO_PAYLOAD_MAX (64 << 20) // Largest payload accepted in one packet
+
+/*
+ * Count the DATA packets that follow a request header.
+ *
+ * @param pkt  The request header, with fields in host byte order.
+ * @param data  The header's payload, or NULL if there is none.
+ * @return  The number of DATA packets making up the rest of the
+ *   request, or -1 if a batch header is malformed or too large.
+ */
+int proto_request_data_packets(XACTO_PACKET *pkt, void *data);
+
+/*
+ * Buffered packet reader for one connection.
+ *
+ * Builds on the CS:APP rio_t buffer: each read() pulls in as much as the
+ * socket has ready (up to RIO_BUFSIZE bytes), and packets are then parsed
+ * out of the buffer, so a PUT that arrives in one segment costs one
+ * system call instead of six.  Payloads that fit in the buffer are
+ * returned in place; larger ones are assembled in a scratch area that is
+ * kept for reuse, so there is no per-packet allocation either way.  A
+ * packet announcing more than XACTO_PAYLOAD_MAX bytes is refused with
+ * errno set to EMSGSIZE.
+ */
+typedef struct proto_reader {
+    rio_t rio;              // Unread bytes are rio_cnt bytes at rio_bufptr.
+    char *scratch;          // Payloads too large for rio_buf.
+    size_t scratch_cap;
+} PROTO_READER;
+
+/*
+ * Associate a reader with a connection.
+ *
+ * @param rp  The reader.
+ * @param fd  The file descriptor to read packets from.
+ */
+void proto_reader_init(PROTO_READER *rp, int fd);
+
+/*
+ * Release the storage held by a reader.  The file descriptor is not
+ * closed.
+ *
+ * @param rp  The reader.
+ */
+void proto_reader_fini(PROTO_READER *rp);
+
+/*
+ * Receive a packet through a reader, blocking until a whole packet
+ * is available.  The returned structure has its multi-byte fields in
+ * host byte order.
+ *
+ * @param rp  The reader.
+ * @param pkt  Pointer to caller-supplied storage for the fixed-size
+ *   portion of the packet.
+ * @param datap  Pointer to variable into which to store a pointer to any
+ *   payload received (NULL if there is none), or NULL to discard the
+ *   payload.  The payload belongs to the reader and is only valid until
+ *   the next call; it is not NUL-terminated.
+ * @return  0 in case of successful reception, -1 otherwise.  In the
+ *   latter case, errno is set to indicate the error, or to 0 on EOF.
+ */
+int proto_read_packet(PROTO_READER *rp, XACTO_PACKET *pkt, void **datap);
+
+/*
+ * Receive a packet through a reader, with its payload in a blob of its
+ * own.  The payload is placed directly in storage that the blob adopts,
+ * so a large value goes from the socket into the blob without passing
+ * through any other buffer.
+ *
+ * @param rp  The reader.
+ * @param pkt  Pointer to caller-supplied storage for the fixed-size
+ *   portion of the packet, with multi-byte fields in host byte order.
+ * @param blobp  Pointer to variable into which to store the new blob,
+ *   which has a NULL content if the packet has no payload.  The caller
+ *   is responsible for its reference.
+ * @return  0 in case of successful reception, -1 otherwise.  In the
+ *   latter case, errno is set to indicate the error, or to 0 on EOF.
+ */
+int proto_read_blob(PROTO_READER *rp, XACTO_PACKET *pkt, BLOB **blobp);
+
+/*
+ * Receive a packet through a reader, with its payload made into a key
+ * in an arena, see arena_key().
+ *
+ * @param rp  The reader.
+ * @param pkt  Pointer to caller-supplied storage for the fixed-size
+ *   portion of the packet, with multi-byte fields in host byte order.
+ * @param ap  The arena.
+ * @param keyp  Pointer to variable into which to store the key.
+ * @return  0 in case of successful reception, -1 otherwise.  In the
+ *   latter case, errno is set to indicate the error, or to 0 on EOF.
+ */
+int proto_read_key(PROTO_READER *rp, XACTO_PACKET *pkt, ARENA *ap, KEY **keyp);
+
+/*
+ * Reports whether a whole request (a header followed by the DATA packets
+ * counted by proto_request_data_packets()) is already
+ * buffered in a reader, so that it can be handled without blocking.
+ *
+ * @param rp  The reader.
+ * @return  Nonzero if a request is ready, 0 otherwise.
+ */
+int proto_reader_pending(PROTO_READER *rp);
+
+#define PROTO_WRITER_BUFSIZE 16384  // Replies held back before a forced flush
+#define PROTO_WRITER_INLINE 4096    // Larger payloads are sent from the caller's memory
+
+/*
+ * Reply writer for one connection.
+ *
+ * Packets are assembled (headers in network byte order, small payloads
+ * copied in) into one buffer and go out together in a single sendmsg(),
+ * or a single io_uring operation when the calling thread has a ring,
+ * instead of a write() per header and per payload.  A large payload is
+ * not copied: it is sent straight away, gathered after whatever is
+ * already buffered.
+ *
+ * A corked writer also holds replies back across requests for as long
+ * as the client has further requests buffered, see proto_end_request().
+ */
+typedef struct proto_writer {
+    int fd;
+    int corked;             // Hold replies while more requests are buffered.
+    size_t len;             // Bytes in buf.
+    char buf[PROTO_WRITER_BUFSIZE];
+} PROTO_WRITER;
+
+/*
+ * Associate a writer with a connection.
+ *
+ * @param wp  The writer.
+ * @param fd  The file descriptor to send packets on.
+ * @param corked  Nonzero for a corked writer.
+ */
+void proto_writer_init(PROTO_WRITER *wp, int fd, int corked);
+
+/*
+ * Queue a packet, followed by its payload (if any), for sending.
+ *
+ * @param wp  The writer.
+ * @param pkt  The fixed-size part of the packet, with multi-byte fields
+ *   in host byte order.  It is not modified.
+ * @param data  The payload, or NULL.  It need only remain valid for the
+ *   duration of the call.
+ * @return  0 on success, -1 if a flush that had to be done failed (errno
+ *   set).
+ */
+int proto_write_packet(PROTO_WRITER *wp, XACTO_PACKET *pkt, void *data);
+
+/*
+ * Send everything queued on a writer.
+ *
+ * @param wp  The writer.
+ * @return  0 on success, -1 otherwise (errno set).
+ */
+int proto_flush(PROTO_WRITER *wp);
+
+/*
+ * Mark the end of the replies to one request.  The queued replies are
+ * flushed, unless the writer is corked and the next request is already
+ * waiting in the reader, in which case they go out with its replies.
+ *
+ * @param wp  The writer.
+ * @param rp  The reader for the same connection.
+ * @return  0 on success, -1 if a flush failed (errno set).
+ */
+int proto_end_request(PROTO_WRITER *wp, PROTO_READER *rp);
+
+#endif
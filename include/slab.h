@@ -0,0 +1,80 @@
+/*
+ * Slab allocation of the store's small fixed-size objects.
+ *
+ * Each type of object has its own slabs: chunks of SLAB_CHUNK bytes,
+ * mapped as needed and carved into objects of the type's size, which
+ * are never given back to the system, only reused.  Every thread keeps
+ * a cache of free objects of each type, so that an allocation or free
+ * is normally a push or pop on that cache, with no lock.  A cache that
+ * runs dry takes a magazine of SLAB_MAGAZINE objects from the type's
+ * depot, or carves one from the current slab; a cache that fills up
+ * gives a magazine back to the depot.  Objects freed by one thread and
+ * allocated by another thus make their way back through the depot a
+ * magazine at a time.  A thread that exits gives all of its cache to the
+ * depot.
+ *
+ * With server_config.hugepages set, slabs are mapped with huge pages,
+ * or failing that are advised to be.
+ */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_MAGAZINE 64       // Objects moved between a thread and the depot at a time
+#define SLAB_CHUNK (2 << 20)   // Bytes mapped at a time for a type
+
+/*
+ * The types of object allocated from slabs.
+ */
+typedef enum {
+	SLAB_VERSION,
+	SLAB_KEY,
+	SLAB_DEPENDENCY,
+	SLAB_TRANSACTION,
+	SLAB_ENTRY,                 // Map entries with short keys, see MAP_SLOT_KEY_MAX
+	SLAB_NTYPES
+} SLAB_TYPE;
+
+/*
+ * Counters for one type, as of some moment while they were read:
+ * threads that are allocating may move objects from one to the other.
+ */
+typedef struct slab_stats {
+	const char *name;
+	size_t size;                // Bytes per object
+	unsigned long live;         // Allocated and not yet freed
+	unsigned long free;         // Carved out of a slab and waiting to be reused
+	size_t mapped;              // Bytes of slabs mapped
+} SLAB_STATS;
+
+/*
+ * Allocate an object of a given type.  The object is uninitialized.
+ *
+ * @param type  The type of object.
+ * @return  The object.
+ */
+void *slab_alloc(SLAB_TYPE type);
+
+/*
+ * Free an object obtained from slab_alloc() with the same type.
+ *
+ * @param type  The type of object.
+ * @param p  The object.
+ */
+void slab_free(SLAB_TYPE type, void *p);
+
+/*
+ * Read the counters for a type.
+ *
+ * @param type  The type of object.
+ * @param sp  Where to put them.
+ */
+void slab_stats(SLAB_TYPE type, SLAB_STATS *sp);
+
+/*
+ * Print the counters for every type to stderr.
+ */
+void slab_show(void);
+
+#endif
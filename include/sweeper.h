@@ -0,0 +1,42 @@
+/*
+ * Background garbage collection of version lists.
+ *
+ * A sweeper thread wakes up every SWEEP_INTERVAL_MS milliseconds and
+ * spends up to a set budget of time going through the store's entries,
+ * SWEEP_STEP buckets (or open-addressed slots) at a time, throwing away
+ * the versions that nobody can see any more: committed versions that
+ * have been superseded, and aborted ones.  Each wakeup picks up where
+ * the last one left off, so a pass over the whole table may take many
+ * of them.  Entries left with no versions are dropped, so that keys that
+ * are no longer used do not hold on to their versions, and to the
+ * transactions that created them, forever.
+ *
+ * While the sweeper runs, operations only collect an entry themselves
+ * when its version list is longer than SWEEP_THRESHOLD, or when its
+ * latest version has been aborted (which would abort them too).
+ */
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#define SWEEP_INTERVAL_MS 100  // Time between wakeups
+#define SWEEP_STEP 16          // Buckets swept with the map locked at a time
+#define SWEEP_THRESHOLD 8      // Versions an entry may have before operations collect it
+
+/*
+ * Start the sweeper thread.
+ *
+ * @param budget  Microseconds of sweeping per wakeup.
+ */
+void sweeper_start(int budget);
+
+/*
+ * Stop the sweeper thread and wait for it to exit.
+ */
+void sweeper_stop(void);
+
+/*
+ * Print what the sweeper has reclaimed to stderr.
+ */
+void sweeper_show(void);
+
+#endif
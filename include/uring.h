@@ -0,0 +1,105 @@
+/*
+ * Minimal io_uring backend for socket sends and receives.
+ *
+ * A ring collects any number of sends (each a gather list that is written
+ * as one operation) and receives, and then submits them all and reaps
+ * their completions with a single io_uring_enter() call.  Small sends are copied into
+ * buffers registered with the kernel and issued as fixed-buffer writes,
+ * which saves pinning and unpinning user pages on every operation; larger
+ * sends are issued as vectored writes straight from the caller's memory.
+ *
+ * Rings belong to a thread.  Long-lived threads (pool workers and event
+ * loops) set one up with uring_thread_init(); code on any thread can then
+ * find it with uring_thread(), which returns NULL when the thread has no
+ * ring, so callers fall back to plain read()/write().
+ *
+ * Receives only pay off where many of them can go in one submission, as
+ * in an event loop with several connections readable at once.  A pool
+ * worker blocks on the one connection it serves, and a receive through
+ * its ring would cost the same system call as the read() it replaces,
+ * so the buffered reader (see proto_io.h) keeps to read().
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <sys/uio.h>
+
+#define URING_ENTRIES 64       // Sends per submission
+#define URING_BUFSIZE 512      // Size of each registered buffer
+#define URING_MAXIOV 8         // Gather list entries per send
+
+typedef struct uring URING;
+
+/*
+ * Check whether the running kernel supports io_uring.
+ *
+ * @return  0 if it does, -1 otherwise (errno is set from io_uring_setup).
+ */
+int uring_probe(void);
+
+/*
+ * Set up a ring for the calling thread.  Does nothing if the thread
+ * already has one.
+ *
+ * @return  0 if the thread has a ring, -1 if one could not be set up.
+ */
+int uring_thread_init(void);
+
+/*
+ * Tear down the calling thread's ring, if any.
+ */
+void uring_thread_fini(void);
+
+/*
+ * @return  The calling thread's ring, or NULL if it has none.
+ */
+URING *uring_thread(void);
+
+/*
+ * Queue a send of a gather list as a single write operation.
+ * The memory the list refers to must stay valid until uring_submit()
+ * returns; the list itself is copied.
+ *
+ * @param ur  The ring.
+ * @param fd  The file descriptor to write to.
+ * @param iov  The gather list.
+ * @param iovcnt  Number of entries, at most URING_MAXIOV.
+ * @return  An operation number to pass to uring_result(), or -1 if the
+ *   ring is full (submit first) or the list is too long.
+ */
+int uring_queue_send(URING *ur, int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Queue a receive into a buffer.  The buffer must stay valid until
+ * uring_submit() returns.
+ *
+ * @param ur  The ring.
+ * @param fd  The socket to receive from.
+ * @param buf  Where to put what arrives.
+ * @param len  Room in the buffer.
+ * @return  An operation number to pass to uring_result(), or -1 if the
+ *   ring is full (submit first) or the kernel cannot receive through it.
+ */
+int uring_queue_recv(URING *ur, int fd, void *buf, size_t len);
+
+/*
+ * Submit every queued operation and wait for all of them to complete,
+ * using a single system call in the normal case.
+ *
+ * @param ur  The ring.
+ * @return  0 on success, -1 if the submission itself failed (errno set);
+ *   in that case every operation reports -errno as its result.
+ */
+int uring_submit(URING *ur);
+
+/*
+ * Result of an operation from the last submission.
+ *
+ * @param ur  The ring.
+ * @param op  Operation number returned by uring_queue_send() or
+ *   uring_queue_recv().
+ * @return  Number of bytes sent or received, or a negated errno value.
+ */
+int uring_result(URING *ur, int op);
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "map.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ * Set up an empty arena.  The block is only allocated when it is first
+ * needed, so that an idle connection costs nothing.
+ */
+void arena_init(ARENA *ap){
+	ap->block = NULL;
+	ap->size = 0;
+	ap->used = 0;
+	ap->extra = NULL;
+	ap->peak = 0;
+}
+
+/*
+ * Free the extra blocks of an arena.
+ */
+static void arena_free_extra(ARENA *ap){
+	ARENA_EXTRA *xp;
+	while((xp = ap->extra) != NULL){
+		ap->extra = xp->next;
+		free(xp);
+	}
+}
+
+/*
+ * Release all the storage held by an arena.
+ */
+void arena_fini(ARENA *ap){
+	arena_free_extra(ap);
+	free(ap->block);
+	arena_init(ap);
+}
+
+/*
+ * Allocate storage that lasts until the next reset.
+ */
+void *arena_alloc(ARENA *ap, size_t size){
+	ARENA_EXTRA *xp;
+	size = ARENA_ROUND(size);
+	ap->peak += size;
+	if(ap->block == NULL){
+		ap->size = ARENA_BLOCK;
+		ap->block = malloc(ap->size);
+	}
+	if(ap->size - ap->used >= size){
+		ap->used += size;
+		return ap->block + ap->used - size;
+	}
+	//this request is larger than usual, the reset sees to it for next time
+	xp = malloc(sizeof(ARENA_EXTRA) + size);
+	xp->next = ap->extra;
+	ap->extra = xp;
+	return xp->data;
+}
+
+/*
+ * Give back everything allocated from an arena.
+ */
+void arena_reset(ARENA *ap){
+	if(ap->extra != NULL){
+		arena_free_extra(ap);
+		if(ap->peak > ap->size && ap->size < ARENA_KEEP_MAX){
+			free(ap->block);
+			ap->size = ap->peak < ARENA_KEEP_MAX ? ARENA_ROUND(ap->peak) : ARENA_KEEP_MAX;
+			ap->block = malloc(ap->size);
+		}
+	}
+	ap->used = 0;
+	ap->peak = 0;
+}
+
+/*
+ * Make a key of a copy of some content, all in an arena.
+ */
+KEY *arena_key(ARENA *ap, char *content, size_t size){
+	//a view of a copy that lives as long as the view, right after it
+	KEY_VIEW *vp = arena_alloc(ap, sizeof(KEY_VIEW) + size + 1);
+	char *copy = (char *)(vp + 1);
+	if(size > 0){
+		memcpy(copy, content, size);
+	}
+	copy[size] = '\0';
+	return key_view(vp, copy, size);
+}
@@ -0,0 +1,19 @@
+#include "config.h"
+
+/*
+ * Defaults, overridden by option processing in main().
+ */
+SERVER_CONFIG server_config = {
+	.mode = SERVER_THREAD,
+	.nthreads = 0,
+	.uring = 0,
+	.listeners = 0,
+	.pin = 0,
+	.persist = 0,
+	.buckets = 1024,
+	.stripes = 64,
+	.table = TABLE_CHAINED,
+	.sweep = 1000,
+	.hugepages = 0,
+	.lockstats = 0,
+};
@@ -5,6 +5,42 @@
 #include "string.h"
 #include "helper.h"
 #include "debug.h"
+#include "hash.h"
+#include "slab.h"
+
+/*
+ * Content of at most this many bytes is always kept in the blob's own
+ * allocation, right after the BLOB, even when it is adopted.
+ */
+#define BLOB_INLINE_MAX 32
+
+/*
+ * @return  Nonzero if the content of a blob lives in the blob's own
+ *   allocation.
+ */
+static int blob_inline(BLOB *bp){
+	return bp->content == (char *)(bp + 1);
+}
+
+/*
+ * Create a blob with room for content of a given size, in the same
+ * allocation as the blob itself.  The content is left for the caller
+ * to fill in; the null terminator after it is already in place.
+ *
+ * @param size  The size in bytes of the content.
+ * @return  The new blob, which has reference count 1.
+ */
+BLOB *blob_alloc(size_t size){
+	BLOB *b = malloc(sizeof(BLOB) + size + 1);
+	//the mutex is left alone, the reference count is kept with atomics
+	b->refcnt = 1;
+	b->size = size;
+	b->content = (char *)(b + 1);
+	//keep a null terminator after the content, so it prints as a string
+	b->content[size] = '\0';
+	b->prefix = b->content; //DEBUGGING
+	return b;
+}
 
 /*
  * Create a blob with given content and size.
@@ -17,30 +53,43 @@
  * @return  The new blob, which has reference count 1.
  */
 BLOB *blob_create(char *content, size_t size){
+	BLOB *b;
+	if(content == NULL){
+		return blob_adopt(NULL, size);
+	}
+	//b->content is copied from content, into the blob's own allocation
+	b = blob_alloc(size);
+	memcpy(b->content, content, size);
+	return b;
+}
+
+/*
+ * Create a blob that takes over an existing buffer as its content,
+ * instead of copying it.  The buffer must have been obtained from
+ * malloc() and have room for a null terminator after the content,
+ * which must already be in place; it is freed with the blob.  Small
+ * content is copied into the blob after all, and the buffer freed
+ * right away, so that a blob is a single allocation.
+ *
+ * @param content  The content of the blob, or NULL.
+ * @param size  The size in bytes of the content.
+ * @return  The new blob, which has reference count 1.
+ */
+BLOB *blob_adopt(char *content, size_t size){
+	BLOB *b;
+	if(content != NULL && size <= BLOB_INLINE_MAX){
+		b = blob_create(content, size);
+		free(content);
+		return b;
+	}
 	//make a new blob
-	BLOB *b = malloc(sizeof(BLOB));
+	b = malloc(sizeof(BLOB));
 	//init blob
-	pthread_mutex_t mutex;
-	pthread_mutex_init(&mutex, NULL);//initialize mutex
-	b->mutex = mutex;
-	pthread_mutex_lock(&b->mutex); //LOCK
 	b->refcnt = 1;
-	//b->content is copied from content
-	if(content != NULL){
-		b->size = size; //get the null terminator
-		b->content = calloc(b->size, sizeof(char));
-		memcpy(b->content, content, b->size);
-	}
-	else{
-		//content is null
-		b->content = NULL;
-		b->size = size;
-	}
-	//CRITICAL CODE
-	//content is copied
+	b->content = content;
+	b->size = size;
 	b->prefix = b->content; //DEBUGGING
-	pthread_mutex_unlock(&b->mutex); //UNLOCk
- 	return b;
+	return b;
 }
 
 /*
@@ -51,17 +100,12 @@ BLOB *blob_create(char *content, size_t size){
  * @return  The blob pointer passed as the argument.
  */
 BLOB *blob_ref(BLOB *bp, char *why){
-	//use that mutex to inc the ref count
 	debug("%s\n",why);
 	if(bp == NULL){
 		return NULL;
 	}
-	//LOCK
-	pthread_mutex_lock(&bp->mutex);
-	//CRITICAL CODE
-	bp->refcnt++;
-	//UNLOCK
-	pthread_mutex_unlock(&bp->mutex);
+	//the caller already holds a reference, so nothing needs ordering
+	__atomic_fetch_add(&bp->refcnt, 1, __ATOMIC_RELAXED);
 	return bp;
 }
 
@@ -79,22 +123,13 @@ void blob_unref(BLOB *bp, char *why){
 		debug("attempted to unref a NULL blob");
 		return;
 	}
-	//LOCK
-	pthread_mutex_lock(&bp->mutex);
-	//CRITICAL CODE
-	bp->refcnt--;
-	//UNLOCK
-	pthread_mutex_unlock(&bp->mutex);
-	if(bp->refcnt == 0){
-		pthread_mutex_lock(&bp->mutex);
+	//whoever drops the last reference must see what the others did with it
+	if(__atomic_sub_fetch(&bp->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
 		//This means that no key is referecing it, we have to free it
-		//free the content
-		if(bp->content != NULL){
+		//free the content, unless it goes with the blob
+		if(bp->content != NULL && !blob_inline(bp)){
 			free(bp->content);
 		}
-		pthread_mutex_unlock(&bp->mutex);
-		//destroy the mutex
-		pthread_mutex_destroy(&bp->mutex);
 		//free the blob
 		free(bp);
 	}
@@ -109,7 +144,10 @@ void blob_unref(BLOB *bp, char *why){
  */
 int blob_compare(BLOB *bp1, BLOB *bp2){
 	//take me back to when computer science was this easy ;(
-	if (memcmp(bp1->content, bp2->content, bp1->size) == 0 && memcmp(bp1->content, bp2->content, bp2->size) == 0 ){
+	if(bp1->size != bp2->size){
+		return -1;
+	}
+	if(bytes_equal(bp1->content, bp2->content, bp1->size)){
 		return 0;
 	}
 	return -1;
@@ -117,12 +155,14 @@ int blob_compare(BLOB *bp1, BLOB *bp2){
 
 /*
  Hash function for hashing the content of a blob.
+ * The whole content is hashed, NUL bytes and all; the hash is 64 bits
+ * wide, of which a key keeps the int's worth.
  *
  * @param bp  The blob.
  * @return  Hash of the blob.
  */
 int blob_hash(BLOB *bp){
-	return hash((char *) bp->content);
+	return (int)hash_bytes(bp->content, bp->size);
 }
 
 
@@ -135,7 +175,7 @@ int blob_hash(BLOB *bp){
 KEY *key_create(BLOB *bp){
 	//create a key struct
 	debug("key_create");
-	KEY *k = malloc(sizeof(KEY));
+	KEY *k = slab_alloc(SLAB_KEY);
 	//put bp in key
 	k->blob = bp;
 	//hash
@@ -157,7 +197,7 @@ void key_dispose(KEY *kp){
 	//deference the blob
 	debug("key is being disposed");
 	blob_unref(kp->blob, "key is unreferecing blob [key_dispose]");
-	free(kp);
+	slab_free(SLAB_KEY, kp);
 }
 
 /*
@@ -168,7 +208,11 @@ void key_dispose(KEY *kp){
  * @return  0 if the keys are equal, otherwise nonzero.
  */
 int key_compare(KEY *kp1, KEY *kp2){
-	if((blob_compare(kp1->blob, kp2->blob) == 0) && (kp1->hash == kp2->hash)){
+	//the cheap tests first, the bytes are only compared if both pass
+	if(kp1->hash != kp2->hash || kp1->blob->size != kp2->blob->size){
+		return -1;
+	}
+	if(bytes_equal(kp1->blob->content, kp2->blob->content, kp1->blob->size)){
 		return 0;
 	}
 	return -1;
@@ -186,7 +230,7 @@ int key_compare(KEY *kp1, KEY *kp2){
  */
 VERSION *version_create(TRANSACTION *tp, BLOB *bp){
 	//create a version struct
-	VERSION *v = malloc(sizeof(VERSION));
+	VERSION *v = slab_alloc(SLAB_VERSION);
 	//fill in members tp and bp
 	v->creator = tp;
 	v->blob = bp;
@@ -212,6 +256,9 @@ VERSION *version_create(TRANSACTION *tp, BLOB *bp){
  */
 void version_dispose(VERSION *vp){
 	blob_unref(vp->blob, "version dispose blob_unref");
-	trans_unref(vp->creator, "version dispose trans_unref");
-	free(vp);
+	//a committed version may have let go of its creator already
+	if(vp->creator != &trans_committed){
+		trans_unref(vp->creator, "version dispose trans_unref");
+	}
+	slab_free(SLAB_VERSION, vp);
 }
\ No newline at end of file
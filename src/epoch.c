@@ -0,0 +1,289 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "epoch.h"
+#include "csapp.h"
+
+/*
+ * An object waiting to be freed.
+ */
+typedef struct epoch_item {
+	void (*fn)(void *);
+	void *arg;
+} EPOCH_ITEM;
+
+/*
+ * Objects deferred by one thread in one epoch.
+ */
+typedef struct epoch_limbo {
+	unsigned long epoch;        // Epoch in which the objects were unlinked
+	EPOCH_ITEM *items;
+	int count, size;
+} EPOCH_LIMBO;
+
+/*
+ * Per-thread state.  Records are never freed; a thread that exits gives
+ * its record back, along with anything it has not reclaimed, and the
+ * next thread to start takes it over.
+ */
+typedef struct epoch_record {
+	atomic_ulong state;         // (epoch << 1) | 1 while in a read section, else 0
+	atomic_int in_use;          // Owned by a live thread
+	EPOCH_LIMBO limbo[3];       // By epoch, modulo 3
+	int deferred;               // Deferrals since the last attempt to reclaim
+	int held;                   // Depth of epoch_hold()
+	EPOCH_LIMBO retired;        // Objects to free at the end of the hold
+	struct epoch_record *next;
+} __attribute__((aligned(64))) EPOCH_RECORD;
+
+static struct {
+	atomic_ulong epoch;
+	_Atomic(EPOCH_RECORD *) records;
+	pthread_key_t key;          // Gives the record back when its thread exits
+	atomic_ulong advances, deferred, reclaimed;
+	atomic_ulong postponed;     // Objects freed at the end of a hold
+} epoch_state;
+
+static __thread EPOCH_RECORD *thread_record;
+
+/*
+ * Add an object to a list, making room for it.
+ */
+static void limbo_add(EPOCH_LIMBO *lp, void (*fn)(void *), void *arg){
+	if(lp->count == lp->size){
+		lp->size = lp->size > 0 ? lp->size * 2 : EPOCH_BATCH;
+		//nothing deferred can be freed early, so running out of memory is fatal
+		lp->items = Realloc(lp->items, lp->size * sizeof(EPOCH_ITEM));
+	}
+	lp->items[lp->count].fn = fn;
+	lp->items[lp->count].arg = arg;
+	lp->count++;
+}
+
+/*
+ * Free the objects of a list.
+ */
+static void items_run(EPOCH_LIMBO *lp){
+	for(int i = 0; i < lp->count; i++){
+		lp->items[i].fn(lp->items[i].arg);
+	}
+	lp->count = 0;
+}
+
+/*
+ * Free the objects of one limbo list.
+ */
+static void limbo_run(EPOCH_LIMBO *lp){
+	atomic_fetch_add(&epoch_state.reclaimed, lp->count);
+	items_run(lp);
+}
+
+/*
+ * Free the objects put off until the end of a hold.
+ */
+static void retired_run(EPOCH_RECORD *r){
+	atomic_fetch_add(&epoch_state.postponed, r->retired.count);
+	items_run(&r->retired);
+}
+
+/*
+ * Move the global epoch on if every thread in a read section has seen
+ * the current one.
+ *
+ * @return  The global epoch.
+ */
+static unsigned long epoch_advance(void){
+	unsigned long e = atomic_load(&epoch_state.epoch), s;
+	for(EPOCH_RECORD *r = atomic_load(&epoch_state.records); r != NULL; r = r->next){
+		s = atomic_load(&r->state);
+		if((s & 1) && (s >> 1) != e){
+			return e;
+		}
+	}
+	if(atomic_compare_exchange_strong(&epoch_state.epoch, &e, e + 1)){
+		atomic_fetch_add(&epoch_state.advances, 1);
+		return e + 1;
+	}
+	return e;
+}
+
+/*
+ * Free whatever a record holds from epochs no reader can still be in.
+ */
+static void epoch_reclaim(EPOCH_RECORD *r){
+	unsigned long e = epoch_advance();
+	for(int i = 0; i < 3; i++){
+		if(r->limbo[i].count > 0 && r->limbo[i].epoch + 2 <= e){
+			limbo_run(&r->limbo[i]);
+		}
+	}
+	r->deferred = 0;
+}
+
+static void record_release(void *arg){
+	EPOCH_RECORD *r = arg;
+	r->held = 0;
+	retired_run(r);
+	epoch_reclaim(r);
+	atomic_store(&r->state, 0);
+	atomic_store(&r->in_use, 0);
+}
+
+/*
+ * @return  The calling thread's record, taking one on first use.
+ */
+static EPOCH_RECORD *record_get(void){
+	EPOCH_RECORD *r = thread_record;
+	int unused = 0;
+	if(r != NULL){
+		return r;
+	}
+	for(r = atomic_load(&epoch_state.records); r != NULL; r = r->next){
+		if(atomic_compare_exchange_strong(&r->in_use, &unused, 1)){
+			break;
+		}
+		unused = 0;
+	}
+	if(r == NULL){
+		r = calloc(1, sizeof(EPOCH_RECORD));
+		atomic_store(&r->in_use, 1);
+		r->next = atomic_load(&epoch_state.records);
+		while(!atomic_compare_exchange_weak(&epoch_state.records, &r->next, r));
+	}
+	pthread_setspecific(epoch_state.key, r);
+	thread_record = r;
+	return r;
+}
+
+/*
+ * Set up the global epoch.
+ */
+void epoch_init(void){
+	pthread_key_create(&epoch_state.key, record_release);
+	atomic_store(&epoch_state.advances, 0);
+	atomic_store(&epoch_state.deferred, 0);
+	atomic_store(&epoch_state.reclaimed, 0);
+	atomic_store(&epoch_state.postponed, 0);
+}
+
+/*
+ * Free everything still waiting to be reclaimed.
+ */
+void epoch_fini(void){
+	for(EPOCH_RECORD *r = atomic_load(&epoch_state.records); r != NULL; r = r->next){
+		for(int i = 0; i < 3; i++){
+			limbo_run(&r->limbo[i]);
+			free(r->limbo[i].items);
+			r->limbo[i].items = NULL;
+			r->limbo[i].size = 0;
+		}
+		retired_run(r);
+		free(r->retired.items);
+		r->retired.items = NULL;
+		r->retired.size = 0;
+	}
+	pthread_key_delete(epoch_state.key);
+}
+
+/*
+ * Enter a read section on the calling thread.
+ */
+void epoch_enter(void){
+	EPOCH_RECORD *r = record_get();
+	atomic_store(&r->state, (atomic_load(&epoch_state.epoch) << 1) | 1);
+	//nothing may be read before the announcement is visible
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * Leave the read section entered by epoch_enter().
+ */
+void epoch_exit(void){
+	atomic_store_explicit(&thread_record->state, 0, memory_order_release);
+}
+
+/*
+ * Arrange for an object to be freed once no reader can still see it.
+ */
+void epoch_defer(void (*fn)(void *), void *arg){
+	EPOCH_RECORD *r = record_get();
+	unsigned long e = atomic_load(&epoch_state.epoch);
+	EPOCH_LIMBO *lp = &r->limbo[e % 3];
+	//a list left from three or more epochs ago can go now, or during a
+	//hold, at the end of it
+	if(lp->count > 0 && lp->epoch != e){
+		if(r->held > 0){
+			for(int i = 0; i < lp->count; i++){
+				limbo_add(&r->retired, lp->items[i].fn, lp->items[i].arg);
+			}
+			atomic_fetch_add(&epoch_state.reclaimed, lp->count);
+			lp->count = 0;
+		}
+		else{
+			limbo_run(lp);
+		}
+	}
+	lp->epoch = e;
+	limbo_add(lp, fn, arg);
+	atomic_fetch_add(&epoch_state.deferred, 1);
+	//during a hold, the reclamation that falls due waits for its end
+	if(++r->deferred >= EPOCH_BATCH && r->held == 0){
+		epoch_reclaim(r);
+	}
+}
+
+/*
+ * Free what the calling thread has deferred and no reader can still see.
+ */
+void epoch_poll(void){
+	if(thread_record != NULL && thread_record->held == 0){
+		epoch_reclaim(thread_record);
+	}
+}
+
+/*
+ * Start a stretch of work under locks on the calling thread.
+ */
+void epoch_hold(void){
+	record_get()->held++;
+}
+
+/*
+ * End the stretch started by epoch_hold().
+ */
+void epoch_unhold(void){
+	EPOCH_RECORD *r = thread_record;
+	if(--r->held > 0){
+		return;
+	}
+	if(r->retired.count > 0){
+		retired_run(r);
+	}
+	if(r->deferred >= EPOCH_BATCH){
+		epoch_reclaim(r);
+	}
+}
+
+/*
+ * Free an object as soon as the calling thread is out of its holds.
+ */
+void epoch_retire(void (*fn)(void *), void *arg){
+	EPOCH_RECORD *r = thread_record;
+	if(r == NULL || r->held == 0){
+		fn(arg);
+		return;
+	}
+	limbo_add(&r->retired, fn, arg);
+}
+
+/*
+ * Print the reclamation counters to stderr.
+ */
+void epoch_show(void){
+	unsigned long deferred = atomic_load(&epoch_state.deferred);
+	unsigned long reclaimed = atomic_load(&epoch_state.reclaimed);
+	fprintf(stderr, "epoch: %lu, %lu advances, %lu deferred frees, %lu pending, %lu put off to the end of a hold\n",
+		atomic_load(&epoch_state.epoch), atomic_load(&epoch_state.advances),
+		deferred, deferred - reclaimed, atomic_load(&epoch_state.postponed));
+}
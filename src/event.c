@@ -0,0 +1,977 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "event.h"
+#include "config.h"
+#include "server.h"
+#include "protocol.h"
+#include "proto_io.h"
+#include "transaction.h"
+#include "store.h"
+#include "uring.h"
+#include "csapp.h"
+#include "helper.h"
+#include "debug.h"
+#include "map.h"
+
+#define EVENT_MAX_EVENTS 64    // Events handled per epoll_wait()
+#define CONN_BUFSIZE 4096      // Initial size of connection buffers
+#define CONN_SHARED 4096       // Larger values are sent from their blobs, not copied
+#define CONN_MAXIOV 8          // Gather list entries per write
+#define EVENT_COMMITTERS 4     // Helper threads for commits that have to wait
+#define EVENT_COMMIT_WAIT 1000 // Microseconds a helper waits on one commit at a time
+
+/*
+ * Where a connection is in the request sequence.  PUT, GET and batch
+ * requests are followed by DATA packets, so the connection remembers
+ * which request those packets belong to.
+ */
+typedef enum {
+	CONN_IDLE,          // Waiting for a request packet
+	CONN_PUT_KEY,       // PUT received, waiting for the key
+	CONN_PUT_VALUE,     // Key received, waiting for the value
+	CONN_GET_KEY,       // GET received, waiting for the key
+	CONN_MULTI,         // Batch received, collecting its keys and values
+	CONN_COMMITTING,    // Blocking commit handed off to a helper
+	CONN_CLOSING        // Final reply queued, close once it is flushed
+} CONN_STATE;
+
+/*
+ * A value to be sent straight from its blob, at a given point in the
+ * output buffer.
+ */
+typedef struct out_ref {
+	size_t at;                  // Goes out after this many bytes of outbuf
+	BLOB *blob;                 // Holds a reference
+} OUT_REF;
+
+typedef struct conn {
+	int fd;
+	CONN_STATE state;
+	TRANSACTION *tp;            // Current transaction (NULL between transactions)
+	unsigned long ntrans;       // Transactions begun on this connection
+	int discarding;             // Skipping the rest of an aborted transaction
+	TRANS_STATUS status;        // Result of an offloaded commit
+	KEY *key;                   // Key of a PUT waiting for its value
+	int multi;                  // Type of the batch being collected
+	int ndata, have;            // DATA packets in the batch, and received so far
+	int nkeys;                  // Keys collected for the batch
+	KEY **keys;                 // The batch's keys
+	BLOB **values;              // The batch's values (MULTI_PUT)
+	ARENA arena;                // Keys and batch arrays of the current request
+	char *inbuf;                // Received bytes not yet parsed
+	char *body;                 // Large payload, received straight into blob storage
+	size_t bodylen;             // Bytes of it received so far
+	XACTO_PACKET bodypkt;       // The packet it belongs to
+	size_t inlen, incap;
+	char *outbuf;               // Replies not yet written
+	size_t outoff, outlen, outcap;  // outoff counts blob bytes sent, too
+	OUT_REF *outrefs;           // Values interleaved with outbuf
+	int noutrefs, outrefcap;
+	size_t outrefbytes;         // Bytes of those values
+	uint32_t events;            // Events currently registered with epoll
+	int dirty;                  // On the loop's list of connections to flush
+	int closed;                 // Closed while dirty, freed by the flush
+	int dropped;                // Closed while committing, released once
+	                            // the helper hands it back
+	struct event_loop *loop;    // Loop that owns this connection
+	struct conn *next;          // Link in the helpers' queue, then in the
+	                            // loop's completion list
+	struct conn *next_dirty;    // Link in the loop's flush list
+} CONN;
+
+typedef struct event_loop {
+	pthread_t tid;
+	int epfd;
+	int wakefd;                 // eventfd to wake the loop from other threads
+	int stop;                   // Set by event_fini()
+	pthread_mutex_t mutex;      // Protects the completion list
+	CONN *done;                 // Connections whose offloaded commit finished
+	CONN *dirty;                // Connections to flush before the next wait
+} EVENT_LOOP;
+
+static EVENT_LOOP *loops;
+static int num_loops;
+static unsigned int next_loop;
+
+/*
+ * Commits waiting for their dependencies, shared by all the loops.  A
+ * fixed set of helpers takes them in turn, and one that is still kept
+ * waiting goes back at the end of the queue, so that a helper never
+ * sits on a commit that waits for another one still in the queue.
+ */
+static struct {
+	pthread_mutex_t mutex;      // Protects the queue and stop
+	pthread_cond_t cond;        // Signalled when a commit is queued
+	CONN *head, *tail;
+	int stop;                   // Set by event_fini()
+	pthread_t tids[EVENT_COMMITTERS];
+} committers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void conn_close(CONN *c);
+
+/*
+ * @return  Nonzero if the connection has output not yet written.
+ */
+static int conn_pending(CONN *c){
+	return c->outoff < c->outlen + c->outrefbytes;
+}
+
+/*
+ * Append a piece of output to a gather list, less whatever part of it
+ * has already been written.
+ *
+ * @return  The new number of entries.
+ */
+static int conn_iov_add(struct iovec *iov, int n, size_t *skip, char *base, size_t len){
+	if(*skip >= len){
+		*skip -= len;
+		return n;
+	}
+	iov[n].iov_base = base + *skip;
+	iov[n].iov_len = len - *skip;
+	*skip = 0;
+	return n + 1;
+}
+
+/*
+ * Build a gather list of the output not yet written: stretches of the
+ * output buffer, with the shared values in between.
+ *
+ * @param max  Room in the list; output beyond it is left for later.
+ * @return  Number of entries.
+ */
+static int conn_iov(CONN *c, struct iovec *iov, int max){
+	size_t skip = c->outoff, from = 0;
+	int n = 0;
+	for(int i = 0; i < c->noutrefs && n < max; i++){
+		n = conn_iov_add(iov, n, &skip, c->outbuf + from, c->outrefs[i].at - from);
+		from = c->outrefs[i].at;
+		if(n < max)
+			n = conn_iov_add(iov, n, &skip, c->outrefs[i].blob->content, c->outrefs[i].blob->size);
+	}
+	if(n < max)
+		n = conn_iov_add(iov, n, &skip, c->outbuf + from, c->outlen - from);
+	return n;
+}
+
+/*
+ * Forget output that has all been written, dropping the shared values.
+ */
+static void conn_output_reset(CONN *c){
+	for(int i = 0; i < c->noutrefs; i++)
+		blob_unref(c->outrefs[i].blob, "sent value from [conn_output_reset]");
+	c->noutrefs = 0;
+	c->outrefbytes = 0;
+	c->outoff = c->outlen = 0;
+}
+
+/*
+ * Bring the set of events registered for a connection in line with
+ * its state: input is only wanted while requests can be processed,
+ * output only while replies are pending.
+ */
+static void conn_arm(CONN *c){
+	struct epoll_event ev;
+	uint32_t want = 0;
+	if(c->dropped)
+		return;
+	if(c->state != CONN_COMMITTING && c->state != CONN_CLOSING)
+		want |= EPOLLIN;
+	if(conn_pending(c))
+		want |= EPOLLOUT;
+	if(want == c->events)
+		return;
+	ev.events = want;
+	ev.data.ptr = c;
+	if(want == 0)
+		epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	else if(c->events == 0)
+		epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	else
+		epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = want;
+}
+
+/*
+ * Append a packet and its payload to the connection's output buffer.
+ * The header is converted to network byte order in the buffer.  With
+ * no data, only the header is appended, whatever its size.
+ */
+static void conn_queue(CONN *c, XACTO_PACKET *pkt, void *data){
+	struct timespec current_time;
+	size_t size = pkt->size;
+	size_t need;
+	if(data == NULL)
+		size = 0;
+	need = c->outlen + sizeof(XACTO_PACKET) + size;
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	pkt->timestamp_sec = current_time.tv_sec;
+	pkt->timestamp_nsec = current_time.tv_nsec;
+	if(need > c->outcap){
+		while(c->outcap < need)
+			c->outcap *= 2;
+		c->outbuf = Realloc(c->outbuf, c->outcap);
+	}
+	pkt->size = htonl(pkt->size);
+	pkt->timestamp_sec = htonl(pkt->timestamp_sec);
+	pkt->timestamp_nsec = htonl(pkt->timestamp_nsec);
+	memcpy(c->outbuf + c->outlen, pkt, sizeof(XACTO_PACKET));
+	c->outlen += sizeof(XACTO_PACKET);
+	if(size > 0){
+		memcpy(c->outbuf + c->outlen, data, size);
+		c->outlen += size;
+	}
+}
+
+/*
+ * Queue a packet whose payload is a value from the store.  A large
+ * value is not copied: the blob is kept until it has been written.
+ */
+static void conn_queue_blob(CONN *c, XACTO_PACKET *pkt, BLOB *bp){
+	if(pkt->size <= CONN_SHARED){
+		conn_queue(c, pkt, bp->content);
+		return;
+	}
+	conn_queue(c, pkt, NULL);
+	if(c->noutrefs == c->outrefcap){
+		c->outrefcap = c->outrefcap ? 2 * c->outrefcap : 4;
+		c->outrefs = Realloc(c->outrefs, c->outrefcap * sizeof(OUT_REF));
+	}
+	c->outrefs[c->noutrefs].at = c->outlen;
+	c->outrefs[c->noutrefs++].blob = blob_ref(bp, "queued value from [conn_queue_blob]");
+	c->outrefbytes += bp->size;
+}
+
+/*
+ * Queue a payload-free REPLY packet with the given status.
+ */
+static void conn_reply(CONN *c, int status){
+	XACTO_PACKET pkt;
+	memset(&pkt, 0, sizeof(XACTO_PACKET));
+	pkt.type = XACTO_REPLY_PKT;
+	pkt.status = status;
+	conn_queue(c, &pkt, NULL);
+}
+
+/*
+ * Write as much pending output as the socket accepts.
+ *
+ * @return  0 if the connection is still open, -1 if it was closed.
+ */
+static int conn_flush(CONN *c){
+	struct iovec iov[CONN_MAXIOV];
+	ssize_t n;
+	if(c->dropped)
+		return -1;
+	while(conn_pending(c)){
+		n = writev(c->fd, iov, conn_iov(c, iov, CONN_MAXIOV));
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if(n <= 0){
+			conn_close(c);
+			return -1;
+		}
+		c->outoff += n;
+	}
+	if(!conn_pending(c)){
+		conn_output_reset(c);
+		if(c->state == CONN_CLOSING){
+			conn_close(c);
+			return -1;
+		}
+	}
+	conn_arm(c);
+	return 0;
+}
+
+/*
+ * Note that a connection has output to flush (or is closing).  Flushing
+ * is deferred to the end of the loop iteration, so that the writes of
+ * all connections serviced in one wakeup can be submitted together.
+ */
+static void conn_dirty(CONN *c){
+	if(c->dirty)
+		return;
+	c->dirty = 1;
+	c->next_dirty = c->loop->dirty;
+	c->loop->dirty = c;
+}
+
+/*
+ * The current transaction has reached a final state (and the connection's
+ * reference to it is gone): queue the final reply.  The connection is
+ * closed once that has been written, unless sessions are persistent.
+ * A persistent session that aborted before its COMMIT skips the rest
+ * of the transaction's requests, as xacto_serve() does.
+ *
+ * @param at_commit  Nonzero if the status is the outcome of a COMMIT.
+ */
+static void conn_finish(CONN *c, TRANS_STATUS status, int at_commit){
+	c->tp = NULL;
+	conn_reply(c, status == TRANS_COMMITTED ? TRANS_COMMITTED : TRANS_ABORTED);
+	if(!server_config.persist){
+		c->state = CONN_CLOSING;
+		return;
+	}
+	c->state = CONN_IDLE;
+	c->discarding = status != TRANS_COMMITTED && !at_commit;
+}
+
+/*
+ * Put a connection at the end of the helpers' queue.
+ */
+static void committer_queue(CONN *c){
+	pthread_mutex_lock(&committers.mutex);
+	c->next = NULL;
+	if(committers.tail != NULL)
+		committers.tail->next = c;
+	else
+		committers.head = c;
+	committers.tail = c;
+	pthread_cond_signal(&committers.cond);
+	pthread_mutex_unlock(&committers.mutex);
+}
+
+/*
+ * Thread function for a commit helper.  Each result is posted back to
+ * the loop that owns the connection.
+ */
+static void *committer_thread(void *arg){
+	EVENT_LOOP *loop;
+	TRANS_STATUS status;
+	uint64_t one = 1;
+	CONN *c;
+	block_server_signals();
+	for(;;){
+		pthread_mutex_lock(&committers.mutex);
+		while(committers.head == NULL && !committers.stop)
+			pthread_cond_wait(&committers.cond, &committers.mutex);
+		if((c = committers.head) == NULL){
+			pthread_mutex_unlock(&committers.mutex);
+			break;
+		}
+		if((committers.head = c->next) == NULL)
+			committers.tail = NULL;
+		pthread_mutex_unlock(&committers.mutex);
+		if((status = trans_commit_timed(c->tp, EVENT_COMMIT_WAIT)) == TRANS_PENDING){
+			committer_queue(c);
+			continue;
+		}
+		loop = c->loop;
+		c->status = status;
+		pthread_mutex_lock(&loop->mutex);
+		c->next = loop->done;
+		loop->done = c;
+		pthread_mutex_unlock(&loop->mutex);
+		if(write(loop->wakefd, &one, sizeof(one)) < 0)
+			debug("commit wakeup failed");
+	}
+	return NULL;
+}
+
+/*
+ * Commit the current transaction.  A transaction with no outstanding
+ * dependencies commits without blocking, so that is done in the loop.
+ * Otherwise the commit is handed to the helpers, because the
+ * transactions it waits for may well be serviced by this same loop.
+ * Until the helper hands the connection back, the transaction and the
+ * connection are the helper's to use.
+ */
+static void conn_commit(CONN *c){
+	if(__atomic_load_n(&c->tp->waitcnt, __ATOMIC_RELAXED) == 0){
+		conn_finish(c, trans_commit(c->tp), 1);
+		return;
+	}
+	c->state = CONN_COMMITTING;
+	conn_arm(c);
+	committer_queue(c);
+}
+
+/*
+ * Make a blob of a packet's payload.  A large payload that was received
+ * into storage of its own is adopted rather than copied.
+ */
+static BLOB *conn_blob(CONN *c, XACTO_PACKET *pkt, char *content){
+	BLOB *bp;
+	if(c->body != NULL && content == c->body){
+		bp = blob_adopt(c->body, pkt->size);
+		c->body = NULL;
+		return bp;
+	}
+	return blob_create(content, pkt->size);
+}
+
+/*
+ * Start collecting a batch request.
+ *
+ * @param ndata  Number of DATA packets to follow.
+ */
+static void conn_multi_begin(CONN *c, int type, int ndata){
+	c->multi = type;
+	c->ndata = ndata;
+	c->have = 0;
+	c->nkeys = 0;
+	if(!c->discarding){
+		c->keys = arena_alloc(&c->arena, (ndata + 1) * sizeof(KEY *));
+		c->values = arena_alloc(&c->arena, (ndata + 1) * sizeof(BLOB *));
+		memset(c->values, 0, (ndata + 1) * sizeof(BLOB *));
+	}
+	c->state = CONN_MULTI;
+}
+
+/*
+ * Run a batch whose keys (and values) have all arrived, under one
+ * store lock, and queue its reply.
+ */
+static void conn_multi_run(CONN *c){
+	XACTO_PACKET reply;
+	TRANS_STATUS status;
+	int i;
+	c->state = CONN_IDLE;
+	if(c->discarding){
+		conn_reply(c, TRANS_ABORTED);
+		return;
+	}
+	if(c->multi == XACTO_MULTI_PUT_PKT)
+		status = store_put_multi(c->tp, c->keys, c->values, c->nkeys);
+	else
+		status = store_get_multi(c->tp, c->keys, c->values, c->nkeys);
+	//the keys were only lent to the store
+	c->keys = NULL;
+	c->nkeys = 0;
+	if(status == TRANS_ABORTED){
+		conn_finish(c, trans_abort(c->tp), 0);
+	}
+	else{
+		conn_reply(c, 0);
+		for(i = 0; c->multi == XACTO_MULTI_GET_PKT && i < c->ndata; i++){
+			memset(&reply, 0, sizeof(XACTO_PACKET));
+			reply.type = XACTO_DATA_PKT;
+			if(c->values[i]->content){
+				reply.size = c->values[i]->size;
+			}
+			else{
+				reply.null = 1;
+			}
+			conn_queue_blob(c, &reply, c->values[i]);
+			blob_unref(c->values[i], "value from [conn_multi_run]");
+		}
+	}
+	c->values = NULL;
+}
+
+/*
+ * Advance the connection's state machine by one received packet.
+ */
+static void conn_packet(CONN *c, XACTO_PACKET *pkt, char *payload){
+	XACTO_PACKET reply;
+	BLOB *value;
+	KEY *key;
+	KEY_VIEW view;
+	TRANS_STATUS status;
+	char *content = pkt->size > 0 ? payload : NULL;
+	int ndata;
+	switch(c->state){
+		case CONN_IDLE:
+		//whatever the last request left in the arena is done with
+		arena_reset(&c->arena);
+		if((ndata = proto_request_data_packets(pkt, content)) < 0){
+			//a batch we cannot take, there is no telling where the next request starts
+			c->state = CONN_CLOSING;
+			break;
+		}
+		if(c->discarding){
+			//the rest of an aborted transaction is answered, not run
+			if(pkt->type == XACTO_COMMIT_PKT){
+				c->discarding = 0;
+				conn_reply(c, TRANS_ABORTED);
+			}
+		}
+		else if(c->tp == NULL){
+			c->tp = trans_create();
+			c->ntrans++;
+		}
+		if(pkt->type == XACTO_PUT_PKT)
+			c->state = CONN_PUT_KEY;
+		else if(pkt->type == XACTO_GET_PKT)
+			c->state = CONN_GET_KEY;
+		else if(pkt->type == XACTO_MULTI_GET_PKT || pkt->type == XACTO_MULTI_PUT_PKT){
+			conn_multi_begin(c, pkt->type, ndata);
+			if(ndata == 0)
+				conn_multi_run(c);
+		}
+		else if(pkt->type == XACTO_COMMIT_PKT && c->tp != NULL)
+			conn_commit(c);
+		break;
+		case CONN_MULTI:
+		if(!c->discarding){
+			//a MULTI_PUT alternates keys and values
+			if(c->multi == XACTO_MULTI_PUT_PKT && c->have % 2 == 1)
+				c->values[c->nkeys - 1] = conn_blob(c, pkt, content);
+			else
+				c->keys[c->nkeys++] = arena_key(&c->arena, content, pkt->size);
+		}
+		if(++c->have == c->ndata)
+			conn_multi_run(c);
+		break;
+		case CONN_PUT_KEY:
+		c->key = arena_key(&c->arena, content, pkt->size);
+		c->state = CONN_PUT_VALUE;
+		break;
+		case CONN_PUT_VALUE:
+		key = c->key;
+		c->key = NULL;
+		c->state = CONN_IDLE;
+		if(c->discarding){
+			conn_reply(c, TRANS_ABORTED);
+			break;
+		}
+		status = store_put_borrowed(c->tp, key, conn_blob(c, pkt, content));
+		if(status == TRANS_ABORTED){
+			//the store leaves our reference to us
+			conn_finish(c, trans_abort(c->tp), 0);
+			break;
+		}
+		conn_reply(c, 0);
+		break;
+		case CONN_GET_KEY:
+		c->state = CONN_IDLE;
+		if(c->discarding){
+			conn_reply(c, TRANS_ABORTED);
+			break;
+		}
+		//the payload stays put in the input buffer for the lookup
+		key = key_view(&view, content, pkt->size);
+		status = store_get_borrowed(c->tp, key, &value);
+		if(status == TRANS_ABORTED){
+			conn_finish(c, trans_abort(c->tp), 0);
+			break;
+		}
+		conn_reply(c, 0);
+		memset(&reply, 0, sizeof(XACTO_PACKET));
+		reply.type = XACTO_DATA_PKT;
+		if(value->content){
+			reply.size = value->size;
+		}
+		else{
+			reply.null = 1;
+		}
+		conn_queue_blob(c, &reply, value);
+		blob_unref(value, "value from [conn_packet]");
+		break;
+		case CONN_COMMITTING:
+		case CONN_CLOSING:
+		break;
+	}
+}
+
+/*
+ * Parse and handle every complete packet in the input buffer, leaving
+ * any trailing partial packet for the next read.
+ */
+static void conn_process(CONN *c){
+	XACTO_PACKET pkt;
+	size_t off = 0;
+	while(c->state != CONN_COMMITTING && c->state != CONN_CLOSING){
+		if(c->inlen - off < sizeof(XACTO_PACKET))
+			break;
+		memcpy(&pkt, c->inbuf + off, sizeof(XACTO_PACKET));
+		pkt.size = ntohl(pkt.size);
+		pkt.timestamp_sec = ntohl(pkt.timestamp_sec);
+		pkt.timestamp_nsec = ntohl(pkt.timestamp_nsec);
+		if(pkt.size > XACTO_PAYLOAD_MAX){
+			//a payload we will not take, and no telling where the next packet starts
+			c->state = CONN_CLOSING;
+			break;
+		}
+		if(c->inlen - off - sizeof(XACTO_PACKET) < pkt.size){
+			if(pkt.size > CONN_BUFSIZE){
+				//rather than grow the input buffer to hold it, a large payload
+				//is read into storage that its blob can take over
+				off += sizeof(XACTO_PACKET);
+				c->body = Malloc((size_t)pkt.size + 1);
+				c->bodylen = c->inlen - off;
+				c->bodypkt = pkt;
+				memcpy(c->body, c->inbuf + off, c->bodylen);
+				off = c->inlen;
+			}
+			break;
+		}
+		off += sizeof(XACTO_PACKET);
+		conn_packet(c, &pkt, c->inbuf + off);
+		off += pkt.size;
+	}
+	memmove(c->inbuf, c->inbuf + off, c->inlen - off);
+	c->inlen -= off;
+}
+
+/*
+ * Handle a large payload once all of it has arrived.
+ */
+static void conn_body(CONN *c){
+	XACTO_PACKET pkt = c->bodypkt;
+	c->body[pkt.size] = '\0';
+	conn_packet(c, &pkt, c->body);
+	//a payload that did not end up in a blob
+	free(c->body);
+	c->body = NULL;
+}
+
+/*
+ * Where the next bytes received on a connection go: the rest of a large
+ * payload, or the input buffer, which is grown if it is full.
+ *
+ * @param lenp  Set to the room there.
+ */
+static char *conn_inspace(CONN *c, size_t *lenp){
+	if(c->body != NULL){
+		*lenp = c->bodypkt.size - c->bodylen;
+		return c->body + c->bodylen;
+	}
+	if(c->inlen == c->incap){
+		c->incap *= 2;
+		c->inbuf = Realloc(c->inbuf, c->incap);
+	}
+	*lenp = c->incap - c->inlen;
+	return c->inbuf + c->inlen;
+}
+
+/*
+ * Run bytes just received into conn_inspace() through the state machine.
+ */
+static void conn_received(CONN *c, size_t n){
+	if(c->body != NULL){
+		if((c->bodylen += n) == c->bodypkt.size)
+			conn_body(c);
+	}
+	else{
+		c->inlen += n;
+		conn_process(c);
+	}
+}
+
+/*
+ * Read everything the socket has to offer and run it through the
+ * state machine.  End of file in the middle of a transaction aborts
+ * the transaction.
+ *
+ * @return  0 if the connection is still open, -1 if it was closed.
+ */
+static int conn_readable(CONN *c){
+	ssize_t n;
+	size_t len;
+	char *buf;
+	while(c->state != CONN_COMMITTING && c->state != CONN_CLOSING){
+		buf = conn_inspace(c, &len);
+		if((n = read(c->fd, buf, len)) > 0){
+			conn_received(c, n);
+			continue;
+		}
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		//Unexpected EOF or error
+		conn_close(c);
+		return -1;
+	}
+	conn_dirty(c);
+	return 0;
+}
+
+/*
+ * Release a connection, aborting its transaction if it never finished.
+ * A connection whose commit is with a helper is only taken off the
+ * loop; loop_completions() releases it when the helper is done.
+ */
+static void conn_close(CONN *c){
+	if(c->state == CONN_COMMITTING){
+		if(!c->dropped && c->events != 0)
+			epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		c->events = 0;
+		c->dropped = 1;
+		return;
+	}
+	//a batch that was still arriving, its keys go with the arena
+	for(int i = 0; i < c->nkeys; i++){
+		if(c->values[i] != NULL)
+			blob_unref(c->values[i], "unused value from [conn_close]");
+	}
+	arena_fini(&c->arena);
+	if(c->tp != NULL)
+		trans_abort(c->tp);
+	xacto_session_done(c->ntrans);
+	creg_unregister(client_registry, c->fd);
+	close(c->fd);
+	free(c->inbuf);
+	free(c->body);
+	conn_output_reset(c);
+	free(c->outrefs);
+	free(c->outbuf);
+	c->inbuf = c->outbuf = NULL;
+	if(c->dirty){
+		//still on the flush list, which frees it
+		c->closed = 1;
+		return;
+	}
+	free(c);
+}
+
+/*
+ * Pick up connections whose offloaded commit has completed.
+ */
+static void loop_completions(EVENT_LOOP *loop){
+	uint64_t count;
+	CONN *c, *next;
+	if(read(loop->wakefd, &count, sizeof(count)) < 0)
+		debug("eventfd read failed");
+	pthread_mutex_lock(&loop->mutex);
+	c = loop->done;
+	loop->done = NULL;
+	pthread_mutex_unlock(&loop->mutex);
+	for(; c != NULL; c = next){
+		next = c->next;
+		if(c->dropped){
+			//the commit took the connection's reference with it
+			c->tp = NULL;
+			c->state = CONN_CLOSING;
+			c->dropped = 0;
+			conn_close(c);
+			continue;
+		}
+		conn_finish(c, c->status, 1);
+		//a persistent session may have pipelined its next transaction already
+		conn_process(c);
+		conn_dirty(c);
+	}
+}
+
+/*
+ * Flush every connection that has output.  With an io_uring ring the
+ * writes for all of them go out in one submission; whatever a socket
+ * does not take is left to conn_flush(), which waits for EPOLLOUT.
+ */
+static void loop_flush(EVENT_LOOP *loop){
+	URING *ur = uring_thread();
+	CONN *batch[URING_ENTRIES];
+	int ops[URING_ENTRIES];
+	struct iovec iov[URING_MAXIOV];
+	int n = 0, res;
+	CONN *c;
+	for(;;){
+		if((c = loop->dirty) != NULL){
+			loop->dirty = c->next_dirty;
+			c->dirty = 0;
+			if(c->closed){
+				free(c);
+				continue;
+			}
+			if(c->dropped)
+				continue;
+			if(ur == NULL || !conn_pending(c)){
+				conn_flush(c);
+				continue;
+			}
+			ops[n] = uring_queue_send(ur, c->fd, iov, conn_iov(c, iov, URING_MAXIOV));
+			batch[n++] = c;
+			if(n < URING_ENTRIES)
+				continue;
+		}
+		if(n == 0)
+			break;
+		uring_submit(ur);
+		for(int i = 0; i < n; i++){
+			c = batch[i];
+			res = uring_result(ur, ops[i]);
+			if(res < 0 && res != -EAGAIN && res != -EINTR){
+				conn_close(c);
+				continue;
+			}
+			if(res > 0)
+				c->outoff += res;
+			conn_flush(c);
+		}
+		n = 0;
+	}
+}
+
+/*
+ * Read from every connection that epoll reported readable.  With an
+ * io_uring ring, one read for each of them goes out in a single
+ * submission; only a connection that filled its buffer is read from
+ * again directly, since the loop's epoll is level-triggered and reports
+ * whatever the others have left.
+ *
+ * @param ready  The connections, which are not known to be closed.
+ */
+static void loop_read(CONN **ready, int nready){
+	URING *ur = uring_thread();
+	int ops[EVENT_MAX_EVENTS];
+	size_t lens[EVENT_MAX_EVENTS];
+	int res;
+	char *buf;
+	CONN *c;
+	if(ur == NULL){
+		for(int i = 0; i < nready; i++)
+			conn_readable(ready[i]);
+		return;
+	}
+	for(int i = 0; i < nready; i++){
+		c = ready[i];
+		ops[i] = -1;
+		if(c->state != CONN_COMMITTING && c->state != CONN_CLOSING){
+			buf = conn_inspace(c, &lens[i]);
+			ops[i] = uring_queue_recv(ur, c->fd, buf, lens[i]);
+		}
+	}
+	uring_submit(ur);
+	for(int i = 0; i < nready; i++){
+		c = ready[i];
+		if(ops[i] < 0){
+			conn_readable(c);
+			continue;
+		}
+		res = uring_result(ur, ops[i]);
+		if(res > 0){
+			conn_received(c, res);
+			if((size_t)res == lens[i])
+				conn_readable(c);
+			else
+				conn_dirty(c);
+		}
+		else if(res == -EAGAIN || res == -EINTR){
+			conn_dirty(c);
+		}
+		else{
+			//Unexpected EOF or error
+			conn_close(c);
+		}
+	}
+}
+
+/*
+ * Thread function for an event loop.
+ */
+static void *loop_thread(void *arg){
+	EVENT_LOOP *loop = arg;
+	struct epoll_event events[EVENT_MAX_EVENTS];
+	CONN *ready[EVENT_MAX_EVENTS];
+	int n, nready;
+	block_server_signals();
+	if(server_config.uring)
+		uring_thread_init();
+	while(!loop->stop){
+		if((n = epoll_wait(loop->epfd, events, EVENT_MAX_EVENTS, -1)) < 0){
+			if(errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+		nready = 0;
+		for(int i = 0; i < n; i++){
+			CONN *c = events[i].data.ptr;
+			if(c == NULL){
+				loop_completions(loop);
+				continue;
+			}
+			//reading marks the connection for flushing as well
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ready[nready++] = c;
+			else if(events[i].events & EPOLLOUT)
+				conn_dirty(c);
+		}
+		loop_read(ready, nready);
+		loop_flush(loop);
+	}
+	uring_thread_fini();
+	return NULL;
+}
+
+/*
+ * Start the event loops.
+ *
+ * @param nloops  Number of loop threads to start (0 means one per core).
+ */
+void event_init(int nloops){
+	struct epoll_event ev;
+	if(nloops <= 0)
+		nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nloops <= 0)
+		nloops = 1;
+	debug("Starting %d event loops", nloops);
+	num_loops = nloops;
+	loops = Calloc(nloops, sizeof(EVENT_LOOP));
+	for(int i = 0; i < nloops; i++){
+		EVENT_LOOP *loop = &loops[i];
+		if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			unix_error("epoll_create1 error");
+		if((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+			unix_error("eventfd error");
+		pthread_mutex_init(&loop->mutex, NULL);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+		Pthread_create(&loop->tid, NULL, loop_thread, loop);
+	}
+	committers.stop = 0;
+	for(int i = 0; i < EVENT_COMMITTERS; i++)
+		Pthread_create(&committers.tids[i], NULL, committer_thread, NULL);
+}
+
+/*
+ * Hand a newly accepted connection to one of the event loops.
+ * The loop takes over the file descriptor and registers it with the
+ * client registry; transactions are created by the first request
+ * that needs one.
+ *
+ * @param connfd  The connected file descriptor.
+ */
+void event_dispatch(int connfd){
+	struct epoll_event ev;
+	CONN *c = Calloc(1, sizeof(CONN));
+	c->fd = connfd;
+	c->state = CONN_IDLE;
+	c->incap = c->outcap = CONN_BUFSIZE;
+	c->inbuf = Malloc(c->incap);
+	c->outbuf = Malloc(c->outcap);
+	arena_init(&c->arena);
+	c->loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % num_loops];
+	fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+	creg_register(client_registry, connfd);
+	//once registered with epoll the connection belongs to the loop thread,
+	//so it must not be touched after epoll_ctl()
+	c->events = EPOLLIN;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, connfd, &ev);
+}
+
+/*
+ * Stop the event loops and wait for their threads to exit.
+ * Should only be called once all client connections have been shut down.
+ */
+void event_fini(void){
+	uint64_t one = 1;
+	//the helpers post to the loops, so they go first
+	pthread_mutex_lock(&committers.mutex);
+	committers.stop = 1;
+	pthread_cond_broadcast(&committers.cond);
+	pthread_mutex_unlock(&committers.mutex);
+	for(int i = 0; i < EVENT_COMMITTERS; i++)
+		Pthread_join(committers.tids[i], NULL);
+	for(int i = 0; i < num_loops; i++){
+		loops[i].stop = 1;
+		if(write(loops[i].wakefd, &one, sizeof(one)) < 0)
+			debug("eventfd write failed");
+	}
+	for(int i = 0; i < num_loops; i++){
+		Pthread_join(loops[i].tid, NULL);
+		close(loops[i].epfd);
+		close(loops[i].wakefd);
+		pthread_mutex_destroy(&loops[i].mutex);
+	}
+	free(loops);
+	loops = NULL;
+	num_loops = 0;
+}
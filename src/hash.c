@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hash.h"
+
+static const uint64_t prime[4] = {
+	0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+	0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+static uint64_t seed;           // Mixed from the raw seed once, up front
+static pthread_once_t seed_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Multiply two words into a double word, leaving the halves in them.
+ */
+static inline void mum(uint64_t *a, uint64_t *b){
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t mum_fold(uint64_t a, uint64_t b){
+	mum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t read8(const unsigned char *p){
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t read4(const unsigned char *p){
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static void seed_set(uint64_t raw){
+	seed = raw ^ mum_fold(raw ^ prime[0], prime[1]);
+}
+
+static void seed_random(void){
+	uint64_t raw;
+	if(getrandom(&raw, sizeof(raw), 0) != sizeof(raw)){
+		//no entropy to be had, which still beats a fixed seed
+		raw = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&raw;
+	}
+	seed_set(raw);
+}
+
+static void seed_none(void){
+}
+
+/*
+ * Set the seed instead of drawing a random one.
+ */
+void hash_seed(uint64_t raw){
+	seed_set(raw);
+	pthread_once(&seed_once, seed_none);
+}
+
+/*
+ * Hash a string of bytes.
+ */
+uint64_t hash_bytes(const void *data, size_t len){
+	const unsigned char *p = data;
+	uint64_t s, a, b;
+	size_t i = len;
+	pthread_once(&seed_once, seed_random);
+	s = seed;
+	if(len <= 16){
+		if(len >= 4){
+			//two overlapping pairs of four cover anything from 4 to 16 bytes
+			a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+			b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+		}
+		else if(len > 0){
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else{
+			a = b = 0;
+		}
+	}
+	else{
+		if(i > 48){
+			uint64_t s1 = s, s2 = s;
+			do{
+				s = mum_fold(read8(p) ^ prime[1], read8(p + 8) ^ s);
+				s1 = mum_fold(read8(p + 16) ^ prime[2], read8(p + 24) ^ s1);
+				s2 = mum_fold(read8(p + 32) ^ prime[3], read8(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while(i > 48);
+			s ^= s1 ^ s2;
+		}
+		while(i > 16){
+			s = mum_fold(read8(p) ^ prime[1], read8(p + 8) ^ s);
+			p += 16;
+			i -= 16;
+		}
+		//the last sixteen bytes, overlapping what came before
+		a = read8(p + i - 16);
+		b = read8(p + i - 8);
+	}
+	a ^= prime[1];
+	b ^= s;
+	mum(&a, &b);
+	return mum_fold(a ^ prime[0] ^ len, b ^ prime[1]);
+}
+
+/*
+ * Compare two strings of bytes of the same length.
+ */
+int bytes_equal(const void *a, const void *b, size_t len){
+	const unsigned char *p = a, *q = b;
+#ifdef __SSE2__
+	if(len >= 16){
+		__m128i x, y;
+		//thirty-two bytes per test, folding the two halves together
+		for(; len >= 32; len -= 32, p += 32, q += 32){
+			x = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),
+				_mm_loadu_si128((const __m128i *)q));
+			y = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+				_mm_loadu_si128((const __m128i *)(q + 16)));
+			if(_mm_movemask_epi8(_mm_and_si128(x, y)) != 0xffff){
+				return 0;
+			}
+		}
+		if(len == 0){
+			return 1;
+		}
+		//sixteen bytes from here, if more than that are left, and the last
+		//sixteen, overlapping what came before
+		x = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + len - 16)),
+			_mm_loadu_si128((const __m128i *)(q + len - 16)));
+		if(len > 16){
+			y = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),
+				_mm_loadu_si128((const __m128i *)q));
+			x = _mm_and_si128(x, y);
+		}
+		return _mm_movemask_epi8(x) == 0xffff;
+	}
+#endif
+	for(; len >= 8; len -= 8, p += 8, q += 8){
+		if(read8(p) != read8(q)){
+			return 0;
+		}
+	}
+	if(len >= 4){
+		//two overlapping words of four cover the last 4 to 7 bytes
+		return read4(p) == read4(q) && read4(p + len - 4) == read4(q + len - 4);
+	}
+	for(; len > 0; len--){
+		if(*p++ != *q++){
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -3,6 +3,9 @@
  */
 #include "helper.h"
 #include "debug.h"
+#include "epoch.h"
+#include "map.h"
+#include "slab.h"
 
 /*Converts a string to a positive int
  *returns -1 if the string was not a integer
@@ -25,19 +28,18 @@ int string_to_int(char *string){
 	return number;
 }
 
-/* Hashing function used to create a unique has int for the string
- * @param The string create the hash
- * @return The unique hash of the string
+/*
+ * Block the signals that the main thread handles, so that they are
+ * never delivered to a thread that services clients.  Shutdown waits
+ * for those threads, so it must not run on one of them, and SIGUSR1 is
+ * only ever taken by the thread that prints the counters.
  */
-unsigned long hash(void *str){
-	unsigned long hash = 5381;
-	int character;
-	int i = 0;
-	while( (character = *((char *)(str+i))) ){
-		hash = ((hash << 5) + hash) + character; /* hash * 33 + c */
-		i++;
-	}
-    return hash % the_map.num_buckets; //This returns a number between 0 and num_buckets -1
+void block_server_signals(void){
+	sigset_t mask;
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGHUP);
+	Sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 }
 
 
@@ -78,9 +80,15 @@ void trans_destroy(TRANSACTION *tp){
 	//LOCK
 	pthread_mutex_lock(&tp->mutex);
 	//CRITICAL CODE
+	pthread_mutex_lock(&trans_list.mutex);
 	remove_transaction_from_LL(tp);
+	pthread_mutex_unlock(&trans_list.mutex);
 	//now that it has been unlinked, destroy it
 	sem_destroy(&(tp->sem));
+	//UNLOCK
+	//nobody else can reach it any more, and the unrefs below may destroy a
+	//long chain of dependents, which should not pile up held locks
+	pthread_mutex_unlock(&tp->mutex);
 	//Iterate through the LL of dependecies and free each one
 	DEPENDENCY *index_ptr = tp->depends; //tp->depends is the head
 	DEPENDENCY *dump = NULL;
@@ -89,274 +97,246 @@ void trans_destroy(TRANSACTION *tp){
 		dump = index_ptr;
 		trans_unref(index_ptr->trans, "trans unref from [trans_destroy]");
 		index_ptr = index_ptr->next; //get the next
-		free(dump);//free
+		slab_free(SLAB_DEPENDENCY, dump);//free
 	}
-	//UNLOCK
 	//Free the mutex
-	pthread_mutex_unlock(&tp->mutex);
 	//free the transaction
 	pthread_mutex_destroy(&(tp->mutex));
-	free(tp);
+	slab_free(SLAB_TRANSACTION, tp);
 }
 
 /*
- * Create a blank map entry.(Bucket)
- *
- * @param key
- * @return a pointer to the MAP_ENTRY
+ * Link a version in at the tail of an entry's list.
+ * The caller must hold the entry's lock.
  *
+ * @param map entry, the version
+ * @return the version
  */
-MAP_ENTRY *map_entry_create(KEY *kp){
-	//VERSION *head = version_create(NULL, NULL);//our sentinal head
-	//head->next = NULL;
-	MAP_ENTRY *m = malloc(sizeof(MAP_ENTRY));
-	m->key = kp;
-	m->versions = NULL; //LINKED LIST OF VERIONS
-	m->next = NULL; //next entry from this bucket
-	return m;
-}
-
-void map_entry_destroy(MAP_ENTRY *mp){
-	//we have to destroy this map entry
-	//we have to handle the versions
-	VERSION *index_ptr = mp->versions;
-	VERSION *dump;
-	while(index_ptr != NULL){
-		dump = index_ptr;
-		index_ptr = index_ptr->next;
-		version_dispose(dump);
+static VERSION *append_version(MAP_ENTRY *mp, VERSION *vp){
+	VERSION *tail = SLOT(mp)->tail;
+	vp->prev = tail;
+	if(tail == NULL){
+		SHARED_STORE(mp->versions, vp);
+	}
+	else{
+		SHARED_STORE(tail->next, vp);
 	}
-	key_dispose(mp->key);//throw away the key
-	free(mp);//free it
+	SHARED_STORE(SLOT(mp)->tail, vp);
+	SLOT(mp)->nversions++;
+	return vp;
 }
 
-/*
- * find a map entry of equal key
- * If map entry does not exist, it will add the key from input to the hashmap
- *
- * @param key
- * @return a pointer to the MAP_ENTRY
- *
- */
-MAP_ENTRY *find_map_entry(KEY *kp){
-	//We have to find the map entry whose key matches kp
-	//get our hash map the_map.table;
-	//LOCK
-	MAP_ENTRY *index_ptr;
-	pthread_mutex_lock(&the_map.mutex);
-	//Go find a match in the table
-	if(the_map.table[kp->hash] != NULL){//make sure we aren't accessing a null bucket
-		//found a bucket with a key entry, iterate through that
-		index_ptr = the_map.table[kp->hash];
-		while(index_ptr != NULL){
-			//compare the key
-			if(key_compare(index_ptr->key, kp) == 0){ //THE KEYS MATCH
-				//Since we found a redundant key, we need to dispose of the kp
-				key_dispose(kp);
-				pthread_mutex_unlock(&the_map.mutex);
-				return index_ptr;
-			}
-			index_ptr = index_ptr->next;
-		}
-	}
-	//If we are here, that means we didn't find a match, so add it to the table!
-	//we want to add it to the bucket equal to the hash
-	if(the_map.table[kp->hash] == NULL){//found a NULL bucket
-		//first key of the bucket
-		the_map.table[kp->hash] = map_entry_create(kp);
-		pthread_mutex_unlock(&the_map.mutex);
-		return the_map.table[kp->hash];
- 	}
- 	else{
- 		//other keys in this bucket
- 		index_ptr = the_map.table[kp->hash];
- 		while(index_ptr->next != NULL){
- 			index_ptr = index_ptr->next;
- 		}
- 		index_ptr->next = map_entry_create(kp);
- 		pthread_mutex_unlock(&the_map.mutex);
-		return index_ptr->next;
- 	}
+static void value_release(void *bp){
+	blob_unref(bp, "value not stored from [add_version]");
 }
 
 /*
  * we add a version of map entry
+ * The caller must hold the entry's lock, see map_lock_entry().
+ * A value that is not stored is freed once the lock is let go.
  *
  * @param map entry, transaction pointer, value
  *
  */
 VERSION *add_version(MAP_ENTRY *mp, TRANSACTION *tp, BLOB *value){
-	//first, we shall create the version
-	//LOCK
-	pthread_mutex_lock(&the_map.mutex);
-	// VERSION *vp = version_create(tp, value);
-	VERSION *index_ptr = mp->versions;
-	VERSION *temp;
-	//vp holds the version we want to create
+	//the latest version is the tail, no need to walk the list for it
+	VERSION *index_ptr = SLOT(mp)->tail;
 	//check the mp if there are any previous version existed
 	if(index_ptr == NULL){
 		//this map entry has no versions to it
-		//add the version to this map_entry
-		mp->versions = version_create(tp, value);
 		//a successful put!
-		pthread_mutex_unlock(&the_map.mutex);
-		return mp->versions;
+		return append_version(mp, version_create(tp, value));
 	}
-	else{
-		//index_ptr is not null
-		//this map entry has versions
-		//get the lastest version
-		while(index_ptr->next != NULL){
-			index_ptr = index_ptr->next;
-		}
-		//index_ptr has the lastest version
-		if(trans_get_status(index_ptr->creator) == TRANS_PENDING ){
-			//we can append this new version to a pending version
-			//check to see if the transaction ID is less than or equal to
-			if(index_ptr->creator->id == tp->id){
-				//versions are from same transaction, OVERWRITE IT
-				temp = index_ptr;//put the old lastest version in a temp
-				index_ptr = remove_version_from_LL(index_ptr, mp->versions);//get the prev
-				if(index_ptr == mp->versions){//IT WAS THE HEAD
-					//we were attempting to remove the head
-					//overwrite at the head
-					mp->versions = version_create(tp, value);//rewrite the head
-					index_ptr = mp->versions;//point to the newly created
-					version_dispose(temp);
-					pthread_mutex_unlock(&the_map.mutex);
-					return index_ptr;
-				}
-				else{//index_ptr is the version right before the one we want to overwrite
-					index_ptr->next = version_create(tp, value);//point to the newly created
-					//dispose original
-					version_dispose(temp);
-					pthread_mutex_unlock(&the_map.mutex);
-					return index_ptr->next;
-				}
-			}
-			//
-			else {
-				//transactoin id is not the same
-				//APPEND IT
-				if(index_ptr->creator->id > tp->id){
-					//a transaction id that is less was appended
-					trans_abort(tp);
-					//ABORT IT
-					pthread_mutex_unlock(&the_map.mutex);
-					return index_ptr; //return that version
-				}
-				trans_add_dependency(tp, index_ptr->creator);//add the dependency
-				index_ptr->next = version_create(tp, value);//append version
-				//Append was successful
-				pthread_mutex_unlock(&the_map.mutex);
-				return index_ptr->next;
-
-			}
+	//its creator may finish at any time, so look at its status only once
+	TRANS_STATUS latest_status = trans_get_status(index_ptr->creator);
+	if(latest_status == TRANS_PENDING){
+		//we can append this new version to a pending version
+		//check to see if the transaction ID is less than or equal to
+		if(index_ptr->creator->id == tp->id){
+			//versions are from same transaction, OVERWRITE IT
+			remove_version_from_LL(mp, index_ptr);
+			//dispose original
+			version_retire(index_ptr);
+			return append_version(mp, version_create(tp, value));
 		}
-		else if(trans_get_status(index_ptr->creator) == TRANS_ABORTED){
-			//we are attempting to add a version to a aborted transaction
-			//ABORT
-			trans_abort(tp); //abort this transaction
-			pthread_mutex_unlock(&the_map.mutex);
-			return index_ptr; //return that aborted version
+		if(index_ptr->creator->id > tp->id){
+			//a transaction id that is less was appended
+			//trans_abort() consumes a reference, the caller keeps its own
+			trans_abort(trans_ref(tp, "trans_ref from [add_version]"));
+			epoch_retire(value_release, value);
+			//ABORT IT
+			return index_ptr; //return that version
 		}
-		else if(trans_get_status(index_ptr->creator) == TRANS_COMMITTED){
-			//we can append this new verion to the commited version
-			index_ptr->next = version_create(tp, value);
-			//Append was successful
-			pthread_mutex_unlock(&the_map.mutex);
-			return index_ptr->next;
+		trans_add_dependency(tp, index_ptr->creator);//add the dependency
+		//Append was successful
+		return append_version(mp, version_create(tp, value));
+	}
+	else if(latest_status == TRANS_ABORTED){
+		//we are attempting to add a version to a aborted transaction
+		//ABORT
+		trans_abort(trans_ref(tp, "trans_ref from [add_version]")); //abort this transaction
+		epoch_retire(value_release, value);
+		return index_ptr; //return that aborted version
+	}
+	//we can append this new verion to the commited version
+	index_ptr = append_version(mp, version_create(tp, value));
+	//a later transaction may have read the committed value without
+	//the lock, in which case this one comes too late, as if it had
+	//found that reader's version in the way
+	if(map_last_reader(mp) > tp->id){
+		trans_abort(trans_ref(tp, "trans_ref from [add_version]"));
+	}
+	//Append was successful
+	return index_ptr;
+}
+
+/*
+ * Throw away a version and all the ones after it, aborting their
+ * creators if they are still pending: they were written on top of an
+ * aborted version, so they cannot commit.
+ *
+ * @return the number of versions thrown away
+ */
+static int cut_versions(MAP_ENTRY *mp, VERSION *vp, void (*retire)(VERSION *vp)){
+	VERSION *temp;
+	int n = 0;
+	if(vp->prev == NULL){
+		SHARED_STORE(mp->versions, NULL);
+	}
+	else{
+		SHARED_STORE(vp->prev->next, NULL);
+	}
+	SHARED_STORE(SLOT(mp)->tail, vp->prev);
+	while(vp != NULL){
+		temp = vp;
+		vp = vp->next;
+		if(trans_get_status(temp->creator) == TRANS_PENDING){
+			//trans_abort() consumes a reference, the version keeps its own
+			trans_abort(trans_ref(temp->creator, "trans_ref from [garbage_collect]"));
 		}
-		debug("Nothing happened");
-		pthread_mutex_unlock(&the_map.mutex);
-		return NULL;
+		retire(temp);//throw away this one
+		n++;
+	}
+	SLOT(mp)->nversions -= n;
+	return n;
+}
+
+static void creator_release(void *tp){
+	trans_unref(tp, "trans unref of a settled creator [garbage_collect]");
+}
+
+/*
+ * Let a committed version go of its creator, which then no longer
+ * stays around, with its lock, semaphore and the rest, for as long as
+ * the version is the entry's value.  The creator is only unreferenced
+ * once no lock-free reader can still be looking at its status.
+ * The caller must hold the entry's lock.
+ *
+ * @param the version
+ */
+static void version_settle(VERSION *vp){
+	TRANSACTION *tp = vp->creator;
+	if(tp != &trans_committed){
+		SHARED_STORE(vp->creator, &trans_committed);
+		epoch_defer(creator_release, tp);
 	}
 }
 
 /*
  * collect any transactions that are already commited
+ * The caller must hold the entry's lock, see map_lock_entry().
  *
- * @param map entry, transaction pointer, value
+ * A transaction commits only after those whose versions come before its
+ * own, so the committed versions are always at the head of the list,
+ * and only the ends of the list need to be looked at: the cost is that
+ * of the versions thrown away, not of the pending ones that stay.  An
+ * aborted version in the middle is left until it reaches either end;
+ * the pending versions after it cannot commit in the meantime anyway.
+ * The committed version that stays lets go of its creator.
+ *
+ * @param map entry, and the function to retire the versions thrown away
+ *   with, normally version_retire()
+ * @return the number of versions thrown away
  *
  */
-void garbage_collect(MAP_ENTRY *mp){
-	//LOCK
-	pthread_mutex_lock(&the_map.mutex);
-	VERSION *index_ptr = mp->versions;
-	VERSION *temp;
-	int recent = 0, i = 0;
-	if(index_ptr == NULL){
-		//UNLOCK
-		pthread_mutex_unlock(&the_map.mutex);
-		return;
+int garbage_collect(MAP_ENTRY *mp, void (*retire)(VERSION *vp)){
+	VERSION *index_ptr, *cut;
+	int n = 0;
+	//keep only the most recent of the committed versions at the head
+	while((index_ptr = mp->versions) != NULL && index_ptr->next != NULL
+		&& trans_get_status(index_ptr->creator) == TRANS_COMMITTED
+		&& trans_get_status(index_ptr->next->creator) == TRANS_COMMITTED){
+		remove_version_from_LL(mp, index_ptr);
+		retire(index_ptr);
+		n++;
 	}
-	for(i = 0; index_ptr != NULL; i++, index_ptr = index_ptr->next){
-		//i gets the version[i] we are on
-		if(index_ptr->creator != NULL){
-			if(trans_get_status(index_ptr->creator) == TRANS_ABORTED){
-				//we found a aborted version, we have to remove it and all next ones
-				//remove this one
-				if(index_ptr == mp->versions){//if we are removing the head node
-					temp = index_ptr;
-					mp->versions = index_ptr->next; //make the next one the new head
-					if(mp->versions == NULL){//if the head turned NULL
-						//don't call another abort
-					}
-					else{
-						if(mp->versions->next != NULL){//head exists, so check if there is a next
-							trans_abort(mp->versions->next->creator);//abort the next one
-						}
-					}
-					version_dispose(index_ptr);//dispose of the head
-				}
-				else {//we are not at the head
-					temp = index_ptr;
-					index_ptr = remove_version_from_LL(index_ptr, mp->versions);//index_ptr gets the previous
-					if(index_ptr->next != NULL){
-						trans_abort(index_ptr->next->creator);//abort the next one
-					}
-					version_dispose(temp);//throw away this one
-				}
-			}
-			else if(trans_get_status(index_ptr->creator) == TRANS_COMMITTED){
-				//we have to find the most recent one
-				recent = i;
-			}
-		}
+	//the first version that is not committed, if aborted, takes all the
+	//later ones with it
+	if(index_ptr != NULL && trans_get_status(index_ptr->creator) == TRANS_COMMITTED){
+		version_settle(index_ptr);
+		index_ptr = index_ptr->next;
 	}
-	//we took care of the aborts, now for the commits
-	//recent has the committed we want to keep
-	index_ptr = mp->versions;
-	for(i = 0; i < recent; i++, index_ptr = index_ptr->next){
-		if(trans_get_status(index_ptr->creator) == TRANS_COMMITTED){
-			//remove it
-			if(index_ptr == mp->versions){//if we are removing the firsts node
-				//remove the head
-				mp->versions = index_ptr->next;
-				version_dispose(index_ptr);
-			}
-			else{
-				//the node we want to remove is not the first one
-				temp = index_ptr;
-				index_ptr = remove_version_from_LL(index_ptr, mp->versions);
-				version_dispose(temp);
-			}
-		}
+	if(index_ptr != NULL && trans_get_status(index_ptr->creator) == TRANS_ABORTED){
+		return n + cut_versions(mp, index_ptr, retire);
 	}
-	//UNLOCK
-	pthread_mutex_unlock(&the_map.mutex);
+	//otherwise throw away any aborted versions at the tail
+	for(cut = NULL, index_ptr = SLOT(mp)->tail; index_ptr != NULL
+		&& trans_get_status(index_ptr->creator) == TRANS_ABORTED; index_ptr = index_ptr->prev){
+		cut = index_ptr;
+	}
+	if(cut != NULL){
+		n += cut_versions(mp, cut, retire);
+	}
+	return n;
 }
 
-VERSION *remove_version_from_LL(VERSION *vp, VERSION *head){
-	//start at the head
-	//remove vp while fixing next pointers
-	VERSION *prev_ptr = head; //get the FRONT
-	while(prev_ptr != vp){
-		prev_ptr = prev_ptr->next;
+/*
+ * Unlink a version from its entry's list.
+ * The caller must hold the entry's lock.
+ *
+ * @param map entry, the version
+ */
+void remove_version_from_LL(MAP_ENTRY *mp, VERSION *vp){
+	//the links on both sides make this a constant-time operation
+	if(vp->prev == NULL){
+		SHARED_STORE(mp->versions, vp->next);
+	}
+	else{
+		SHARED_STORE(vp->prev->next, vp->next);
+	}
+	if(vp->next == NULL){
+		SHARED_STORE(SLOT(mp)->tail, vp->prev);
 	}
-	//prev_ptr is the version right before
-	prev_ptr->next = vp->next;
+	else{
+		vp->next->prev = vp->prev;
+	}
+	SLOT(mp)->nversions--;
 	//vp is now removed
 	vp->next = NULL;
-	return prev_ptr;//pointer right before the deleted one
-}
\ No newline at end of file
+	vp->prev = NULL;
+}
+
+static void version_free(void *vp){
+	version_dispose(vp);
+}
+
+/*
+ * Dispose of a version that has been unlinked from its map entry, once
+ * no lock-free reader can still be looking at it.
+ *
+ * @param the version
+ */
+void version_retire(VERSION *vp){
+	epoch_defer(version_free, vp);
+}
+
+/*
+ * Find the latest version of a map entry.  This takes no lock, so the
+ * caller must hold the entry's lock or be in an epoch read section.
+ *
+ * @param map entry
+ * @return the latest version, or NULL if there are none
+ */
+VERSION *latest_version(MAP_ENTRY *mp){
+	return SHARED_LOAD(SLOT(mp)->tail);
+}
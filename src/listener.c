@@ -0,0 +1,175 @@
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include "listener.h"
+#include "csapp.h"
+#include "helper.h"
+#include "debug.h"
+
+typedef struct listener {
+	pthread_t tid;
+	int id;
+	int fd;
+	int cpu;                    // Core to pin to, or -1
+	atomic_ulong accepted;      // Connections accepted
+	unsigned long last_accepted;    // Count at the previous report
+	struct timespec last_report;    // Time of the previous report
+} LISTENER;
+
+static LISTENER *listeners;
+static int num_listeners;
+static struct timespec started;
+static volatile int stopping;
+//reports update the listeners' last counts, so they go one at a time
+static pthread_mutex_t show_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Like open_listenfd(), but with SO_REUSEPORT set so that several
+ * sockets can be bound to the same port.
+ *
+ * @return  The listening socket, or -1 on error.
+ */
+static int open_reuseport_listenfd(char *port){
+	struct addrinfo hints, *listp, *p;
+	int listenfd = -1, rc, optval = 1;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+	if((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0){
+		fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+		return -1;
+	}
+	for(p = listp; p; p = p->ai_next){
+		if((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+		if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0
+				&& bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(listenfd);
+		listenfd = -1;
+	}
+	freeaddrinfo(listp);
+	if(listenfd < 0)
+		return -1;
+	if(listen(listenfd, LISTENQ) < 0){
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+/*
+ * Pin the calling thread to one core.  This goes straight to the system
+ * call because the glibc wrappers need _GNU_SOURCE, which csapp.h does
+ * not tolerate.
+ *
+ * @return  0 on success, -1 otherwise.
+ */
+static int pin_thread(int cpu){
+	unsigned long mask[16];
+	if(cpu >= (int)(sizeof(mask) * 8))
+		return -1;
+	memset(mask, 0, sizeof(mask));
+	mask[cpu / (sizeof(long) * 8)] = 1UL << (cpu % (sizeof(long) * 8));
+	//pid 0 is the calling thread
+	return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0 ? -1 : 0;
+}
+
+/*
+ * Thread function for an accept thread.
+ */
+static void *listener_thread(void *arg){
+	LISTENER *l = arg;
+	struct sockaddr_storage clientaddr;
+	socklen_t clientlen;
+	int connfd;
+	block_server_signals();
+	if(l->cpu >= 0){
+		if(pin_thread(l->cpu) < 0)
+			debug("could not pin listener %d to cpu %d", l->id, l->cpu);
+	}
+	for(;;){
+		clientlen = sizeof(struct sockaddr_storage);
+		if((connfd = accept(l->fd, (SA *) &clientaddr, &clientlen)) < 0){
+			if(stopping)
+				break;
+			//the client may have given up before we got to it
+			if(errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+				continue;
+			unix_error("Accept error");
+		}
+		atomic_fetch_add_explicit(&l->accepted, 1, memory_order_relaxed);
+		xacto_dispatch(connfd);
+	}
+	return NULL;
+}
+
+/*
+ * Open the listening sockets and start their accept threads.
+ * Accepted connections are handed to xacto_dispatch().
+ *
+ * @param port  The port to listen on.
+ * @param nlisteners  Number of listening sockets and accept threads.
+ * @param pin  Nonzero to pin accept thread i to core i (modulo the
+ *   number of cores).
+ */
+void listener_start(char *port, int nlisteners, int pin){
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus <= 0)
+		ncpus = 1;
+	debug("Starting %d listeners", nlisteners);
+	num_listeners = nlisteners;
+	listeners = calloc(nlisteners, sizeof(LISTENER));
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	for(int i = 0; i < nlisteners; i++){
+		LISTENER *l = &listeners[i];
+		l->id = i;
+		l->cpu = pin ? i % ncpus : -1;
+		l->last_report = started;
+		atomic_init(&l->accepted, 0);
+		//all sockets are bound before any thread accepts, so none is left out
+		if((l->fd = open_reuseport_listenfd(port)) < 0)
+			unix_error("Open_listenfd error");
+	}
+	for(int i = 0; i < nlisteners; i++)
+		Pthread_create(&listeners[i].tid, NULL, listener_thread, &listeners[i]);
+}
+
+/*
+ * Close the listening sockets and wait for the accept threads to exit.
+ * The listeners themselves are kept, for the counts in the final report.
+ */
+void listener_stop(void){
+	stopping = 1;
+	//shutdown() wakes up a thread blocked in accept(), close() alone does not
+	for(int i = 0; i < num_listeners; i++)
+		shutdown(listeners[i].fd, SHUT_RDWR);
+	for(int i = 0; i < num_listeners; i++){
+		Pthread_join(listeners[i].tid, NULL);
+		close(listeners[i].fd);
+	}
+}
+
+/*
+ * Print per-listener accept counts and rates to stderr.
+ */
+void listener_show(void){
+	struct timespec now;
+	double since_start, since_last;
+	pthread_mutex_lock(&show_mutex);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	since_start = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+	for(int i = 0; i < num_listeners; i++){
+		LISTENER *l = &listeners[i];
+		unsigned long accepted = atomic_load(&l->accepted);
+		since_last = (now.tv_sec - l->last_report.tv_sec)
+			+ (now.tv_nsec - l->last_report.tv_nsec) / 1e9;
+		fprintf(stderr, "listener %d: %lu accepted, %.1f/s since last report, %.1f/s overall\n",
+			i, accepted,
+			since_last > 0 ? (accepted - l->last_accepted) / since_last : 0.0,
+			since_start > 0 ? accepted / since_start : 0.0);
+		l->last_accepted = accepted;
+		l->last_report = now;
+	}
+	pthread_mutex_unlock(&show_mutex);
+}
@@ -5,29 +5,48 @@
 #include "csapp.h"
 #include "helper.h"
 #include "server.h"
+#include "config.h"
+#include "event.h"
+#include "pool.h"
+#include "uring.h"
+#include "listener.h"
+#include "map.h"
+#include "epoch.h"
+#include "sweeper.h"
+#include "slab.h"
+
+#define USAGE "Usage: %s [-p <port>] [-m thread|pool|event] [-n <threads>] [-u] [-l <listeners>] [-a] [-k] [-b <buckets>] [-s <stripes>] [-t chained|open] [-g <usec>] [-H] [-L]\n"
 
 static void terminate(int status);
 static void sighup_handler(int status);
+static void *stats_thread(void *arg);
+static void show_stats(void);
 
 CLIENT_REGISTRY *client_registry;
-int *connfd;
 
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
     Signal(SIGHUP, sighup_handler); //sighup handlers here
+    //SIGUSR1 dumps the counters, from a thread that waits for it, so it
+    //stays blocked in every thread, all of which inherit this mask
+    sigset_t usr1;
+    pthread_t stats_tid;
+    Sigemptyset(&usr1);
+    Sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
     debug("pid: %d\n",getpid());
     if(argv[1] == NULL){
         //-p is not there
-        fprintf(stderr, "Usage: %s [-p <port>]\n", argv[0]);
+        fprintf(stderr, USAGE, argv[0]);
         exit(EXIT_FAILURE);
     }
     char optval;
     char *port;
     int port_checker = -1;
     while(optind < argc) {
-        if((optval = getopt(argc, argv, "p:?")) != -1) {
+        if((optval = getopt(argc, argv, "p:m:n:ul:akb:s:t:g:HL?")) != -1) {
             switch(optval) {
             case 'p':
             port_checker = string_to_int(optarg);
@@ -39,9 +58,93 @@ int main(int argc, char* argv[]){
             //port is valid
             port = optarg;
             break;
+            case 'm':
+            //connection servicing model
+            if(strcmp(optarg, "thread") == 0){
+                server_config.mode = SERVER_THREAD;
+            }
+            else if(strcmp(optarg, "pool") == 0){
+                server_config.mode = SERVER_POOL;
+            }
+            else if(strcmp(optarg, "event") == 0){
+                server_config.mode = SERVER_EVENT;
+            }
+            else{
+                fprintf(stderr, "invalid mode argument: %s [thread, pool, event]\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 'n':
+            //number of pool workers or event loops, 0 for one per core
+            if((server_config.nthreads = string_to_int(optarg)) < 0){
+                fprintf(stderr, "invalid thread count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 'u':
+            //io_uring sends (and event loop receives), if the kernel has it
+            server_config.uring = 1;
+            break;
+            case 'l':
+            //SO_REUSEPORT listeners, each with its own accept thread
+            if((server_config.listeners = string_to_int(optarg)) < 1){
+                fprintf(stderr, "invalid listener count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 'a':
+            //pin the accept threads to cores
+            server_config.pin = 1;
+            break;
+            case 'k':
+            //persistent sessions: a connection may run any number of transactions
+            server_config.persist = 1;
+            break;
+            case 'b':
+            //starting size of the store's hash table, it grows as needed
+            if((server_config.buckets = string_to_int(optarg)) < 1){
+                fprintf(stderr, "invalid bucket count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 's':
+            //lock stripes for the store, 0 for one lock over all of it
+            if((server_config.stripes = string_to_int(optarg)) < 0){
+                fprintf(stderr, "invalid stripe count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 't':
+            //layout of the store's hash table
+            if(strcmp(optarg, "chained") == 0){
+                server_config.table = TABLE_CHAINED;
+            }
+            else if(strcmp(optarg, "open") == 0){
+                server_config.table = TABLE_OPEN;
+            }
+            else{
+                fprintf(stderr, "invalid table argument: %s [chained, open]\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 'g':
+            //background garbage collection per sweeper wakeup, 0 for none
+            if((server_config.sweep = string_to_int(optarg)) < 0){
+                fprintf(stderr, "invalid sweep budget: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 'H':
+            //huge pages for the slabs
+            server_config.hugepages = 1;
+            break;
+            case 'L':
+            //lock hold time histogram in the stats
+            server_config.lockstats = 1;
+            break;
             case '?':
             //print Help Msg
-            fprintf(stderr, "Usage: %s [-p <port>]\n", argv[0]);
+            fprintf(stderr, USAGE, argv[0]);
             exit(EXIT_FAILURE);
             break;
             default:
@@ -53,9 +156,14 @@ int main(int argc, char* argv[]){
     //port has our port number
     // Perform required initializations of the client_registry,
     // transaction manager, and object store.
+    if(server_config.uring && uring_probe() == -1){
+        fprintf(stderr, "io_uring unavailable (%s), using read/write\n", strerror(errno));
+        server_config.uring = 0;
+    }
     client_registry = creg_init();
     trans_init();
     store_init();
+    Pthread_create(&stats_tid, NULL, stats_thread, NULL);
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
     // run function xacto_client_service().  In addition, you should install
@@ -65,17 +173,24 @@ int main(int argc, char* argv[]){
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
+    if(server_config.mode == SERVER_POOL){
+        pool_init(server_config.nthreads);
+    }
+    else if(server_config.mode == SERVER_EVENT){
+        event_init(server_config.nthreads);
+    }
+    if(server_config.listeners > 0){
+        //the accept threads take it from here, wait for SIGHUP
+        listener_start(port, server_config.listeners, server_config.pin);
+        while(1){
+            pause();
+        }
+    }
     listenfd = Open_listenfd(port); //file descriptor for listening(incoming connctions)
     while(1){
-        pthread_t tid;
         clientlen = sizeof(struct sockaddr_storage);
-        connfd = (int *) malloc(sizeof(int)); //malloc space for the connfd
-        *connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen); //connfd now has the connected file descriptor with accepted client
-        if(*connfd == -1){
-            break;
-        }
-        Pthread_create(&tid, NULL, xacto_client_service, connfd);
-        //free(connfd);
+        //Accept() exits on error, so there is no failure to handle here
+        xacto_dispatch(Accept(listenfd, (SA *) &clientaddr, &clientlen));
     }
     terminate(EXIT_FAILURE);
 }
@@ -86,17 +201,28 @@ int main(int argc, char* argv[]){
 void terminate(int status) {
     // Shutdown all client connections.
     // This will trigger the eventual termination of service threads.
-    free(connfd);
+    if(server_config.listeners > 0){
+        //no new connections once the registry is being emptied
+        listener_stop();
+    }
     creg_shutdown_all(client_registry);
 
     debug("Waiting for service threads to terminate...");
     creg_wait_for_empty(client_registry);
     debug("All service threads terminated.");
+    show_stats();
+    if(server_config.mode == SERVER_POOL){
+        pool_fini();
+    }
+    else if(server_config.mode == SERVER_EVENT){
+        event_fini();
+    }
 
     // Finalize modules.
     creg_fini(client_registry);
-    trans_fini();
+    //versions in the store hold transaction references, so the store goes first
     store_fini();
+    trans_fini();
 
     debug("Xacto server terminating");
     exit(status);
@@ -104,4 +230,38 @@ void terminate(int status) {
 
 void sighup_handler(int status){
     terminate(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
+
+/*
+ * Print the counters of the active modules to stderr.
+ */
+void show_stats(void){
+    xacto_show();
+    map_show();
+    epoch_show();
+    sweeper_show();
+    slab_show();
+    if(server_config.listeners > 0){
+        listener_show();
+    }
+    if(server_config.mode == SERVER_POOL){
+        pool_show();
+    }
+}
+
+/*
+ * Thread function that prints the counters whenever SIGUSR1 arrives.
+ * Printing takes locks and reads structures that other threads change,
+ * which is no business for a signal handler.
+ */
+void *stats_thread(void *arg){
+    sigset_t mask;
+    int sig;
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    while(sigwait(&mask, &sig) == 0){
+        show_stats();
+    }
+    return NULL;
+}
@@ -0,0 +1,680 @@
+#include <stdatomic.h>
+#include <time.h>
+#include "map.h"
+#include "helper.h"
+#include "debug.h"
+#include "epoch.h"
+#include "optable.h"
+#include "slab.h"
+
+/*
+ * A lock stripe, on a cache line of its own.
+ */
+typedef struct map_stripe {
+	pthread_mutex_t mutex;
+} __attribute__((aligned(64))) MAP_STRIPE;
+
+/*
+ * Locking and resize state.  The current table is the one in the_map.
+ */
+static struct {
+	pthread_rwlock_t resize_lock;   // Shared by operations, exclusive to swap tables
+	MAP_STRIPE *stripes;        // Stripe i guards the buckets whose index is i
+	                            // modulo nstripes, in both tables
+	int nstripes;               // 0 when the_map.mutex guards everything
+	int open;                   // Entries are in the open-addressing table
+	MAP_ENTRY **old;            // Table being emptied by a resize, or NULL
+	size_t old_buckets;         // Its size
+	atomic_size_t cursor;       // Next old bucket to be claimed for moving
+	atomic_size_t migrated;     // Old buckets moved so far
+	size_t min_buckets;         // Starting size, the table never gets smaller
+	atomic_long entries;        // Map entries in both tables
+	atomic_uint table_seq;      // Odd while resize() swaps tables
+	unsigned long resizes;
+	atomic_ulong holds[MAP_HOLD_BUCKETS];   // Lock hold times, see map_hold_times()
+} map_state;
+
+static __thread unsigned long hold_start;  // When the lock being timed was taken
+
+/*
+ * @return  The bucket for a hash in a table of the given size.
+ */
+static size_t bucket_of(int hash, size_t buckets){
+	return (unsigned int)hash & (buckets - 1);
+}
+
+static unsigned long hold_clock(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Start timing a lock that has just been taken, if lock hold times are
+ * being kept.
+ */
+static inline void hold_begin(void){
+	if(server_config.lockstats){
+		hold_start = hold_clock();
+	}
+}
+
+/*
+ * @return  How long the lock timed by hold_begin() has been held, to be
+ *   taken just before it is let go and passed to hold_record() after.
+ */
+static inline unsigned long hold_end(void){
+	return server_config.lockstats ? hold_clock() - hold_start : 0;
+}
+
+static void hold_record(unsigned long ns){
+	int i;
+	if(server_config.lockstats){
+		i = ns > 1 ? 63 - __builtin_clzl(ns) : 0;
+		atomic_fetch_add_explicit(&map_state.holds[i < MAP_HOLD_BUCKETS ? i : MAP_HOLD_BUCKETS - 1], 1,
+			memory_order_relaxed);
+	}
+}
+
+/*
+ * Lock and unlock the stripe for a bucket index (or hash).  Both tables
+ * are at least nstripes buckets in size, so a bucket and every bucket
+ * its entries move to in a resize share a stripe.
+ */
+static void stripe_lock(size_t i){
+	if(map_state.nstripes > 0){
+		pthread_mutex_lock(&map_state.stripes[i & (map_state.nstripes - 1)].mutex);
+	}
+}
+
+static void stripe_unlock(size_t i){
+	if(map_state.nstripes > 0){
+		pthread_mutex_unlock(&map_state.stripes[i & (map_state.nstripes - 1)].mutex);
+	}
+}
+
+/*
+ * Set up an empty table.
+ */
+void map_init(size_t buckets, int stripes, TABLE_KIND table){
+	size_t n = NUM_BUCKETS;
+	int s = 1;
+	memset(&map_state, 0, sizeof(map_state));
+	if(stripes > 0){
+		while(s < stripes){
+			s <<= 1;
+		}
+		map_state.nstripes = s;
+		map_state.stripes = calloc(s, sizeof(MAP_STRIPE));
+		for(int i = 0; i < s; i++){
+			pthread_mutex_init(&map_state.stripes[i].mutex, NULL);
+		}
+	}
+	pthread_rwlock_init(&map_state.resize_lock, NULL);
+	if(table == TABLE_OPEN){
+		map_state.open = 1;
+		optable_init(buckets, s);
+		return;
+	}
+	while(n < buckets || n < (size_t)map_state.nstripes){
+		n <<= 1;
+	}
+	the_map.num_buckets = n;
+	the_map.table = calloc(n, sizeof(MAP_ENTRY *));
+	map_state.min_buckets = n;
+}
+
+/*
+ * Create a blank map entry.(Bucket)
+ * The key is only borrowed: the entry gets a copy of it.
+ *
+ * @param key
+ * @return a pointer to the MAP_ENTRY
+ *
+ */
+MAP_ENTRY *map_entry_create(KEY *kp){
+	size_t size = kp->blob->size;
+	//the key is copied into the entry, which keeps no allocation of its own
+	MAP_SLOT *slot = size <= MAP_SLOT_KEY_MAX ? slab_alloc(SLAB_ENTRY) : malloc(sizeof(MAP_SLOT) + size + 1);
+	MAP_ENTRY *m = &slot->entry;
+	atomic_init(&slot->reader, 0);
+	slot->tail = NULL;
+	slot->nversions = 0;
+	slot->key.hash = kp->hash;
+	slot->key.blob = &slot->key_blob;
+	//also the entry's lock, see MAP_SLOT
+	pthread_mutex_init(&slot->key_blob.mutex, NULL);
+	slot->key_blob.refcnt = 1;
+	slot->key_blob.size = size;
+	slot->key_blob.content = slot->key_bytes;
+	slot->key_blob.prefix = slot->key_bytes;
+	if(size > 0){
+		memcpy(slot->key_bytes, kp->blob->content, size);
+	}
+	slot->key_bytes[size] = '\0';
+	m->key = &slot->key;
+	m->versions = NULL; //LINKED LIST OF VERIONS
+	m->next = NULL; //next entry from this bucket
+	return m;
+}
+
+void map_entry_destroy(MAP_ENTRY *mp){
+	//we have to destroy this map entry
+	//we have to handle the versions
+	VERSION *index_ptr = mp->versions;
+	VERSION *dump;
+	while(index_ptr != NULL){
+		dump = index_ptr;
+		index_ptr = index_ptr->next;
+		version_dispose(dump);
+	}
+	//the key goes with the entry
+	pthread_mutex_destroy(SLOT_LOCK(mp));
+	//free it, the way it was allocated
+	if(SLOT(mp)->key_blob.size <= MAP_SLOT_KEY_MAX){
+		slab_free(SLAB_ENTRY, SLOT(mp));
+	}
+	else{
+		free(SLOT(mp));
+	}
+}
+
+/*
+ * Make a view of some content as a key, without copying it.
+ */
+KEY *key_view(KEY_VIEW *vp, char *content, size_t size){
+	vp->blob.refcnt = 1;
+	vp->blob.size = size;
+	vp->blob.content = content;
+	vp->blob.prefix = content;
+	vp->key.blob = &vp->blob;
+	vp->key.hash = blob_hash(&vp->blob);
+	return &vp->key;
+}
+
+static void map_entry_free(void *mp){
+	map_entry_destroy(mp);
+}
+
+/*
+ * Report whether an entry has no versions and nobody is working on it.
+ * The caller must hold the entry's stripe: whoever holds an entry's
+ * lock got it through that stripe, so an entry whose lock is free is not
+ * in use.
+ */
+int map_entry_unused(MAP_ENTRY *mp){
+	int empty = 0;
+	if(pthread_mutex_trylock(SLOT_LOCK(mp)) == 0){
+		empty = mp->versions == NULL;
+		pthread_mutex_unlock(SLOT_LOCK(mp));
+	}
+	return empty;
+}
+
+/*
+ * Destroy an entry that has been unlinked from the table, once no
+ * lock-free reader can still be looking at it.
+ */
+void map_entry_retire(MAP_ENTRY *mp){
+	epoch_defer(map_entry_free, mp);
+}
+
+/*
+ * Destroy the entries of one table and free it.
+ */
+static void table_destroy(MAP_ENTRY **table, size_t buckets){
+	MAP_ENTRY *index_ptr, *dump;
+	for(size_t i = 0; i < buckets; i++){
+		index_ptr = table[i];
+		while(index_ptr != NULL){
+			dump = index_ptr;
+			index_ptr = index_ptr->next;
+			map_entry_destroy(dump);
+		}
+	}
+	free(table);
+}
+
+/*
+ * Destroy every map entry and free the table.
+ */
+void map_fini(void){
+	if(map_state.open){
+		optable_fini();
+	}
+	else if(map_state.old != NULL){
+		table_destroy(map_state.old, map_state.old_buckets);
+	}
+	if(the_map.table != NULL){
+		table_destroy(the_map.table, the_map.num_buckets);
+	}
+	the_map.table = NULL;
+	the_map.num_buckets = 0;
+	for(int i = 0; i < map_state.nstripes; i++){
+		pthread_mutex_destroy(&map_state.stripes[i].mutex);
+	}
+	free(map_state.stripes);
+	pthread_rwlock_destroy(&map_state.resize_lock);
+	memset(&map_state, 0, sizeof(map_state));
+}
+
+/*
+ * Move one bucket of the old table into the current table.  Moving a
+ * bucket that has already been moved does nothing.  The caller must
+ * hold the bucket's stripe.
+ */
+static void move_bucket(size_t i){
+	MAP_ENTRY *mp = map_state.old[i], *next, **bucket;
+	SHARED_STORE(map_state.old[i], NULL);
+	for(; mp != NULL; mp = next){
+		next = mp->next;
+		bucket = &the_map.table[bucket_of(mp->key->hash, the_map.num_buckets)];
+		//a reader still on the old chain carries on down the new one
+		SHARED_STORE(mp->next, *bucket);
+		SHARED_STORE(*bucket, mp);
+	}
+}
+
+/*
+ * Move the next few buckets of the old table, if there is one, into the
+ * current table.  The caller must not hold any stripe.
+ */
+static void rehash_step(void){
+	size_t i;
+	if(map_state.old == NULL){
+		return;
+	}
+	for(int k = 0; k < MAP_REHASH_STEP; k++){
+		if((i = atomic_fetch_add(&map_state.cursor, 1)) >= map_state.old_buckets){
+			break;
+		}
+		stripe_lock(i);
+		move_bucket(i);
+		stripe_unlock(i);
+		atomic_fetch_add(&map_state.migrated, 1);
+	}
+}
+
+/*
+ * Report whether the table needs the exclusive attention of resize():
+ * a finished rehash to clean up, or a load that calls for a new size.
+ */
+static int resize_due(void){
+	size_t buckets = the_map.num_buckets;
+	size_t entries = atomic_load(&map_state.entries);
+	if(map_state.old != NULL){
+		return atomic_load(&map_state.migrated) == map_state.old_buckets;
+	}
+	return entries > buckets
+		|| (buckets > map_state.min_buckets && entries < buckets / MAP_SHRINK_RATIO);
+}
+
+/*
+ * Free the old table once it is empty, and start a resize if the load
+ * calls for one.  Nothing else may be using the map, except lock-free
+ * readers, which check table_seq to see that they found a consistent
+ * pair of tables.
+ */
+static void resize(void){
+	size_t buckets = the_map.num_buckets, n;
+	size_t entries = atomic_load(&map_state.entries);
+	MAP_ENTRY **table;
+	if(map_state.old != NULL){
+		if(atomic_load(&map_state.migrated) < map_state.old_buckets){
+			return;
+		}
+		debug("rehash to %d buckets done", the_map.num_buckets);
+		table = map_state.old;
+		atomic_fetch_add(&map_state.table_seq, 1);
+		SHARED_STORE(map_state.old, NULL);
+		atomic_fetch_add(&map_state.table_seq, 1);
+		epoch_defer(free, table);
+	}
+	if(entries > buckets){
+		n = buckets * 2;
+	}
+	else if(buckets > map_state.min_buckets && entries < buckets / MAP_SHRINK_RATIO){
+		n = buckets / 2;
+	}
+	else{
+		return;
+	}
+	debug("resizing map from %zu to %zu buckets", buckets, n);
+	table = calloc(n, sizeof(MAP_ENTRY *));
+	atomic_store(&map_state.cursor, 0);
+	atomic_store(&map_state.migrated, 0);
+	atomic_fetch_add(&map_state.table_seq, 1);
+	SHARED_STORE(map_state.old, the_map.table);
+	SHARED_STORE(map_state.old_buckets, buckets);
+	SHARED_STORE(the_map.table, table);
+	SHARED_STORE(the_map.num_buckets, n);
+	atomic_fetch_add(&map_state.table_seq, 1);
+	map_state.resizes++;
+}
+
+/*
+ * Look for a key in one bucket.  Entries with no versions left that are
+ * passed on the way, and that nobody is working on, are dropped.
+ *
+ * @return  The entry for the key, or NULL.
+ */
+static MAP_ENTRY *bucket_find(MAP_ENTRY **link, KEY *kp){
+	MAP_ENTRY *mp;
+	while((mp = *link) != NULL){
+		if(key_compare(mp->key, kp) == 0){
+			return mp;
+		}
+		if(map_entry_unused(mp)){
+			//lock-free readers may still be looking at it
+			SHARED_STORE(*link, mp->next);
+			map_entry_retire(mp);
+			atomic_fetch_sub(&map_state.entries, 1);
+			continue;
+		}
+		link = &mp->next;
+	}
+	return NULL;
+}
+
+/*
+ * find a map entry of equal key
+ * If map entry does not exist, it will add a copy of the key to the hashmap
+ * The caller must hold the stripe for the key (or the map mutex, if
+ * the map is not striped).
+ *
+ * @param key
+ * @return a pointer to the MAP_ENTRY
+ *
+ */
+MAP_ENTRY *find_map_entry(KEY *kp){
+	MAP_ENTRY *mp, **bucket;
+	//the key's bucket in the old table is moved before the key is looked for
+	if(map_state.old != NULL){
+		move_bucket(bucket_of(kp->hash, map_state.old_buckets));
+	}
+	bucket = &the_map.table[bucket_of(kp->hash, the_map.num_buckets)];
+	if((mp = bucket_find(bucket, kp)) != NULL){
+		//the key is the caller's, whichever way this goes
+		return mp;
+	}
+	//If we are here, that means we didn't find a match, so add it to the table!
+	mp = map_entry_create(kp);
+	mp->next = *bucket;
+	SHARED_STORE(*bucket, mp);
+	atomic_fetch_add(&map_state.entries, 1);
+	return mp;
+}
+
+/*
+ * Look for a key in a chain without taking any lock.
+ */
+static MAP_ENTRY *chain_find(MAP_ENTRY *mp, KEY *kp){
+	for(; mp != NULL; mp = SHARED_LOAD(mp->next)){
+		if(key_compare(mp->key, kp) == 0){
+			return mp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the entry for a key without taking any lock.
+ */
+MAP_ENTRY *map_find_entry(KEY *kp){
+	MAP_ENTRY **table, **old, *mp;
+	size_t buckets, old_buckets;
+	unsigned int seq;
+	if(map_state.open){
+		return optable_find(kp);
+	}
+	seq = atomic_load(&map_state.table_seq);
+	if(seq & 1){
+		return NULL;
+	}
+	table = SHARED_LOAD(the_map.table);
+	buckets = SHARED_LOAD(the_map.num_buckets);
+	old = SHARED_LOAD(map_state.old);
+	old_buckets = SHARED_LOAD(map_state.old_buckets);
+	if(atomic_load(&map_state.table_seq) != seq){
+		return NULL;
+	}
+	//an entry on its way between the tables may be missed, which only
+	//sends the caller down the locked path
+	if(old != NULL && (mp = chain_find(SHARED_LOAD(old[bucket_of(kp->hash, old_buckets)]), kp)) != NULL){
+		return mp;
+	}
+	return chain_find(SHARED_LOAD(table[bucket_of(kp->hash, buckets)]), kp);
+}
+
+/*
+ * Record that a transaction read the committed value of an entry
+ * without its lock.
+ */
+void map_note_reader(MAP_ENTRY *mp, TRANSACTION *tp){
+	unsigned int id = atomic_load(&SLOT(mp)->reader);
+	while(id < tp->id && !atomic_compare_exchange_weak(&SLOT(mp)->reader, &id, tp->id));
+}
+
+/*
+ * @return  The highest ID passed to map_note_reader() for an entry.
+ */
+unsigned int map_last_reader(MAP_ENTRY *mp){
+	return atomic_load(&SLOT(mp)->reader);
+}
+
+/*
+ * Begin a group of map operations.
+ */
+void map_begin(void){
+	epoch_hold();
+	if(map_state.nstripes > 0){
+		//shards of the open-addressing table are rebuilt under their stripe
+		if(!map_state.open){
+			pthread_rwlock_rdlock(&map_state.resize_lock);
+		}
+	}
+	else{
+		pthread_mutex_lock(&the_map.mutex);
+		hold_begin();
+	}
+}
+
+/*
+ * End a group of map operations.
+ */
+void map_end(void){
+	int due = !map_state.open && resize_due();
+	unsigned long held;
+	if(map_state.nstripes == 0){
+		if(due){
+			resize();
+		}
+		held = hold_end();
+		pthread_mutex_unlock(&the_map.mutex);
+		hold_record(held);
+	}
+	else if(!map_state.open){
+		pthread_rwlock_unlock(&map_state.resize_lock);
+		if(due){
+			pthread_rwlock_wrlock(&map_state.resize_lock);
+			resize();
+			pthread_rwlock_unlock(&map_state.resize_lock);
+		}
+	}
+	//what the group threw away goes now, with nothing locked
+	epoch_unhold();
+}
+
+/*
+ * Find the entry for a key, creating it if there is none, and lock its
+ * version list.
+ */
+MAP_ENTRY *map_lock_entry(KEY *kp){
+	MAP_ENTRY *mp;
+	int hash = kp->hash;
+	if(map_state.open){
+		stripe_lock(hash);
+		mp = optable_find_or_add(kp);
+	}
+	else{
+		//every operation does its share of a resize in progress
+		rehash_step();
+		stripe_lock(hash);
+		mp = find_map_entry(kp);
+	}
+	if(map_state.nstripes > 0){
+		//the entry is locked before the stripe is let go, so that it
+		//cannot be dropped in between
+		pthread_mutex_lock(SLOT_LOCK(mp));
+		hold_begin();
+	}
+	stripe_unlock(hash);
+	return mp;
+}
+
+/*
+ * Unlock the version list of an entry locked by map_lock_entry().
+ */
+void map_unlock_entry(MAP_ENTRY *mp){
+	unsigned long held;
+	if(map_state.nstripes > 0){
+		held = hold_end();
+		pthread_mutex_unlock(SLOT_LOCK(mp));
+		hold_record(held);
+	}
+}
+
+/*
+ * Run a sweep function on an entry, unless someone else has it locked.
+ * Nobody can lock it in the meantime: that takes the entry's stripe,
+ * which the sweep holds.
+ */
+static void sweep_entry(MAP_ENTRY *mp, void *arg){
+	void (**fnp)(MAP_ENTRY *mp) = arg;
+	unsigned long held;
+	//with no stripes, it is the map mutex that is being timed
+	int timed = map_state.nstripes > 0;
+	if(pthread_mutex_trylock(SLOT_LOCK(mp)) == 0){
+		if(timed){
+			hold_begin();
+		}
+		(*fnp)(mp);
+		held = timed ? hold_end() : 0;
+		pthread_mutex_unlock(SLOT_LOCK(mp));
+		if(timed){
+			hold_record(held);
+		}
+	}
+}
+
+/*
+ * Sweep the entries of one bucket of the chained table, dropping those
+ * left unused.  The caller must hold the bucket's stripe.
+ */
+static void sweep_bucket(MAP_ENTRY **link, void (*fn)(MAP_ENTRY *mp)){
+	MAP_ENTRY *mp;
+	while((mp = *link) != NULL){
+		sweep_entry(mp, &fn);
+		if(map_entry_unused(mp)){
+			//lock-free readers may still be looking at it
+			SHARED_STORE(*link, mp->next);
+			map_entry_retire(mp);
+			atomic_fetch_sub(&map_state.entries, 1);
+			continue;
+		}
+		link = &mp->next;
+	}
+}
+
+/*
+ * Visit a few of the entries in the table, carrying on from where the
+ * last call left off.
+ */
+int map_sweep(MAP_CURSOR *cursor, size_t n, void (*fn)(MAP_ENTRY *mp)){
+	size_t end;
+	int done = 0;
+	map_begin();
+	if(map_state.open){
+		stripe_lock(cursor->shard);
+		cursor->pos = optable_sweep(cursor->shard, cursor->pos, n, sweep_entry, &fn);
+		stripe_unlock(cursor->shard);
+		if(cursor->pos == 0 && ++cursor->shard >= (size_t)(map_state.nstripes > 0 ? map_state.nstripes : 1)){
+			cursor->shard = 0;
+			done = 1;
+		}
+	}
+	else{
+		//the table may have shrunk since the last call
+		end = cursor->pos + n < (size_t)the_map.num_buckets ? cursor->pos + n : (size_t)the_map.num_buckets;
+		for(; cursor->pos < end; cursor->pos++){
+			stripe_lock(cursor->pos);
+			sweep_bucket(&the_map.table[cursor->pos], fn);
+			stripe_unlock(cursor->pos);
+		}
+		if(cursor->pos >= (size_t)the_map.num_buckets){
+			cursor->pos = 0;
+			done = 1;
+		}
+	}
+	map_end();
+	return done;
+}
+
+/*
+ * Read the histogram of lock hold times.
+ */
+unsigned long map_hold_times(unsigned long counts[MAP_HOLD_BUCKETS]){
+	unsigned long total = 0;
+	for(int i = 0; i < MAP_HOLD_BUCKETS; i++){
+		counts[i] = atomic_load_explicit(&map_state.holds[i], memory_order_relaxed);
+		total += counts[i];
+	}
+	return total;
+}
+
+/*
+ * Print the lock hold times to stderr, as the bounds under which the
+ * median and the tail fall.
+ */
+static void hold_show(void){
+	static const double tails[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long counts[MAP_HOLD_BUCKETS], seen = 0;
+	unsigned long total = map_hold_times(counts);
+	int i = 0, last = 0;
+	fprintf(stderr, "store: locks held %lu times", total);
+	for(int t = 0; t < 4 && total > 0; t++){
+		while(seen + counts[i] < tails[t] * total){
+			seen += counts[i++];
+		}
+		fprintf(stderr, ", %g%% under %lu ns", tails[t] * 100, 2UL << i);
+	}
+	for(int j = 0; j < MAP_HOLD_BUCKETS; j++){
+		if(counts[j] > 0){
+			last = j;
+		}
+	}
+	if(total > 0){
+		fprintf(stderr, ", longest under %lu ns", 2UL << last);
+	}
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Print the size and load of the table to stderr.
+ */
+void map_show(void){
+	long entries = atomic_load(&map_state.entries);
+	if(map_state.open){
+		optable_show();
+	}
+	else{
+		fprintf(stderr, "store: %ld keys in %d buckets (load %.2f), %lu resizes%s, %d lock stripes\n",
+			entries, the_map.num_buckets,
+			the_map.num_buckets > 0 ? (double)entries / the_map.num_buckets : 0.0,
+			map_state.resizes, map_state.old != NULL ? ", rehash in progress" : "",
+			map_state.nstripes);
+	}
+	if(server_config.lockstats){
+		hold_show();
+	}
+}
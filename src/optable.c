@@ -0,0 +1,293 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "optable.h"
+#include "map.h"
+#include "helper.h"
+#include "epoch.h"
+#include "csapp.h"
+
+/*
+ * A slot.  The hash and length let most mismatches be turned away
+ * without following the entry to its key.
+ */
+typedef struct op_slot {
+	unsigned int hash;          // KEY.hash of the entry's key
+	unsigned int size;          // Length of the entry's key
+	MAP_ENTRY *entry;
+} OP_SLOT;
+
+/*
+ * The table of one shard, allocated in one piece: the control bytes (as
+ * words, two per group) and then the slots.
+ */
+typedef struct op_table {
+	size_t groups;              // Number of groups, a power of two
+	size_t used;                // Full slots
+	OP_SLOT *slots;
+	uint64_t ctrl[];
+} OP_TABLE;
+
+typedef struct op_shard {
+	OP_TABLE *table;            // Replaced by rebuilds
+	unsigned long rebuilds;
+	unsigned long dropped;      // Unused entries dropped by rebuilds
+} __attribute__((aligned(64))) OP_SHARD;
+
+static struct {
+	OP_SHARD *shards;
+	int nshards;
+	size_t min_groups;          // Starting size of each shard
+} optable;
+
+/*
+ * Remix a key hash, whose low bits also pick the shard, for the group
+ * and the tag.
+ */
+static unsigned int mix(unsigned int h){
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static unsigned char *ctrl_bytes(OP_TABLE *t){
+	return (unsigned char *)t->ctrl;
+}
+
+static OP_TABLE *table_create(size_t groups){
+	size_t nslots = groups * OPTABLE_GROUP;
+	OP_TABLE *t = Malloc(sizeof(OP_TABLE) + nslots + nslots * sizeof(OP_SLOT));
+	t->groups = groups;
+	t->used = 0;
+	t->slots = (OP_SLOT *)(ctrl_bytes(t) + nslots);
+	memset(t->ctrl, OPTABLE_EMPTY, nslots);
+	return t;
+}
+
+/*
+ * Compare the control bytes of a group against a tag.
+ *
+ * @param emptyp  Set to the mask of empty slots in the group.
+ * @return  The mask of slots in the group whose tag matches.
+ */
+static unsigned int group_match(OP_TABLE *t, size_t g, unsigned char tag, unsigned int *emptyp){
+	//a writer may be filling a slot of the group, so the words are loaded
+	//atomically and only then compared
+	uint64_t lo = __atomic_load_n(&t->ctrl[2 * g], __ATOMIC_ACQUIRE);
+	uint64_t hi = __atomic_load_n(&t->ctrl[2 * g + 1], __ATOMIC_ACQUIRE);
+#ifdef __SSE2__
+	__m128i ctrl = _mm_set_epi64x((long long)hi, (long long)lo);
+	*emptyp = _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)OPTABLE_EMPTY)));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+	unsigned int match = 0, empty = 0;
+	for(int i = 0; i < OPTABLE_GROUP; i++){
+		unsigned char c = (i < 8 ? lo >> (8 * i) : hi >> (8 * (i - 8))) & 0xff;
+		match |= (c == tag) << i;
+		empty |= (c == OPTABLE_EMPTY) << i;
+	}
+	*emptyp = empty;
+	return match;
+#endif
+}
+
+/*
+ * Look for a key in a table.
+ *
+ * @param freep  If not NULL, set to the slot where the key would go
+ *   when it is not found.
+ * @return  The entry for the key, or NULL.
+ */
+static MAP_ENTRY *probe(OP_TABLE *t, KEY *kp, size_t *freep){
+	unsigned int h = mix(kp->hash), match, empty;
+	unsigned char tag = h >> 25;
+	unsigned int size = kp->blob->size;
+	size_t mask = t->groups - 1, g = h & mask;
+	OP_SLOT *sp;
+	MAP_ENTRY *mp;
+	for(size_t step = 1; ; step++){
+		match = group_match(t, g, tag, &empty);
+		for(; match != 0; match &= match - 1){
+			sp = &t->slots[g * OPTABLE_GROUP + __builtin_ctz(match)];
+			if(__atomic_load_n(&sp->hash, __ATOMIC_RELAXED) == (unsigned int)kp->hash
+				&& __atomic_load_n(&sp->size, __ATOMIC_RELAXED) == size){
+				mp = __atomic_load_n(&sp->entry, __ATOMIC_ACQUIRE);
+				if(key_compare(mp->key, kp) == 0){
+					return mp;
+				}
+			}
+		}
+		//the table is never full, so some group has room
+		if(empty != 0){
+			if(freep != NULL){
+				*freep = g * OPTABLE_GROUP + __builtin_ctz(empty);
+			}
+			return NULL;
+		}
+		g = (g + step) & mask;
+	}
+}
+
+/*
+ * Fill a free slot found by probe().  The tag is written last, so a
+ * lock-free reader that sees it sees the rest of the slot.
+ */
+static void slot_fill(OP_TABLE *t, size_t i, MAP_ENTRY *mp){
+	OP_SLOT *sp = &t->slots[i];
+	__atomic_store_n(&sp->hash, (unsigned int)mp->key->hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&sp->size, (unsigned int)mp->key->blob->size, __ATOMIC_RELAXED);
+	__atomic_store_n(&sp->entry, mp, __ATOMIC_RELEASE);
+	__atomic_store_n(&ctrl_bytes(t)[i], mix(mp->key->hash) >> 25, __ATOMIC_RELEASE);
+	t->used++;
+}
+
+/*
+ * Rebuild a shard into a new table, dropping entries that nobody uses.
+ * The caller must hold the shard's stripe.
+ */
+static void rebuild(OP_SHARD *shp){
+	OP_TABLE *old = shp->table, *t;
+	size_t groups = optable.min_groups, i, slot;
+	MAP_ENTRY *mp, **dropped = Malloc(old->used * sizeof(MAP_ENTRY *));
+	int ndropped = 0;
+	//size for the entries there are now, at half the load that triggers
+	//a rebuild; dropped entries make room for the next one
+	while(old->used * 16 > groups * OPTABLE_GROUP * OPTABLE_MAX_LOAD){
+		groups <<= 1;
+	}
+	t = table_create(groups);
+	for(i = 0; i < old->groups * OPTABLE_GROUP; i++){
+		if(ctrl_bytes(old)[i] == OPTABLE_EMPTY){
+			continue;
+		}
+		mp = old->slots[i].entry;
+		if(map_entry_unused(mp)){
+			dropped[ndropped++] = mp;
+			continue;
+		}
+		probe(t, mp->key, &slot);
+		slot_fill(t, slot, mp);
+	}
+	SHARED_STORE(shp->table, t);
+	//lock-free readers may still be looking at the old table
+	epoch_defer(free, old);
+	for(int j = 0; j < ndropped; j++){
+		map_entry_retire(dropped[j]);
+	}
+	free(dropped);
+	shp->rebuilds++;
+	shp->dropped += ndropped;
+}
+
+/*
+ * Set up empty shards.
+ */
+void optable_init(size_t slots, int shards){
+	size_t groups = 1;
+	while(groups * OPTABLE_GROUP * shards < slots){
+		groups <<= 1;
+	}
+	optable.nshards = shards;
+	optable.min_groups = groups;
+	optable.shards = aligned_alloc(64, shards * sizeof(OP_SHARD));
+	memset(optable.shards, 0, shards * sizeof(OP_SHARD));
+	for(int i = 0; i < shards; i++){
+		optable.shards[i].table = table_create(groups);
+	}
+}
+
+/*
+ * Destroy every map entry and free the shards.
+ */
+void optable_fini(void){
+	OP_TABLE *t;
+	for(int i = 0; i < optable.nshards; i++){
+		t = optable.shards[i].table;
+		for(size_t j = 0; j < t->groups * OPTABLE_GROUP; j++){
+			if(ctrl_bytes(t)[j] != OPTABLE_EMPTY){
+				map_entry_destroy(t->slots[j].entry);
+			}
+		}
+		free(t);
+	}
+	free(optable.shards);
+	memset(&optable, 0, sizeof(optable));
+}
+
+static OP_SHARD *shard_of(KEY *kp){
+	return &optable.shards[(unsigned int)kp->hash & (optable.nshards - 1)];
+}
+
+/*
+ * Find the entry for a key without taking any lock.
+ */
+MAP_ENTRY *optable_find(KEY *kp){
+	return probe(SHARED_LOAD(shard_of(kp)->table), kp, NULL);
+}
+
+/*
+ * Find the entry for a key, creating it if there is none.
+ */
+MAP_ENTRY *optable_find_or_add(KEY *kp){
+	OP_SHARD *shp = shard_of(kp);
+	MAP_ENTRY *mp;
+	size_t slot;
+	if((mp = probe(shp->table, kp, &slot)) != NULL){
+		return mp;
+	}
+	if((shp->table->used + 1) * 8 > shp->table->groups * OPTABLE_GROUP * OPTABLE_MAX_LOAD){
+		rebuild(shp);
+		probe(shp->table, kp, &slot);
+	}
+	mp = map_entry_create(kp);
+	slot_fill(shp->table, slot, mp);
+	return mp;
+}
+
+/*
+ * Run a function on the entries in a range of slots of one shard.
+ */
+size_t optable_sweep(int shard, size_t pos, size_t n, void (*fn)(MAP_ENTRY *mp, void *arg), void *arg){
+	OP_TABLE *t = optable.shards[shard].table;
+	size_t end = t->groups * OPTABLE_GROUP;
+	if(pos + n < end){
+		end = pos + n;
+	}
+	for(; pos < end; pos++){
+		if(ctrl_bytes(t)[pos] != OPTABLE_EMPTY){
+			fn(t->slots[pos].entry, arg);
+		}
+	}
+	//the table may have been rebuilt smaller since the last call
+	return pos < t->groups * OPTABLE_GROUP ? pos : 0;
+}
+
+/*
+ * Print the size and load of the shards to stderr.
+ */
+void optable_show(void){
+	size_t used = 0, slots = 0;
+	unsigned long rebuilds = 0, dropped = 0;
+	OP_TABLE *t;
+	//a rebuild may drop a shard's table at any time
+	epoch_enter();
+	for(int i = 0; i < optable.nshards; i++){
+		t = SHARED_LOAD(optable.shards[i].table);
+		used += t->used;
+		slots += t->groups * OPTABLE_GROUP;
+		rebuilds += optable.shards[i].rebuilds;
+		dropped += optable.shards[i].dropped;
+	}
+	epoch_exit();
+	fprintf(stderr, "store: %zu keys in %zu open-addressed slots (load %.2f), %d shards, "
+		"%lu rebuilds, %lu unused keys dropped\n",
+		used, slots, slots > 0 ? (double)used / slots : 0.0, optable.nshards,
+		rebuilds, dropped);
+}
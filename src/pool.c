@@ -0,0 +1,268 @@
+#include <stdatomic.h>
+#include "pool.h"
+#include "server.h"
+#include "config.h"
+#include "uring.h"
+#include "csapp.h"
+#include "helper.h"
+#include "debug.h"
+
+#define POOL_QUEUE_MASK (POOL_QUEUE_SIZE - 1)
+
+/*
+ * One cell of a worker queue.  The sequence number says whose turn it
+ * is: equal to the enqueue position when the slot is free for that
+ * position, one more than it once the slot holds a connection.
+ */
+typedef struct pool_slot {
+	atomic_size_t seq;
+	int fd;
+	uint64_t enqueued;          // CLOCK_MONOTONIC time of the handoff (ns)
+} POOL_SLOT;
+
+/*
+ * Bounded MPMC queue (Vyukov).  Producers and consumers each claim a
+ * position with a CAS on their own index and then only touch that slot.
+ */
+typedef struct pool_queue {
+	_Alignas(64) atomic_size_t head;    // Next position to enqueue at
+	_Alignas(64) atomic_size_t tail;    // Next position to dequeue from
+	POOL_SLOT slots[POOL_QUEUE_SIZE];
+} POOL_QUEUE;
+
+typedef struct worker {
+	pthread_t tid;
+	int id;
+	atomic_ulong served;        // Connections serviced by this worker
+	POOL_QUEUE queue;
+} WORKER;
+
+static WORKER *workers;
+static int num_workers;
+static atomic_uint next_worker;  // Round-robin start, shared by the accept threads
+static atomic_int stopping;     // Set by pool_fini()
+static sem_t items;             // Connections queued across all workers
+static sem_t slots;             // Free slots across all workers
+//keeps pool_fini() from freeing the workers under pool_show()
+static pthread_mutex_t show_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	atomic_ulong handoffs;      // Connections taken by a worker
+	atomic_ulong steals;        // ... of which from another worker's queue
+	atomic_long depth;          // Connections currently queued
+	atomic_ulong max_depth;     // Highest depth seen
+	atomic_ulong latency_total; // Sum of submit-to-pickup times (ns)
+	atomic_ulong latency_max;   // Longest submit-to-pickup time (ns)
+} pool_stats;
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Raise an atomic maximum to at least the given value.
+ */
+static void atomic_max(atomic_ulong *max, unsigned long value){
+	unsigned long cur = atomic_load_explicit(max, memory_order_relaxed);
+	while(cur < value && !atomic_compare_exchange_weak_explicit(max, &cur, value,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+static void queue_init(POOL_QUEUE *q){
+	for(size_t i = 0; i < POOL_QUEUE_SIZE; i++)
+		atomic_init(&q->slots[i].seq, i);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+/*
+ * @return  0 if the connection was queued, -1 if the queue is full.
+ */
+static int queue_push(POOL_QUEUE *q, int fd, uint64_t when){
+	POOL_SLOT *slot;
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	for(;;){
+		slot = &q->slots[pos & POOL_QUEUE_MASK];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0){
+			if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0){
+			return -1;
+		}
+		else{
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+	slot->fd = fd;
+	slot->enqueued = when;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+/*
+ * @return  0 if a connection was dequeued, -1 if the queue is empty.
+ */
+static int queue_pop(POOL_QUEUE *q, int *fd, uint64_t *when){
+	POOL_SLOT *slot;
+	size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	for(;;){
+		slot = &q->slots[pos & POOL_QUEUE_MASK];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if(diff == 0){
+			if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0){
+			return -1;
+		}
+		else{
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+	*fd = slot->fd;
+	*when = slot->enqueued;
+	atomic_store_explicit(&slot->seq, pos + POOL_QUEUE_SIZE, memory_order_release);
+	return 0;
+}
+
+/*
+ * Take the next connection, from our own queue if possible and otherwise
+ * from the other workers' queues.  The caller has already claimed one
+ * item from the items semaphore, so some queue holds a connection for it.
+ */
+static int worker_take(WORKER *w){
+	int fd;
+	uint64_t when, latency;
+	for(;;){
+		for(int i = 0; i < num_workers; i++){
+			WORKER *victim = &workers[(w->id + i) % num_workers];
+			if(queue_pop(&victim->queue, &fd, &when) == 0){
+				latency = now_ns() - when;
+				if(victim != w)
+					atomic_fetch_add_explicit(&pool_stats.steals, 1, memory_order_relaxed);
+				atomic_fetch_add_explicit(&pool_stats.handoffs, 1, memory_order_relaxed);
+				atomic_fetch_sub_explicit(&pool_stats.depth, 1, memory_order_relaxed);
+				atomic_fetch_add_explicit(&pool_stats.latency_total, latency, memory_order_relaxed);
+				atomic_max(&pool_stats.latency_max, latency);
+				V(&slots);
+				return fd;
+			}
+		}
+		//an item was claimed but its push is not visible yet
+		sched_yield();
+	}
+}
+
+/*
+ * Thread function for a pool worker.
+ */
+static void *worker_thread(void *arg){
+	WORKER *w = arg;
+	block_server_signals();
+	if(server_config.uring)
+		uring_thread_init();
+	for(;;){
+		P(&items);
+		if(atomic_load(&stopping))
+			break;
+		xacto_serve(worker_take(w));
+		atomic_fetch_add_explicit(&w->served, 1, memory_order_relaxed);
+	}
+	uring_thread_fini();
+	return NULL;
+}
+
+/*
+ * Start the worker pool.
+ *
+ * @param nworkers  Number of workers to start (0 means one per core).
+ */
+void pool_init(int nworkers){
+	if(nworkers <= 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers <= 0)
+		nworkers = 1;
+	debug("Starting %d pool workers", nworkers);
+	num_workers = nworkers;
+	workers = aligned_alloc(_Alignof(WORKER), nworkers * sizeof(WORKER));
+	memset(workers, 0, nworkers * sizeof(WORKER));
+	Sem_init(&items, 0, 0);
+	Sem_init(&slots, 0, nworkers * POOL_QUEUE_SIZE);
+	for(int i = 0; i < nworkers; i++){
+		workers[i].id = i;
+		queue_init(&workers[i].queue);
+	}
+	for(int i = 0; i < nworkers; i++)
+		Pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+}
+
+/*
+ * Hand a newly accepted connection to the pool.  Blocks while every
+ * worker queue is full.
+ *
+ * @param connfd  The connected file descriptor.
+ */
+void pool_submit(int connfd){
+	uint64_t when;
+	long depth;
+	unsigned int start;
+	//registered while it waits, so that a shutdown reaches it before a worker does
+	creg_register(client_registry, connfd);
+	P(&slots);
+	when = now_ns();
+	start = atomic_fetch_add_explicit(&next_worker, 1, memory_order_relaxed);
+	//the slots semaphore guarantees that one of the queues has room
+	for(int i = 0; ; i++){
+		if(queue_push(&workers[(start + i) % num_workers].queue, connfd, when) == 0)
+			break;
+	}
+	depth = atomic_fetch_add_explicit(&pool_stats.depth, 1, memory_order_relaxed) + 1;
+	atomic_max(&pool_stats.max_depth, depth);
+	V(&items);
+}
+
+/*
+ * Stop the workers and wait for them to exit.
+ * Should only be called once all client connections have been shut down.
+ */
+void pool_fini(void){
+	atomic_store(&stopping, 1);
+	for(int i = 0; i < num_workers; i++)
+		V(&items);
+	for(int i = 0; i < num_workers; i++)
+		Pthread_join(workers[i].tid, NULL);
+	sem_destroy(&items);
+	sem_destroy(&slots);
+	pthread_mutex_lock(&show_mutex);
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+	pthread_mutex_unlock(&show_mutex);
+}
+
+/*
+ * Print queue depth and handoff latency counters to stderr.
+ */
+void pool_show(void){
+	unsigned long handoffs = atomic_load(&pool_stats.handoffs);
+	unsigned long total = atomic_load(&pool_stats.latency_total);
+	pthread_mutex_lock(&show_mutex);
+	fprintf(stderr, "pool: %d workers, %lu handoffs (%lu stolen), queue depth %ld (max %lu)\n",
+		num_workers, handoffs, atomic_load(&pool_stats.steals),
+		atomic_load(&pool_stats.depth), atomic_load(&pool_stats.max_depth));
+	fprintf(stderr, "pool: handoff latency avg %.1fus max %.1fus\n",
+		handoffs ? total / (double)handoffs / 1000 : 0.0,
+		atomic_load(&pool_stats.latency_max) / 1000.0);
+	for(int i = 0; i < num_workers; i++)
+		fprintf(stderr, "pool: worker %d served %lu\n", i, atomic_load(&workers[i].served));
+	pthread_mutex_unlock(&show_mutex);
+}
@@ -1,4 +1,6 @@
 #include "protocol.h"
+#include "proto_io.h"
+#include "uring.h"
 #include "csapp.h"
 #include "helper.h"
 
@@ -83,7 +85,8 @@ int proto_recv_packet(int fd, XACTO_PACKET *pkt, void **datap){
 	int bytes_read = 0, bytes_to_read = 0;
 	bytes_to_read = sizeof(XACTO_PACKET); //NUMBER OF BYTES TO READ FROM FD
 	while(bytes_to_read > 0){//while there are bytes to read
-		if((bytes_read = read(fd, pkt, bytes_to_read)) <= 0) { //PERFORM READ
+		//a short read leaves the rest to go after what has arrived
+		if((bytes_read = read(fd, (char *)pkt + sizeof(XACTO_PACKET) - bytes_to_read, bytes_to_read)) <= 0) { //PERFORM READ
 			//BAD READ
 			return -1;
 		}
@@ -101,9 +104,10 @@ int proto_recv_packet(int fd, XACTO_PACKET *pkt, void **datap){
 		*datap = calloc(pkt->size + 1, sizeof(char));
 		bytes_to_read = pkt->size;//Get the payload size
 		while(bytes_to_read > 0){//while there are bytes to read
-			if((bytes_read = read(fd, *datap, bytes_to_read)) <= 0) { //PERFORM READ
+			if((bytes_read = read(fd, (char *)*datap + pkt->size - bytes_to_read, bytes_to_read)) <= 0) { //PERFORM READ
 				//BAD READ
-				free(datap);
+				free(*datap);
+				*datap = NULL;
 				return -1;
 			}
 			//read operated fine
@@ -114,5 +118,392 @@ int proto_recv_packet(int fd, XACTO_PACKET *pkt, void **datap){
 	return 0;
 }
 
+/*
+ * Associate a reader with a connection.
+ */
+void proto_reader_init(PROTO_READER *rp, int fd){
+	rio_readinitb(&rp->rio, fd);
+	rp->scratch = NULL;
+	rp->scratch_cap = 0;
+}
 
+/*
+ * Release the storage held by a reader.
+ */
+void proto_reader_fini(PROTO_READER *rp){
+	free(rp->scratch);
+	rp->scratch = NULL;
+	rp->scratch_cap = 0;
+}
 
+/*
+ * Make sure at least n bytes (n <= RIO_BUFSIZE) are buffered, reading
+ * as much as the socket has ready each time.  Unread bytes are moved to
+ * the front of the buffer first if there is no room after them.
+ *
+ * @return  0 on success, -1 on error or EOF (errno set, 0 for EOF).
+ */
+static int reader_fill(PROTO_READER *rp, size_t n){
+	rio_t *rio = &rp->rio;
+	ssize_t bytes_read;
+	char *end;
+	if(rio->rio_cnt == 0){
+		rio->rio_bufptr = rio->rio_buf;
+	}
+	else if(rio->rio_bufptr - rio->rio_buf + n > RIO_BUFSIZE){
+		memmove(rio->rio_buf, rio->rio_bufptr, rio->rio_cnt);
+		rio->rio_bufptr = rio->rio_buf;
+	}
+	while((size_t)rio->rio_cnt < n){
+		end = rio->rio_bufptr + rio->rio_cnt;
+		if((bytes_read = read(rio->rio_fd, end, rio->rio_buf + RIO_BUFSIZE - end)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		if(bytes_read == 0){
+			//EOF in the middle of a packet
+			errno = 0;
+			return -1;
+		}
+		rio->rio_cnt += bytes_read;
+	}
+	return 0;
+}
+
+/*
+ * Read a payload into the given storage: what is already buffered is
+ * copied, the rest is read straight into place.
+ *
+ * @return  0 on success, -1 on error or EOF (errno set, 0 for EOF).
+ */
+static int reader_read_into(PROTO_READER *rp, char *dst, size_t size){
+	rio_t *rio = &rp->rio;
+	size_t have = (size_t)rio->rio_cnt < size ? (size_t)rio->rio_cnt : size;
+	ssize_t bytes_read;
+	memcpy(dst, rio->rio_bufptr, have);
+	rio->rio_bufptr += have;
+	rio->rio_cnt -= have;
+	while(have < size){
+		if((bytes_read = read(rio->rio_fd, dst + have, size - have)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		if(bytes_read == 0){
+			errno = 0;
+			return -1;
+		}
+		have += bytes_read;
+	}
+	return 0;
+}
+
+/*
+ * Read a payload too large for the buffer into the scratch area.
+ *
+ * @return  0 on success, -1 on error or EOF (errno set, 0 for EOF).
+ */
+static int reader_read_large(PROTO_READER *rp, size_t size){
+	if(rp->scratch_cap < size){
+		free(rp->scratch);
+		rp->scratch = Malloc(size);
+		rp->scratch_cap = size;
+	}
+	return reader_read_into(rp, rp->scratch, size);
+}
+
+/*
+ * Take the fixed-size part of the next packet out of the buffer and
+ * put its fields in host byte order.
+ *
+ * @return  0 on success, -1 on error or EOF (errno set, 0 for EOF).
+ */
+static int reader_header(PROTO_READER *rp, XACTO_PACKET *pkt){
+	rio_t *rio = &rp->rio;
+	if(reader_fill(rp, sizeof(XACTO_PACKET)) == -1){
+		return -1;
+	}
+	memcpy(pkt, rio->rio_bufptr, sizeof(XACTO_PACKET));
+	rio->rio_bufptr += sizeof(XACTO_PACKET);
+	rio->rio_cnt -= sizeof(XACTO_PACKET);
+	pkt->size = ntohl(pkt->size);
+	pkt->timestamp_sec = ntohl(pkt->timestamp_sec);
+	pkt->timestamp_nsec = ntohl(pkt->timestamp_nsec);
+	if(pkt->size > XACTO_PAYLOAD_MAX){
+		//nothing after it can be trusted to be where it says
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Receive a packet through a reader, blocking until a whole packet
+ * is available.
+ */
+int proto_read_packet(PROTO_READER *rp, XACTO_PACKET *pkt, void **datap){
+	rio_t *rio = &rp->rio;
+	size_t size;
+	if(datap != NULL){
+		*datap = NULL;
+	}
+	if(reader_header(rp, pkt) == -1){
+		return -1;
+	}
+	size = pkt->size;
+	if(size == 0){
+		return 0;
+	}
+	if(size > RIO_BUFSIZE){
+		if(reader_read_large(rp, size) == -1){
+			return -1;
+		}
+		if(datap != NULL){
+			*datap = rp->scratch;
+		}
+		return 0;
+	}
+	if(reader_fill(rp, size) == -1){
+		return -1;
+	}
+	if(datap != NULL){
+		*datap = rio->rio_bufptr;
+	}
+	rio->rio_bufptr += size;
+	rio->rio_cnt -= size;
+	return 0;
+}
+
+/*
+ * Receive a packet through a reader, with its payload in a blob of
+ * its own.
+ */
+int proto_read_blob(PROTO_READER *rp, XACTO_PACKET *pkt, BLOB **blobp){
+	BLOB *bp;
+	size_t size;
+	*blobp = NULL;
+	if(reader_header(rp, pkt) == -1){
+		return -1;
+	}
+	size = pkt->size;
+	if(size == 0){
+		*blobp = blob_adopt(NULL, 0);
+		return 0;
+	}
+	//the payload goes straight into the blob's own allocation
+	bp = blob_alloc(size);
+	//a small payload is pulled into the buffer along with whatever
+	//follows it, a large one goes from the socket straight to the blob
+	if((size <= RIO_BUFSIZE && reader_fill(rp, size) == -1)
+			|| reader_read_into(rp, bp->content, size) == -1){
+		blob_unref(bp, "unread payload from [proto_read_blob]");
+		return -1;
+	}
+	*blobp = bp;
+	return 0;
+}
+
+/*
+ * Receive a packet through a reader, with its payload made into a key
+ * in an arena.
+ */
+int proto_read_key(PROTO_READER *rp, XACTO_PACKET *pkt, ARENA *ap, KEY **keyp){
+	void *data;
+	*keyp = NULL;
+	if(proto_read_packet(rp, pkt, &data) == -1){
+		return -1;
+	}
+	*keyp = arena_key(ap, data, pkt->size);
+	return 0;
+}
+
+/*
+ * Write out a gather list, starting a given number of bytes into it.
+ *
+ * @return  0 on success, -1 on error (errno set).
+ */
+static int write_iov_from(int fd, struct iovec *iov, int iovcnt, size_t skip){
+	ssize_t bytes_written;
+	for(int i = 0; i < iovcnt; i++){
+		char *base = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if(skip >= len){
+			skip -= len;
+			continue;
+		}
+		base += skip;
+		len -= skip;
+		skip = 0;
+		while(len > 0){
+			if((bytes_written = write(fd, base, len)) <= 0){
+				return -1;
+			}
+			base += bytes_written;
+			len -= bytes_written;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a gather list in one go: one io_uring operation if the calling
+ * thread has a ring, one sendmsg() otherwise.  Whatever a short write
+ * leaves over is finished off directly.
+ *
+ * @param more  Nonzero if more data will follow shortly (MSG_MORE).
+ * @return  0 on success, -1 on error (errno set).
+ */
+static int send_iov(int fd, struct iovec *iov, int iovcnt, int more){
+	struct msghdr msg;
+	URING *ur = uring_thread();
+	ssize_t res;
+	int op;
+	if(ur != NULL && (op = uring_queue_send(ur, fd, iov, iovcnt)) >= 0){
+		uring_submit(ur);
+		if((res = uring_result(ur, op)) < 0){
+			errno = -res;
+			return -1;
+		}
+	}
+	else{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		//a client that has gone away should not take the server with it
+		while((res = sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0))) < 0){
+			if(errno != EINTR){
+				return -1;
+			}
+		}
+	}
+	//a blocking socket only comes up short if interrupted, finish the rest directly
+	return write_iov_from(fd, iov, iovcnt, res);
+}
+
+/*
+ * Reports whether a whole request is already buffered in a reader.
+ */
+int proto_reader_pending(PROTO_READER *rp){
+	char *p = rp->rio.rio_bufptr;
+	size_t left = rp->rio.rio_cnt, size;
+	int packets = 1;
+	XACTO_PACKET hdr;
+	for(int i = 0; i < packets; i++){
+		if(left < sizeof(XACTO_PACKET)){
+			return 0;
+		}
+		memcpy(&hdr, p, sizeof(XACTO_PACKET));
+		if((size = sizeof(XACTO_PACKET) + ntohl(hdr.size)) > left){
+			return 0;
+		}
+		if(i == 0){
+			//the request's DATA packets follow its header
+			hdr.size = ntohl(hdr.size);
+			int more = proto_request_data_packets(&hdr, p + sizeof(XACTO_PACKET));
+			//a malformed request is handled (and refused) without delay
+			packets += more > 0 ? more : 0;
+		}
+		p += size;
+		left -= size;
+	}
+	return 1;
+}
+
+/*
+ * Count the DATA packets that follow a request header.
+ */
+int proto_request_data_packets(XACTO_PACKET *pkt, void *data){
+	uint32_t count;
+	switch(pkt->type){
+	case XACTO_PUT_PKT:
+		return 2;
+	case XACTO_GET_PKT:
+		return 1;
+	case XACTO_MULTI_GET_PKT:
+	case XACTO_MULTI_PUT_PKT:
+		if(pkt->size != sizeof(count) || data == NULL)
+			return -1;
+		memcpy(&count, data, sizeof(count));
+		count = ntohl(count);
+		if(count > XACTO_MULTI_MAX)
+			return -1;
+		return pkt->type == XACTO_MULTI_PUT_PKT ? 2 * count : count;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Associate a writer with a connection.
+ */
+void proto_writer_init(PROTO_WRITER *wp, int fd, int corked){
+	wp->fd = fd;
+	wp->corked = corked;
+	wp->len = 0;
+}
+
+/*
+ * Queue a packet, followed by its payload (if any), for sending.
+ */
+int proto_write_packet(PROTO_WRITER *wp, XACTO_PACKET *pkt, void *data){
+	XACTO_PACKET hdr = *pkt;
+	size_t size = pkt->size;
+	size_t inline_size = size <= PROTO_WRITER_INLINE ? size : 0;
+	struct iovec iov[2];
+	hdr.size = htonl(hdr.size);
+	hdr.timestamp_sec = htonl(hdr.timestamp_sec);
+	hdr.timestamp_nsec = htonl(hdr.timestamp_nsec);
+	if(wp->len + sizeof(XACTO_PACKET) + inline_size > PROTO_WRITER_BUFSIZE){
+		//full, send what is there and say that more is coming
+		iov[0].iov_base = wp->buf;
+		iov[0].iov_len = wp->len;
+		wp->len = 0;
+		if(send_iov(wp->fd, iov, 1, 1) == -1){
+			return -1;
+		}
+	}
+	memcpy(wp->buf + wp->len, &hdr, sizeof(XACTO_PACKET));
+	wp->len += sizeof(XACTO_PACKET);
+	if(size == 0){
+		return 0;
+	}
+	if(size == inline_size){
+		memcpy(wp->buf + wp->len, data, size);
+		wp->len += size;
+		return 0;
+	}
+	//too big to copy, send it now behind everything queued so far
+	iov[0].iov_base = wp->buf;
+	iov[0].iov_len = wp->len;
+	iov[1].iov_base = data;
+	iov[1].iov_len = size;
+	wp->len = 0;
+	return send_iov(wp->fd, iov, 2, 0);
+}
+
+/*
+ * Send everything queued on a writer.
+ */
+int proto_flush(PROTO_WRITER *wp){
+	struct iovec iov;
+	if(wp->len == 0){
+		return 0;
+	}
+	iov.iov_base = wp->buf;
+	iov.iov_len = wp->len;
+	wp->len = 0;
+	return send_iov(wp->fd, &iov, 1, 0);
+}
+
+/*
+ * Mark the end of the replies to one request.
+ */
+int proto_end_request(PROTO_WRITER *wp, PROTO_READER *rp){
+	if(wp->corked && proto_reader_pending(rp)){
+		return 0;
+	}
+	return proto_flush(wp);
+}
@@ -1,12 +1,29 @@
+#include <stdatomic.h>
 #include "server.h"
 #include "transaction.h"
 #include "csapp.h"
 #include "protocol.h"
+#include "proto_io.h"
 #include "data.h"
 #include "store.h"
+#include "helper.h"
+#include "config.h"
+#include "event.h"
+#include "pool.h"
+#include "map.h"
 
 
 CLIENT_REGISTRY *client_registry;
+
+/*
+ * Counters for finished sessions, to see how much connections are reused.
+ */
+static struct {
+	atomic_ulong sessions;      // Connections closed
+	atomic_ulong transactions;  // Transactions run on them
+	atomic_ulong max;           // Most transactions on one connection
+} session_stats;
+
 /*
  * Thread function for the thread that handles client requests.
  *
@@ -23,215 +40,387 @@ void *xacto_client_service(void *arg){
 	Pthread_detach(pthread_self());
 	//register the connfd to the client registry
 	creg_register(client_registry, connfd);
-	//create transaction for this specific session
-	TRANSACTION *tp = trans_create();
+	xacto_serve(connfd);
+	return NULL;
+}
+
+/*
+ * Hand a newly accepted connection to the configured servicing model.
+ * Called from whichever thread accepted it.
+ *
+ * @param connfd  The file descriptor for the client connection.
+ */
+void xacto_dispatch(int connfd){
+	pthread_t tid;
+	int *connfdp;
+	switch(server_config.mode){
+	case SERVER_EVENT:
+		//the event loops take the connection from here
+		event_dispatch(connfd);
+		break;
+	case SERVER_POOL:
+		//one of the pool workers takes the connection from here
+		pool_submit(connfd);
+		break;
+	default:
+		connfdp = malloc(sizeof(int)); //freed by xacto_client_service
+		*connfdp = connfd;
+		Pthread_create(&tid, NULL, xacto_client_service, connfdp);
+		break;
+	}
+}
+
+/*
+ * Queue a payload-free REPLY packet with the given status.
+ *
+ * @return  0 on success, -1 if the connection failed.
+ */
+static int queue_reply(PROTO_WRITER *wp, int status){
+	XACTO_PACKET pkt;
+	struct timespec current_time;
+	memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	pkt.type = XACTO_REPLY_PKT;
+	pkt.status = status;
+	pkt.size = 0;//payload size of this header is 0
+	pkt.timestamp_sec = current_time.tv_sec;
+	pkt.timestamp_nsec = current_time.tv_nsec;
+	return proto_write_packet(wp, &pkt, NULL);
+}
+
+/*
+ * Carry out a MULTI_GET or MULTI_PUT request: read its keys (and values),
+ * run the whole batch through the store under one lock and queue the
+ * reply.
+ *
+ * @param rp  The connection's reader, positioned after the batch header.
+ * @param wp  The connection's writer.
+ * @param ap  The connection's arena, for the keys and the arrays of the batch.
+ * @param tp  The transaction; one reference is consumed if it aborts.
+ * @param request  XACTO_MULTI_GET_PKT or XACTO_MULTI_PUT_PKT.
+ * @param count  Number of keys in the batch.
+ * @param connected  Cleared if the connection failed.
+ * @return  TRANS_PENDING, or TRANS_ABORTED if the transaction aborted.
+ */
+static TRANS_STATUS serve_multi(PROTO_READER *rp, PROTO_WRITER *wp, ARENA *ap, TRANSACTION *tp,
+		int request, int count, int *connected){
+	//the arrays and the keys only last as long as the request
+	KEY **keys = arena_alloc(ap, (count + 1) * sizeof(KEY *));
+	BLOB **values = arena_alloc(ap, (count + 1) * sizeof(BLOB *));
+	XACTO_PACKET pkt;
+	struct timespec current_time;
+	TRANS_STATUS status;
+	int i;
+	memset(values, 0, (count + 1) * sizeof(BLOB *));
+	for(i = 0; i < count; i++){
+		if(proto_read_key(rp, &pkt, ap, &keys[i]) == -1)
+			break;
+		if(request == XACTO_MULTI_PUT_PKT){
+			if(proto_read_blob(rp, &pkt, &values[i]) == -1)
+				break;
+		}
+	}
+	if(i < count){
+		//Unexpected EOF
+		while(i-- > 0){
+			if(values[i] != NULL)
+				blob_unref(values[i], "unused value from [serve_multi]");
+		}
+		*connected = 0;
+		return trans_abort(tp);
+	}
+	if(request == XACTO_MULTI_PUT_PKT)
+		status = store_put_multi(tp, keys, values, count);
+	else
+		status = store_get_multi(tp, keys, values, count);
+	if(status == TRANS_ABORTED){
+		return trans_abort(tp);
+	}
+	//one REPLY for the batch, then a DATA packet per key for a MULTI_GET
+	if(queue_reply(wp, 0) == -1)
+		*connected = 0;
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	for(i = 0; request == XACTO_MULTI_GET_PKT && i < count; i++){
+		if(!*connected){
+			blob_unref(values[i], "unsent value from [serve_multi]");
+			continue;
+		}
+		memset(&pkt, 0, sizeof(XACTO_PACKET));
+		pkt.type = XACTO_DATA_PKT;
+		if(values[i]->content){
+			pkt.size = values[i]->size;
+		}
+		else{
+			pkt.null = 1;//no data
+		}
+		pkt.timestamp_sec = current_time.tv_sec;
+		pkt.timestamp_nsec = current_time.tv_nsec;
+		if(proto_write_packet(wp, &pkt, values[i]->content) == -1)
+			*connected = 0;
+		blob_unref(values[i], "sent value from [serve_multi]");
+	}
+	if(!*connected || proto_end_request(wp, rp) == -1){
+		//Unexpected EOF
+		*connected = 0;
+		return trans_abort(tp);
+	}
+	return TRANS_PENDING;
+}
+
+/*
+ * Service a client connection until its transaction commits or aborts,
+ * then close it.  In a persistent session (-k) the connection stays open
+ * instead, and the next request begins a new transaction.  Runs in
+ * whatever thread calls it: a dedicated thread in the thread-per-connection
+ * model, or a pool worker.
+ *
+ * Once a transaction of a persistent session has aborted, the rest of
+ * its requests, up to and including its COMMIT, are answered with an
+ * aborted reply but not carried out, so that requests the client
+ * pipelined after the failure cannot leak into the next transaction.
+ *
+ * @param connfd  The file descriptor for the client connection, already
+ *   in the client registry; it is unregistered once it has been closed.
+ */
+void xacto_serve(int connfd){
+	//requests are parsed out of a per-connection buffer
+	PROTO_READER reader;
+	proto_reader_init(&reader, connfd);
+	//and replies are gathered up to go out in one write; clients may pipeline,
+	//so every request already buffered is handled before the replies are flushed
+	PROTO_WRITER writer;
+	proto_writer_init(&writer, connfd, 1);
+	//the current transaction, created by the first request that needs it
+	TRANSACTION *tp = NULL;
+	unsigned long ntrans = 0;
+	int discarding = 0; //skipping the rest of an aborted transaction
+	int connected = 1;
+	int request, ndata;
 	//thread enters the service loop
 	XACTO_PACKET pkt;
+	XACTO_PACKET reply[2];
 	memset(&pkt, 0, sizeof(XACTO_PACKET));
-	void **datap = malloc(sizeof(void *));
-	BLOB **valuep = malloc(sizeof(BLOB *));
-	//*valuep = malloc(sizeof(BLOB));
+	void *data;
+	void **datap = &data;
+	BLOB *valueb;
+	BLOB **valuep = &valueb;
 	struct timespec current_time;
-	BLOB *key_blob;
 	KEY *key;
+	KEY_VIEW view;
 	BLOB *value;
-	TRANS_STATUS current_status = trans_get_status(tp);
-	while(current_status == TRANS_PENDING){//while true
+	TRANS_STATUS current_status;
+	//scratch for one request at a time, keys and batch arrays
+	ARENA arena;
+	arena_init(&arena);
+	while(connected){
+		//whatever the last request left in the arena is done with
+		arena_reset(&arena);
 		//recieve a request packet sent by the client
-	if(proto_recv_packet(connfd, &pkt, NULL) == 0){//packet recieved success
-			//determine it header or payload
-			//if the payload is null, it is a header packet
-			switch(pkt.type){
-				///////////////////
-				case XACTO_PUT_PKT:
-				///////////////////
-				//Handle PUT
-				//clean datap
-				memset(datap, 0, sizeof(void *)); //clean the buffer
-				memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-				if(proto_recv_packet(connfd, &pkt, datap) == -1){//packet
-					//Unexpected EOF
-					current_status = trans_abort(tp);
-					break;
-				}
-				//got the key
-				//perform blob operation
-				key_blob = blob_create(*datap, pkt.size);
-				key = key_create(key_blob);
-				free(*datap);
-				//create key to this content
-				//we have our key
-				memset(datap, 0, sizeof(void *)); //clean the buffer
-				memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-				if(proto_recv_packet(connfd, &pkt, datap) == -1){//packet
-					//Unexpected EOF
-					current_status = trans_abort(tp);
-					break;
-				}
-				//got the value
-				//perform operations
-				value = blob_create(*datap, pkt.size);
-				free(*datap);
-				//we now have the key and the value
-				current_status = store_put(tp, key, value);//add our key and value to the hash map
-				if(current_status == TRANS_ABORTED){
-					break;
-				}
-				//we have to reply to the client
-				memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-				//SEND REPLY HEADER
-				clock_gettime(CLOCK_REALTIME, &current_time);
-				pkt.type = XACTO_REPLY_PKT;
-				pkt.status = 0;
-				pkt.size = 0;//payload size of this header is 0
-				pkt.timestamp_sec = current_time.tv_sec;
-				pkt.timestamp_nsec = current_time.tv_nsec;
-				if(proto_send_packet(connfd, &pkt, NULL) == -1){//packet
-					//Unexpected EOF
-					current_status = trans_abort(tp);
-					break;
+		if(proto_read_packet(&reader, &pkt, datap) == -1){
+			//EOF, any unfinished transaction is aborted below
+			break;
+		}
+		request = pkt.type;
+		if((ndata = proto_request_data_packets(&pkt, *datap)) < 0){
+			//a batch we cannot take, there is no telling where the next request starts
+			break;
+		}
+		if(discarding){
+			//the request still has its DATA packets to come
+			for(int i = ndata; i > 0; i--){
+				if(proto_read_packet(&reader, &pkt, NULL) == -1){
+					connected = 0;
 				}
+			}
+			if(request == XACTO_COMMIT_PKT){
+				discarding = 0;
+			}
+			if(!connected || queue_reply(&writer, TRANS_ABORTED) == -1
+					|| proto_end_request(&writer, &reader) == -1){
 				break;
-				///////////////////
-				case XACTO_GET_PKT:
-				///////////////////
-				//Handle GET
-				//clean datap
-				memset(datap, 0, sizeof(void *)); //clean the buffer
-				memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-				memset(valuep, 0, sizeof(BLOB *)); //clean the buffer
-				if(proto_recv_packet(connfd, &pkt, datap) == -1){//packet
-					//Unexpected EOF
-					current_status = trans_abort(tp);
-					break;
-				}
-				//got the key
-				//perform blob operation
-				key_blob = blob_create(*datap, pkt.size);
-				free(*datap);
-				//create key to this content
-				key = key_create(key_blob);
-				//we have our key
-				//perform operations
-				current_status = store_get(tp, key, valuep);//get the value based on the key and store it to the valuep buffer
-				if(current_status == TRANS_ABORTED){
-					break;
-				}
-				//BLOB **valuep, remember that
-				//we have to reply to the client
-				//check if the valuep is NULL(could be null)
-				if((*valuep)->content){
-					//NOT NULL content
-					memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-					//SEND REPLY HEADER
-					clock_gettime(CLOCK_REALTIME, &current_time);
-					pkt.type = XACTO_REPLY_PKT;
-					pkt.status = 0;
-					pkt.size = 0;//payload size of this header is 0
-					pkt.timestamp_sec = current_time.tv_sec;
-					pkt.timestamp_nsec = current_time.tv_nsec;
-					if(proto_send_packet(connfd, &pkt, NULL) == -1){//packet
-						//Unexpected EOF
-						current_status = trans_abort(tp);
-						break;
-					}
-					//SEND DATA PACKET
-					memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-					clock_gettime(CLOCK_REALTIME, &current_time);
-					pkt.type = XACTO_DATA_PKT;
-					pkt.status = 0;
-					pkt.size = (*valuep)->size;//payload size is blob size
-					pkt.timestamp_sec = current_time.tv_sec;
-					pkt.timestamp_nsec = current_time.tv_nsec;
-					if(proto_send_packet(connfd, &pkt, (*valuep)->content) == -1){//packet
-						//Unexpected EOF
-						current_status = trans_abort(tp);
-						break;
-					}
-
-				}
-				else{
-					//NULL
-					memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-					//SEND REPLY HEADER
-					clock_gettime(CLOCK_REALTIME, &current_time);
-					pkt.type = XACTO_REPLY_PKT;
-					pkt.status = 0;
-					pkt.size = 0;//payload size of this header is 0
-					pkt.timestamp_sec = current_time.tv_sec;
-					pkt.timestamp_nsec = current_time.tv_nsec;
-					if(proto_send_packet(connfd, &pkt, NULL) == -1){//packet
-						//Unexpected EOF
-						current_status = trans_abort(tp);
-						break;
-					}
-					//SEND DATA PACKET
-					memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-					clock_gettime(CLOCK_REALTIME, &current_time);
-					pkt.type = XACTO_DATA_PKT;
-					pkt.status = 0;
-					pkt.size = 0;//payload size of NULL is 0
-					pkt.null = 1;//no data
-					pkt.timestamp_sec = current_time.tv_sec;
-					pkt.timestamp_nsec = current_time.tv_nsec;
-					if(proto_send_packet(connfd, &pkt, NULL) == -1){//packet
-						//Unexpected EOF
-						current_status = trans_abort(tp);
-						break;
-					}
-				}
-				// blob_unref(*valuep, "blob unref the valuep from [xacto_get]");
+			}
+			continue;
+		}
+		if(tp == NULL){
+			//create transaction for this part of the session
+			tp = trans_create();
+			ntrans++;
+		}
+		current_status = TRANS_PENDING;
+		//determine it header or payload
+		//if the payload is null, it is a header packet
+		switch(request){
+			///////////////////
+			case XACTO_PUT_PKT:
+			///////////////////
+			//Handle PUT
+			memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
+			//the key is only needed for the lookup, the store copies it if it
+			//is new; the value is received straight into the blob that holds it
+			if(proto_read_key(&reader, &pkt, &arena, &key) == -1){//packet
+				//Unexpected EOF
+				current_status = trans_abort(tp);
+				connected = 0;
+				break;
+			}
+			//got the key
+			memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
+			if(proto_read_blob(&reader, &pkt, &value) == -1){//packet
+				//Unexpected EOF
+				current_status = trans_abort(tp);
+				connected = 0;
+				break;
+			}
+			//got the value
+			//we now have the key and the value
+			if(store_put_borrowed(tp, key, value) == TRANS_ABORTED){//add our key and value to the hash map
+				//our reference to the transaction is still ours to give up
+				current_status = trans_abort(tp);
+				break;
+			}
+			//we have to reply to the client
+			if(queue_reply(&writer, 0) == -1 || proto_end_request(&writer, &reader) == -1){
+				//Unexpected EOF
+				current_status = trans_abort(tp);
+				connected = 0;
+			}
+			break;
+			///////////////////
+			case XACTO_GET_PKT:
+			///////////////////
+			//Handle GET
+			memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
+			memset(valuep, 0, sizeof(BLOB *)); //clean the buffer
+			//nothing is read before the lookup, so the key can be looked up
+			//right where it is in the reader's buffer
+			if(proto_read_packet(&reader, &pkt, datap) == -1){//packet
+				//Unexpected EOF
+				current_status = trans_abort(tp);
+				connected = 0;
+				break;
+			}
+			//got the key
+			key = key_view(&view, *datap, pkt.size);
+			//perform operations
+			if(store_get_borrowed(tp, key, valuep) == TRANS_ABORTED){//get the value based on the key and store it to the valuep buffer
+				current_status = trans_abort(tp);
+				break;
+			}
+			//BLOB **valuep, remember that
+			//we have to reply to the client with a REPLY header and a DATA packet,
+			//which go out together in one write
+			memset(reply, 0, sizeof(reply)); //clean the buffer
+			clock_gettime(CLOCK_REALTIME, &current_time);
+			reply[0].type = XACTO_REPLY_PKT;
+			reply[0].status = 0;
+			reply[0].size = 0;//payload size of this header is 0
+			reply[1].type = XACTO_DATA_PKT;
+			reply[1].status = 0;
+			//check if the valuep is NULL(could be null)
+			if((*valuep)->content){
+				//NOT NULL content
+				reply[1].size = (*valuep)->size;//payload size is blob size
+			}
+			else{
+				//NULL
+				reply[1].size = 0;//payload size of NULL is 0
+				reply[1].null = 1;//no data
+			}
+			for(int i = 0; i < 2; i++){
+				reply[i].timestamp_sec = current_time.tv_sec;
+				reply[i].timestamp_nsec = current_time.tv_nsec;
+			}
+			if(proto_write_packet(&writer, &reply[0], NULL) == -1
+					|| proto_write_packet(&writer, &reply[1], (*valuep)->content) == -1
+					|| proto_end_request(&writer, &reader) == -1){//packets
+				//Unexpected EOF
+				current_status = trans_abort(tp);
+				connected = 0;
+			}
+			//a large value went out straight from the blob, a small one was copied
+			blob_unref(*valuep, "blob unref the valuep from [xacto_get]");
+			break;
+			case XACTO_MULTI_GET_PKT:
+			case XACTO_MULTI_PUT_PKT:
+			//Handle a batch, ndata counts its DATA packets
+			current_status = serve_multi(&reader, &writer, &arena, tp, request,
+				request == XACTO_MULTI_PUT_PKT ? ndata / 2 : ndata, &connected);
+			break;
+			case XACTO_COMMIT_PKT:
+			//Handle COMMIT
+			//0 payload packets
+			//a commit that has to wait for other transactions must not hold back
+			//the replies so far: the client may need them to finish those
+			if(tp->waitcnt > 0 && proto_flush(&writer) == -1){
+				current_status = trans_abort(tp);
+				connected = 0;
 				break;
-				case XACTO_COMMIT_PKT:
-				//Handle COMMIT
-				//0 payload packets
+			}
+			//this consumes our reference whichever way it goes
+			current_status = trans_commit(tp);
+			if(current_status == TRANS_COMMITTED){
 				//we have to reply to the client
-				current_status = trans_commit(tp);
-				if(current_status == TRANS_ABORTED){
-					break;
-				}
-				memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-				//SEND REPLY HEADER
-				clock_gettime(CLOCK_REALTIME, &current_time);
-				pkt.type = XACTO_REPLY_PKT;
-				pkt.status = TRANS_COMMITTED;
-				pkt.size = 0;//payload size of this header is 0
-				pkt.timestamp_sec = current_time.tv_sec;
-				pkt.timestamp_nsec = current_time.tv_nsec;
-				if(proto_send_packet(connfd, &pkt, NULL) == -1){//packet
+				if(queue_reply(&writer, TRANS_COMMITTED) == -1
+						|| proto_end_request(&writer, &reader) == -1){
 					//Unexpected EOF
-					current_status = trans_abort(tp);
-					break;
+					connected = 0;
 				}
-				break;
 			}
+			break;
+		}
+		if(current_status == TRANS_PENDING){
+			continue;
 		}
-		else if(proto_recv_packet(connfd, &pkt, NULL) == -1){//packet
-			//Unexpected EOF
-			current_status = trans_abort(tp);
+		//The status changed, transaction was either commited or aborted
+		tp = NULL;
+		if(current_status == TRANS_ABORTED){
+			//Send a reply with aborted status
+			if(queue_reply(&writer, TRANS_ABORTED) == -1
+					|| proto_end_request(&writer, &reader) == -1){
+				//Unexpected EOF
+				connected = 0;
+			}
+			discarding = request != XACTO_COMMIT_PKT;
+		}
+		if(!server_config.persist){
 			break;
 		}
 	}
-	if(current_status == TRANS_ABORTED){
-		//Send a final reply with aborted status
-		memset(&pkt, 0, sizeof(XACTO_PACKET)); //clean the buffer
-		//SEND REPLY HEADER
-		clock_gettime(CLOCK_REALTIME, &current_time);
-		pkt.type = XACTO_REPLY_PKT;
-		pkt.status = TRANS_ABORTED;
-		pkt.size = 0;//payload size of this header is 0
-		pkt.timestamp_sec = current_time.tv_sec;
-		pkt.timestamp_nsec = current_time.tv_nsec;
-		if(proto_send_packet(connfd, &pkt, NULL) == -1){//packet
-			//Unexpected EOF
-		}
+	if(tp != NULL){
+		//the client went away in the middle of a transaction
+		trans_abort(tp);
 	}
-	//The status changed, transaction was either commited or aborted
+	//replies are held back if the client pipelined anything after its commit
+	proto_flush(&writer);
+	xacto_session_done(ntrans);
 	//Unregister connfd
 	trans_show_all();
-	free(datap);
-	free(valuep);
+	proto_reader_fini(&reader);
+	arena_fini(&arena);
 	creg_unregister(client_registry, connfd);
 	close(connfd);
-	return NULL;
-}
\ No newline at end of file
+}
+
+/*
+ * Account for a finished session.
+ *
+ * @param ntrans  Number of transactions the session ran.
+ */
+void xacto_session_done(unsigned long ntrans){
+	unsigned long max = atomic_load_explicit(&session_stats.max, memory_order_relaxed);
+	atomic_fetch_add_explicit(&session_stats.sessions, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&session_stats.transactions, ntrans, memory_order_relaxed);
+	while(ntrans > max && !atomic_compare_exchange_weak(&session_stats.max, &max, ntrans))
+		;
+}
+
+/*
+ * Print the session counters to stderr.
+ */
+void xacto_show(void){
+	unsigned long sessions = atomic_load(&session_stats.sessions);
+	unsigned long transactions = atomic_load(&session_stats.transactions);
+	fprintf(stderr, "sessions: %lu closed, %lu transactions, %.2f per connection (max %lu)\n",
+		sessions, transactions, sessions > 0 ? (double)transactions / sessions : 0.0,
+		atomic_load(&session_stats.max));
+}
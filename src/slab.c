@@ -0,0 +1,268 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+#include "csapp.h"
+#include "config.h"
+#include "data.h"
+#include "transaction.h"
+#include "map.h"
+
+#define SLAB_ALIGN 16           // As malloc() would align them
+#define SLAB_ROUND(n) (((n) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+/*
+ * Free objects on their way between threads.  Magazines in a depot's
+ * full list hold objects; the ones in its empty list are spares.
+ */
+typedef struct magazine {
+	struct magazine *next;
+	int count;
+	void *objs[SLAB_MAGAZINE];
+} MAGAZINE;
+
+/*
+ * Per-type state shared by all threads.
+ */
+typedef struct slab_depot {
+	pthread_mutex_t mutex;      // Guards everything below
+	const char *name;
+	size_t size;
+	MAGAZINE *full, *empty;
+	char *next, *limit;         // What is left of the current slab
+	unsigned long carved;       // Objects carved out of slabs
+	size_t mapped;
+} SLAB_DEPOT;
+
+/*
+ * A thread's free objects of one type.  The counters are only written
+ * by the thread that owns the cache.
+ */
+typedef struct slab_cache {
+	int count;
+	void *objs[2 * SLAB_MAGAZINE];
+	atomic_ulong allocs, frees;
+} SLAB_CACHE;
+
+/*
+ * Per-thread state.  Records are never freed; a thread that exits gives
+ * its objects to the depots and its record back, and the next thread to
+ * start takes the record over, counters and all.
+ */
+typedef struct slab_thread {
+	SLAB_CACHE caches[SLAB_NTYPES];
+	atomic_int in_use;          // Owned by a live thread
+	struct slab_thread *next;
+} SLAB_THREAD;
+
+#define DEPOT(type, name, size) \
+	[type] = { PTHREAD_MUTEX_INITIALIZER, name, SLAB_ROUND(size), NULL, NULL, NULL, NULL, 0, 0 }
+
+static SLAB_DEPOT depots[SLAB_NTYPES] = {
+	DEPOT(SLAB_VERSION, "version", sizeof(VERSION)),
+	DEPOT(SLAB_KEY, "key", sizeof(KEY)),
+	DEPOT(SLAB_DEPENDENCY, "dependency", sizeof(DEPENDENCY)),
+	DEPOT(SLAB_TRANSACTION, "transaction", sizeof(TRANSACTION)),
+	DEPOT(SLAB_ENTRY, "entry", sizeof(MAP_SLOT) + MAP_SLOT_KEY_MAX + 1),
+};
+
+static struct {
+	_Atomic(SLAB_THREAD *) threads;
+	pthread_once_t once;
+	pthread_key_t key;          // Gives the record back when its thread exits
+} slab_state = { NULL, PTHREAD_ONCE_INIT };
+
+static __thread SLAB_THREAD *thread_slab;
+
+/*
+ * Map a new slab.  Huge pages need the slab aligned to their size, so
+ * without them reserved it is carved out of a mapping twice as large.
+ */
+static char *slab_map(void){
+	char *p = MAP_FAILED, *aligned;
+	if(!server_config.hugepages){
+		return Mmap(NULL, SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	p = mmap(NULL, SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(p != MAP_FAILED){
+		return p;
+	}
+	//none reserved, transparent huge pages may do instead
+	p = Mmap(NULL, 2 * SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	aligned = (char *)(((uintptr_t)p + SLAB_CHUNK - 1) & ~(uintptr_t)(SLAB_CHUNK - 1));
+	if(aligned > p){
+		Munmap(p, aligned - p);
+	}
+	if(aligned + SLAB_CHUNK < p + 2 * SLAB_CHUNK){
+		Munmap(aligned + SLAB_CHUNK, p + SLAB_CHUNK - aligned);
+	}
+	madvise(aligned, SLAB_CHUNK, MADV_HUGEPAGE);
+	return aligned;
+}
+
+/*
+ * Fill an empty cache with a magazine from the depot, or failing that
+ * with objects carved from the current slab.
+ */
+static void cache_fill(SLAB_DEPOT *dp, SLAB_CACHE *cp){
+	MAGAZINE *mp;
+	pthread_mutex_lock(&dp->mutex);
+	if((mp = dp->full) != NULL){
+		dp->full = mp->next;
+		memcpy(cp->objs, mp->objs, mp->count * sizeof(void *));
+		cp->count = mp->count;
+		mp->next = dp->empty;
+		dp->empty = mp;
+		pthread_mutex_unlock(&dp->mutex);
+		return;
+	}
+	for(int i = SLAB_MAGAZINE - 1; i >= 0; i--){
+		if(dp->next + dp->size > dp->limit){
+			//the rest of the old slab is too small to bother with
+			dp->next = slab_map();
+			dp->limit = dp->next + SLAB_CHUNK;
+			dp->mapped += SLAB_CHUNK;
+		}
+		//filled from the top, so that they are handed out in address order
+		cp->objs[i] = dp->next;
+		dp->next += dp->size;
+	}
+	cp->count = SLAB_MAGAZINE;
+	dp->carved += SLAB_MAGAZINE;
+	pthread_mutex_unlock(&dp->mutex);
+}
+
+/*
+ * Give the depot the top n objects of a cache, as one magazine.
+ */
+static void cache_drain(SLAB_DEPOT *dp, SLAB_CACHE *cp, int n){
+	MAGAZINE *mp;
+	pthread_mutex_lock(&dp->mutex);
+	if((mp = dp->empty) != NULL){
+		dp->empty = mp->next;
+	}
+	else{
+		mp = malloc(sizeof(MAGAZINE));
+	}
+	cp->count -= n;
+	memcpy(mp->objs, &cp->objs[cp->count], n * sizeof(void *));
+	mp->count = n;
+	mp->next = dp->full;
+	dp->full = mp;
+	pthread_mutex_unlock(&dp->mutex);
+}
+
+static void thread_release(void *arg){
+	SLAB_THREAD *t = arg;
+	for(int type = 0; type < SLAB_NTYPES; type++){
+		while(t->caches[type].count > 0){
+			cache_drain(&depots[type], &t->caches[type],
+				t->caches[type].count < SLAB_MAGAZINE ? t->caches[type].count : SLAB_MAGAZINE);
+		}
+	}
+	//a later destructor may still free objects, taking a record again
+	thread_slab = NULL;
+	atomic_store(&t->in_use, 0);
+}
+
+static void slab_once(void){
+	pthread_key_create(&slab_state.key, thread_release);
+}
+
+/*
+ * @return  The calling thread's record, taking one on first use.
+ */
+static SLAB_THREAD *thread_get(void){
+	SLAB_THREAD *t;
+	int unused = 0;
+	pthread_once(&slab_state.once, slab_once);
+	for(t = atomic_load(&slab_state.threads); t != NULL; t = t->next){
+		if(atomic_compare_exchange_strong(&t->in_use, &unused, 1)){
+			break;
+		}
+		unused = 0;
+	}
+	if(t == NULL){
+		t = calloc(1, sizeof(SLAB_THREAD));
+		atomic_store(&t->in_use, 1);
+		t->next = atomic_load(&slab_state.threads);
+		while(!atomic_compare_exchange_weak(&slab_state.threads, &t->next, t));
+	}
+	pthread_setspecific(slab_state.key, t);
+	thread_slab = t;
+	return t;
+}
+
+/*
+ * Bump a counter that only the calling thread writes.
+ */
+static inline void count_one(atomic_ulong *counter){
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+}
+
+/*
+ * Allocate an object of a given type.
+ */
+void *slab_alloc(SLAB_TYPE type){
+	SLAB_THREAD *t = thread_slab != NULL ? thread_slab : thread_get();
+	SLAB_CACHE *cp = &t->caches[type];
+	if(cp->count == 0){
+		cache_fill(&depots[type], cp);
+	}
+	count_one(&cp->allocs);
+	return cp->objs[--cp->count];
+}
+
+/*
+ * Free an object obtained from slab_alloc() with the same type.
+ */
+void slab_free(SLAB_TYPE type, void *p){
+	SLAB_THREAD *t = thread_slab != NULL ? thread_slab : thread_get();
+	SLAB_CACHE *cp = &t->caches[type];
+	if(cp->count == 2 * SLAB_MAGAZINE){
+		//half is kept, so that a thread going back and forth over the
+		//limit does not go to the depot every time
+		cache_drain(&depots[type], cp, SLAB_MAGAZINE);
+	}
+	cp->objs[cp->count++] = p;
+	count_one(&cp->frees);
+}
+
+/*
+ * Read the counters for a type.
+ */
+void slab_stats(SLAB_TYPE type, SLAB_STATS *sp){
+	SLAB_DEPOT *dp = &depots[type];
+	unsigned long allocs = 0, frees = 0, carved;
+	for(SLAB_THREAD *t = atomic_load(&slab_state.threads); t != NULL; t = t->next){
+		allocs += atomic_load_explicit(&t->caches[type].allocs, memory_order_relaxed);
+		frees += atomic_load_explicit(&t->caches[type].frees, memory_order_relaxed);
+	}
+	pthread_mutex_lock(&dp->mutex);
+	carved = dp->carved;
+	sp->mapped = dp->mapped;
+	pthread_mutex_unlock(&dp->mutex);
+	sp->name = dp->name;
+	sp->size = dp->size;
+	//an object may be freed by one thread before its allocation is counted
+	//by another, so the difference can be briefly out of range
+	sp->live = allocs > frees ? allocs - frees : 0;
+	sp->free = carved > sp->live ? carved - sp->live : 0;
+}
+
+/*
+ * Print the counters for every type to stderr.
+ */
+void slab_show(void){
+	SLAB_STATS st;
+	for(int type = 0; type < SLAB_NTYPES; type++){
+		slab_stats(type, &st);
+		fprintf(stderr, "slab %s: %zu bytes, %lu live, %lu free, %zu KB mapped\n",
+			st.name, st.size, st.live, st.free, st.mapped / 1024);
+	}
+}
@@ -2,6 +2,16 @@
 #include "helper.h"
 #include "csapp.h"
 #include "debug.h"
+#include "map.h"
+#include "config.h"
+#include "epoch.h"
+#include "sweeper.h"
+
+static void store_put_key(TRANSACTION *tp, KEY *key, BLOB *value);
+static TRANS_STATUS store_get_key(TRANSACTION *tp, KEY *key, BLOB **valuep);
+static int store_get_committed(TRANSACTION *tp, KEY *key, BLOB **valuep);
+static TRANS_STATUS store_get_done(TRANSACTION *tp, BLOB *value, BLOB **valuep);
+static void store_collect(MAP_ENTRY *mp);
 
 /*
  * Initialize the store.
@@ -9,13 +19,13 @@
 void store_init(void){
 	debug("Initialize store manager");
 	//initialize the mutex
-	pthread_mutex_t mutex;
-	pthread_mutex_init(&mutex, NULL);
-	the_map.mutex = mutex;
-	//get the number of buckets from the macro
-	the_map.num_buckets = NUM_BUCKETS;
-	//we need to malloc the array of map_entries
-	the_map.table = calloc(the_map.num_buckets, sizeof(MAP_ENTRY *) );
+	pthread_mutex_init(&the_map.mutex, NULL);
+	epoch_init();
+	//the table starts at the configured size and grows from there
+	map_init(server_config.buckets, server_config.stripes, server_config.table);
+	if(server_config.sweep > 0){
+		sweeper_start(server_config.sweep);
+	}
 }
 
 /*
@@ -23,26 +33,10 @@ void store_init(void){
  */
 void store_fini(void){
 	//we have to remove all of the map entries and their versions
-	MAP_ENTRY *index_ptr, *dump;
-	for(int i = 0; i < the_map.num_buckets; i++){
-		//for each bucket
-		if((index_ptr = the_map.table[i])!= NULL){
-			//index_ptr has the head
-			while(index_ptr != NULL){
-				//for each map_entry in the bucket
-				dump = index_ptr;
-				index_ptr = index_ptr->next;
-				//we want to remove dump;
-				map_entry_destroy(dump);
-			}
-			//all the map entries in the bucket are freed
-		}
-		//onto next bucket
-	}
-	//all buckets are freed
-	//we can now free the map
+	sweeper_stop();
+	map_fini();
+	epoch_fini();
 	pthread_mutex_destroy(&the_map.mutex);//destroy mutex
-	free(the_map.table);
 }
 
 /*
@@ -61,14 +55,34 @@ void store_fini(void){
  *   operations in an already aborted transaction.
  */
 TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value){
+	TRANS_STATUS status = store_put_borrowed(tp, key, value);
+	key_dispose(key);
+	return status;
+}
+
+/*
+ * store_put() of a key that is only borrowed: the store copies the key
+ * if it keeps it, and the caller still has it afterwards.
+ */
+TRANS_STATUS store_put_borrowed(TRANSACTION *tp, KEY *key, BLOB *value){
+	map_begin();
+	store_put_key(tp, key, value);
+	map_end();
+	return trans_get_status(tp);
+}
+
+/*
+ * store_put() for a caller between map_begin() and map_end().
+ */
+static void store_put_key(TRANSACTION *tp, KEY *key, BLOB *value){
 	//get the map entry for this key, we can either find it or create it
-	MAP_ENTRY *mp = find_map_entry(key);
+	MAP_ENTRY *mp = map_lock_entry(key);
 	//Perform Grabage Collection of already commited versions
-	garbage_collect(mp);
+	store_collect(mp);
 	//We got the key's map entry
 	//Next, we need to add the version
 	add_version(mp, tp, value);
-	return trans_get_status(tp);
+	map_unlock_entry(mp);
 }
 
 /*
@@ -76,41 +90,205 @@ TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value){
  * associated value is stored in the specified variable.
  *
  * This operation inherits the key.  The caller is responsible for
- * one reference on any returned value.
+ * one reference on any returned value.  The value is the blob held by
+ * the store, not a copy of it.
  *
  * @param tp  The transaction in which the operation is being performed.
  * @param key  The key.
  * @param valuep  A variable into which a returned value pointer may be
  *   stored.  The value pointer store may be NULL, indicating that there
  *   is no value currently associated in the store with the specified key.
+ *   Nothing is returned if the transaction aborts.
  * @return  Updated status of the transation, either TRANS_PENDING,
  *   or TRANS_ABORTED.  The purpose is to be able to avoid doing further
  *   operations in an already aborted transaction.
  */
 TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep){
+	TRANS_STATUS status = store_get_borrowed(tp, key, valuep);
+	key_dispose(key);
+	return status;
+}
+
+/*
+ * store_get() of a key that is only borrowed: the store copies the key
+ * if it keeps it, and the caller still has it afterwards.
+ */
+TRANS_STATUS store_get_borrowed(TRANSACTION *tp, KEY *key, BLOB **valuep){
+	TRANS_STATUS status;
+	BLOB *value;
+	//most reads are of a committed value, and need no lock at all
+	if(store_get_committed(tp, key, &value)){
+		return store_get_done(tp, value, valuep);
+	}
+	map_begin();
+	status = store_get_key(tp, key, valuep);
+	map_end();
+	return status;
+}
+
+/*
+ * store_get() for a caller between map_begin() and map_end().
+ *
+ * @return  The status that decided whether a value was returned.
+ */
+static TRANS_STATUS store_get_key(TRANSACTION *tp, KEY *key, BLOB **valuep){
 	//get the map entry for this key, we can either find it or create it
-	MAP_ENTRY *mp = find_map_entry(key);
+	MAP_ENTRY *mp = map_lock_entry(key);
 	//Perform Grabage Collection of already commited versions
-	garbage_collect(mp);
+	store_collect(mp);
 	//this map entry has versions
 	//get the lastest version
-	pthread_mutex_lock(&the_map.mutex);
-	VERSION *index_ptr = mp->versions;
+	VERSION *index_ptr = latest_version(mp);
+	BLOB *value;
 	if(index_ptr == NULL){
 		//empty versions, add a NULL blob
-		*valuep = blob_create(NULL, 0);
+		value = blob_create(NULL, 0);
 	}
 	else{
-		while(index_ptr->next != NULL){
-			index_ptr = index_ptr->next;
+		//blobs never change, so the value is shared rather than copied
+		value = blob_ref(index_ptr->blob, "shared value from [store_get]");
+	}
+	//the new version takes a reference of its own, ours goes to the caller
+	add_version(mp, tp, blob_ref(value, "version from [store_get]"));
+	map_unlock_entry(mp);
+	return store_get_done(tp, value, valuep);
+}
+
+/*
+ * Garbage collect an entry's versions, unless that can be left to the
+ * sweeper.  The caller must hold the entry's lock.
+ */
+static void store_collect(MAP_ENTRY *mp){
+	VERSION *tail = SLOT(mp)->tail;
+	//an aborted tail would abort whoever adds a version next, so it goes now
+	if(server_config.sweep == 0 || SLOT(mp)->nversions > SWEEP_THRESHOLD
+		|| (tail != NULL && trans_get_status(tail->creator) == TRANS_ABORTED)){
+		garbage_collect(mp, version_retire);
+	}
+}
+
+/*
+ * store_get() of a key whose latest version is committed, without
+ * taking any lock.  Instead of adding a version of its own, the reader
+ * leaves its ID on the map entry (see map_note_reader()).
+ *
+ * @return  1 if the value was found, in which case one reference on
+ *   the value has been stored in *valuep, or 0 if the caller must take
+ *   the locked path.
+ */
+static int store_get_committed(TRANSACTION *tp, KEY *key, BLOB **valuep){
+	MAP_ENTRY *mp;
+	VERSION *vp;
+	int found = 0;
+	epoch_enter();
+	if((mp = map_find_entry(key)) != NULL && (vp = latest_version(mp)) != NULL
+		&& trans_get_status(SHARED_LOAD(vp->creator)) == TRANS_COMMITTED){
+		map_note_reader(mp, tp);
+		//a writer that appended before it could see the note is let
+		//through, so the value must still be the latest one after it
+		if(latest_version(mp) == vp){
+			*valuep = blob_ref(vp->blob, "shared value from [store_get]");
+			found = 1;
 		}
-		*valuep = blob_create(index_ptr->blob->content, index_ptr->blob->size);
-		//make a new blob in order to prevent memory issues with the content
 	}
-	pthread_mutex_unlock(&the_map.mutex);
-	*valuep = (add_version(mp, tp, *valuep))->blob;
+	epoch_exit();
+	return found;
+}
+
+/*
+ * Hand the value of a get to the caller, unless the transaction has
+ * been aborted.
+ *
+ * @return  The status that decided whether a value was returned.
+ */
+static TRANS_STATUS store_get_done(TRANSACTION *tp, BLOB *value, BLOB **valuep){
+	//look only once, the transaction may be aborted at any time
+	TRANS_STATUS status = trans_get_status(tp);
+	if(status == TRANS_ABORTED){
+		blob_unref(value, "value of an aborted get from [store_get]");
+		value = NULL;
+	}
+	*valuep = value;
+	return status;
+}
+
+/*
+ * Put a batch of key/value mappings in the store, in order, taking the
+ * store's resize lock (or, if unstriped, its lock) once for the whole
+ * batch.  The batch stops at the first
+ * operation that finds the transaction aborted.
+ *
+ * The keys are only borrowed, as by store_put_borrowed().  This
+ * operation consumes one reference on each value, whether or not it was
+ * used.
+ *
+ * @param tp  The transaction in which the operations are performed.
+ * @param keys  The keys.
+ * @param values  The values (entries may be NULL, as for store_put()).
+ * @param n  Number of mappings.
+ * @return  Updated status of the transation, either TRANS_PENDING,
+ *   or TRANS_ABORTED.
+ */
+TRANS_STATUS store_put_multi(TRANSACTION *tp, KEY **keys, BLOB **values, int n){
+	int i;
+	map_begin();
+	for(i = 0; i < n && trans_get_status(tp) != TRANS_ABORTED; i++){
+		store_put_key(tp, keys[i], values[i]);
+	}
+	map_end();
+	//an abort leaves the rest of the batch unused
+	for(; i < n; i++){
+		if(values[i] != NULL)
+			blob_unref(values[i], "unused value from [store_put_multi]");
+	}
 	return trans_get_status(tp);
 }
+
+/*
+ * Get the values associated with a batch of keys, in order, taking the
+ * store's resize lock (or, if unstriped, its lock) once for the whole
+ * batch.  The batch stops at the first
+ * operation that finds the transaction aborted, in which case all the
+ * values are NULL.
+ *
+ * The keys are only borrowed, as by store_get_borrowed().  The caller
+ * is responsible for one reference on each returned value.
+ *
+ * @param tp  The transaction in which the operations are performed.
+ * @param keys  The keys.
+ * @param values  Array into which the value pointers are stored, as
+ *   for store_get().
+ * @param n  Number of keys.
+ * @return  Updated status of the transation, either TRANS_PENDING,
+ *   or TRANS_ABORTED.
+ */
+TRANS_STATUS store_get_multi(TRANSACTION *tp, KEY **keys, BLOB **values, int n){
+	TRANS_STATUS status = TRANS_PENDING;
+	int i;
+	map_begin();
+	for(i = 0; i < n && status != TRANS_ABORTED; i++){
+		if(store_get_committed(tp, keys[i], &values[i])){
+			status = store_get_done(tp, values[i], &values[i]);
+		}
+		else{
+			status = store_get_key(tp, keys[i], &values[i]);
+		}
+	}
+	map_end();
+	for(; i < n; i++){
+		values[i] = NULL;
+	}
+	if(status == TRANS_ABORTED){
+		//an aborted batch returns nothing
+		for(i = 0; i < n; i++){
+			if(values[i] != NULL)
+				blob_unref(values[i], "value of an aborted get from [store_get_multi]");
+			values[i] = NULL;
+		}
+	}
+	return status;
+}
+
 /*
  * Print the contents of the store to stderr.
  * No locking is performed, so this is not thread-safe.
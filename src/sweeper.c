@@ -0,0 +1,166 @@
+#include <stdatomic.h>
+#include <time.h>
+#include "sweeper.h"
+#include "map.h"
+#include "helper.h"
+#include "debug.h"
+#include "epoch.h"
+
+static struct {
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;        // Signalled to stop the thread
+	int running;
+	int stopping;
+	long budget;                // Nanoseconds of sweeping per wakeup
+	MAP_CURSOR cursor;
+	int versions;               // Reclaimed so far in the current pass
+	atomic_ulong transactions;  // Freed along with swept versions, since
+	                            // the end of the last pass
+	double busy;                // Nanoseconds spent on the current pass
+	atomic_ulong passes;        // Passes over the whole table
+	atomic_ulong last_versions; // Reclaimed by the last pass
+	atomic_ulong last_transactions;
+	atomic_ulong last_busy;     // Microseconds spent on the last pass
+	atomic_ulong total_versions;
+	atomic_ulong total_transactions;
+} sweeper;
+
+static double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Dispose of a swept version, counting its creator if this frees it.
+ * The version's reference is the last one if nothing else holds the
+ * transaction, which only its own references could change.
+ */
+static void swept_version_free(void *arg){
+	VERSION *vp = arg;
+	int last = vp->creator != &trans_committed
+		&& __atomic_load_n(&vp->creator->refcnt, __ATOMIC_RELAXED) == 1;
+	version_dispose(vp);
+	if(last){
+		atomic_fetch_add(&sweeper.transactions, 1);
+	}
+}
+
+/*
+ * Like version_retire(), for the sweeper's versions.
+ */
+static void swept_version_retire(VERSION *vp){
+	epoch_defer(swept_version_free, vp);
+}
+
+static void sweep_entry(MAP_ENTRY *mp){
+	sweeper.versions += garbage_collect(mp, swept_version_retire);
+}
+
+/*
+ * Record a finished pass and start the next one.
+ */
+static void pass_done(void){
+	//versions are freed a little after they are swept, so the transactions
+	//are those freed in the time of the pass
+	unsigned long transactions = atomic_exchange(&sweeper.transactions, 0);
+	atomic_store(&sweeper.last_versions, sweeper.versions);
+	atomic_store(&sweeper.last_transactions, transactions);
+	atomic_store(&sweeper.last_busy, (unsigned long)(sweeper.busy / 1000));
+	atomic_fetch_add(&sweeper.total_versions, sweeper.versions);
+	atomic_fetch_add(&sweeper.total_transactions, transactions);
+	atomic_fetch_add(&sweeper.passes, 1);
+	debug("sweep reclaimed %d versions and %lu transactions in %.0f us",
+		sweeper.versions, transactions, sweeper.busy / 1000);
+	sweeper.versions = 0;
+	sweeper.busy = 0;
+}
+
+/*
+ * Sweep until the budget is spent or the pass is over, whichever is
+ * first: a small table is not gone through more than once per wakeup.
+ */
+static void sweep(void){
+	double start = now_ns(), t0 = start, t;
+	int done;
+	do{
+		done = map_sweep(&sweeper.cursor, SWEEP_STEP, sweep_entry);
+		t = now_ns();
+		sweeper.busy += t - t0;
+		t0 = t;
+		if(done){
+			pass_done();
+		}
+	} while(!done && t - start < sweeper.budget);
+}
+
+/*
+ * Thread function for the sweeper.
+ */
+static void *sweeper_thread(void *arg){
+	struct timespec wake;
+	block_server_signals();
+	pthread_mutex_lock(&sweeper.mutex);
+	while(!sweeper.stopping){
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += SWEEP_INTERVAL_MS * 1000000L;
+		wake.tv_sec += wake.tv_nsec / 1000000000L;
+		wake.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&sweeper.cond, &sweeper.mutex, &wake);
+		if(sweeper.stopping){
+			break;
+		}
+		pthread_mutex_unlock(&sweeper.mutex);
+		sweep();
+		//nobody else will see to what the sweep deferred
+		epoch_poll();
+		pthread_mutex_lock(&sweeper.mutex);
+	}
+	pthread_mutex_unlock(&sweeper.mutex);
+	return NULL;
+}
+
+/*
+ * Start the sweeper thread.
+ */
+void sweeper_start(int budget){
+	debug("Starting sweeper, %d us every %d ms", budget, SWEEP_INTERVAL_MS);
+	memset(&sweeper, 0, sizeof(sweeper));
+	pthread_mutex_init(&sweeper.mutex, NULL);
+	pthread_cond_init(&sweeper.cond, NULL);
+	sweeper.budget = budget * 1000L;
+	sweeper.running = 1;
+	Pthread_create(&sweeper.tid, NULL, sweeper_thread, NULL);
+}
+
+/*
+ * Stop the sweeper thread and wait for it to exit.
+ */
+void sweeper_stop(void){
+	if(!sweeper.running){
+		return;
+	}
+	pthread_mutex_lock(&sweeper.mutex);
+	sweeper.stopping = 1;
+	pthread_cond_signal(&sweeper.cond);
+	pthread_mutex_unlock(&sweeper.mutex);
+	Pthread_join(sweeper.tid, NULL);
+	pthread_cond_destroy(&sweeper.cond);
+	pthread_mutex_destroy(&sweeper.mutex);
+	sweeper.running = 0;
+}
+
+/*
+ * Print what the sweeper has reclaimed to stderr.
+ */
+void sweeper_show(void){
+	if(!sweeper.running){
+		return;
+	}
+	fprintf(stderr, "sweeper: %lu passes, the last reclaimed %lu versions and %lu transactions "
+		"in %lu us of sweeping; %lu versions and %lu transactions in all\n",
+		atomic_load(&sweeper.passes), atomic_load(&sweeper.last_versions),
+		atomic_load(&sweeper.last_transactions), atomic_load(&sweeper.last_busy),
+		atomic_load(&sweeper.total_versions), atomic_load(&sweeper.total_transactions));
+}
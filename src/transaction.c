@@ -2,7 +2,28 @@
 #include "helper.h"
 #include "csapp.h"
 #include "debug.h"
+#include "slab.h"
+#include "epoch.h"
 
+/*
+ * The creator of every committed version that has let go of its own
+ * (see garbage_collect()): a committed version needs nothing of its
+ * creator but the status.  It is not on the list of transactions and
+ * is never referenced or unreferenced.
+ */
+TRANSACTION trans_committed = { .status = TRANS_COMMITTED, .refcnt = 1 };
+
+/*
+ * Drop the references held by a detached dependency list, and the list.
+ */
+static void release_dependencies(DEPENDENCY *dp){
+	DEPENDENCY *next;
+	for(; dp != NULL; dp = next){
+		next = dp->next;
+		trans_unref(dp->trans, "dependency released");
+		slab_free(SLAB_DEPENDENCY, dp);
+	}
+}
 
 /*
  * Initialize the transaction manager.
@@ -13,20 +34,33 @@ void trans_init(void){
 	trans_list.id = 0; //the head has the 0 id
 	trans_list.next = &trans_list;
 	trans_list.prev = &trans_list;
+	//the head's mutex guards the list and the id counter
+	pthread_mutex_init(&trans_list.mutex, NULL);
 }
 
 /*
  * Finalize the transaction manager.
  */
 void trans_fini(void){
-	//Iterate through our LL of transactions and free each transaction
-	TRANSACTION *dump_ptr = &trans_list;
-	TRANSACTION *current_ptr = dump_ptr->next;
+	//Iterate through our LL of transactions and free each transaction.
+	//Everything left is going, so references between transactions are not
+	//dropped one at a time: that could free one we have yet to reach.
+	TRANSACTION *dump_ptr;
+	TRANSACTION *current_ptr = trans_list.next;
+	DEPENDENCY *dp;
 	while(current_ptr != &trans_list){
 		dump_ptr = current_ptr;
 		current_ptr = dump_ptr->next;
-		trans_unref(dump_ptr, "trans_unref from [trans_fini]");
+		while((dp = dump_ptr->depends) != NULL){
+			dump_ptr->depends = dp->next;
+			slab_free(SLAB_DEPENDENCY, dp);
+		}
+		sem_destroy(&dump_ptr->sem);
+		pthread_mutex_destroy(&dump_ptr->mutex);
+		slab_free(SLAB_TRANSACTION, dump_ptr);
 	}
+	trans_list.next = &trans_list;
+	trans_list.prev = &trans_list;
 }
 
 /*
@@ -36,7 +70,7 @@ void trans_fini(void){
  * is returned if creation is successful, otherwise NULL is returned.
  */
 TRANSACTION *trans_create(void){
-	TRANSACTION *t = malloc(sizeof(TRANSACTION));
+	TRANSACTION *t = slab_alloc(SLAB_TRANSACTION);
 	pthread_mutex_t mutex;
 	pthread_mutex_init(&mutex, NULL);//initialize mutex
 	sem_t sem;
@@ -52,13 +86,14 @@ TRANSACTION *trans_create(void){
 	t->sem = sem;
 	t->mutex = mutex;
 	//LOCK
-	pthread_mutex_lock(&t->mutex);
+	//transactions are created concurrently, so lock the list, not the new transaction
+	pthread_mutex_lock(&trans_list.mutex);
 	//CRITICAL CODE
 	t->id = (trans_list.id);
 	trans_list.id++;
 	add_transaction_to_LL(t);
 	//UNLOCK
-	pthread_mutex_unlock(&t->mutex);
+	pthread_mutex_unlock(&trans_list.mutex);
 	return t;
 }
 
@@ -71,15 +106,15 @@ TRANSACTION *trans_create(void){
  */
 TRANSACTION *trans_ref(TRANSACTION *tp, char *why){
 	debug("%s\n",why);
-	//LOCK
-	pthread_mutex_lock(&tp->mutex);
-	//CRITICAL CODE
-	tp->refcnt++;
-	//UNLOCK
-	pthread_mutex_unlock(&tp->mutex);
+	//the caller already holds a reference, so nothing needs ordering
+	__atomic_fetch_add(&tp->refcnt, 1, __ATOMIC_RELAXED);
 	return tp;
 }
 
+static void trans_free(void *tp){
+	trans_destroy(tp);
+}
+
 /*
  * Decrease the reference count on a transaction.
  * If the reference count reaches zero, the transaction is freed.
@@ -89,18 +124,12 @@ TRANSACTION *trans_ref(TRANSACTION *tp, char *why){
  */
 void trans_unref(TRANSACTION *tp, char *why){
 	debug("%s\n",why);
-	//LOCK
-	pthread_mutex_lock(&tp->mutex);
-	//CRITICAL CODE
-	tp->refcnt--;
-	//UNLOCK
-	if(tp->refcnt == 0){
-		pthread_mutex_unlock(&tp->mutex);
-		//destroy the transaction
-		trans_destroy(tp);
-		return;
+	//whoever drops the last reference must see what the others did with it
+	if(__atomic_sub_fetch(&tp->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		//destroy the transaction, once out of any lock on the store, as
+		//it may take a chain of dependencies with it
+		epoch_retire(trans_free, tp);
 	}
-	pthread_mutex_unlock(&tp->mutex);
 }
 
 /*
@@ -111,33 +140,40 @@ void trans_unref(TRANSACTION *tp, char *why){
  */
 void trans_add_dependency(TRANSACTION *tp, TRANSACTION *dtp){
 	//create new dependecy
-	DEPENDENCY *d = malloc(sizeof(DEPENDENCY));
-	d->trans = tp;
+	//it goes on dtp's list of transactions to wake when dtp finishes,
+	//so it names (and holds a reference to) tp
+	DEPENDENCY *d = slab_alloc(SLAB_DEPENDENCY);
+	d->trans = trans_ref(tp, "add_dependency");
 	d->next = NULL;
 	//dependecy has been created
-	//add_ref to the dtp
-	trans_ref(dtp, "add_dependency");
-	//add it to our depends list
+	//add it to dtp's depends list
 	//LOCK
-	pthread_mutex_lock(&tp->mutex);
+	pthread_mutex_lock(&dtp->mutex);
 	//CRITICAL CODE
-	DEPENDENCY *index_ptr = dtp->depends; //first one is always the head
-	if(index_ptr == NULL){
-		//there are 0 depends
-		dtp->depends = d;
-	}
-	else {
-		while(index_ptr != NULL){
-			//reached a dependecy
-			index_ptr = index_ptr->next; //get the next
+	if(dtp->status != TRANS_PENDING){
+		//dtp finished (and woke its dependents) before we got here
+		TRANS_STATUS dtp_status = dtp->status;
+		pthread_mutex_unlock(&dtp->mutex);
+		slab_free(SLAB_DEPENDENCY, d);
+		if(dtp_status == TRANS_ABORTED){
+			//written on top of an aborted version, so tp aborts too
+			trans_abort(tp);
+		}
+		else{
+			trans_unref(tp, "add_dependency on a finished transaction");
 		}
-		//at this point, index_ptr should be last dependency
-		index_ptr->next = d; //append to the LL
+		return;
 	}
-	tp->waitcnt++; //dependent transaction waiting for this one
+	DEPENDENCY **index_ptr = &dtp->depends; //first one is always the head
+	while(*index_ptr != NULL){
+		//reached a dependecy
+		index_ptr = &(*index_ptr)->next; //get the next
+	}
+	//at this point, index_ptr is the end of the list
+	*index_ptr = d; //append to the LL
 	//UNLOCK
-	pthread_mutex_unlock(&tp->mutex);
-
+	pthread_mutex_unlock(&dtp->mutex);
+	__atomic_fetch_add(&tp->waitcnt, 1, __ATOMIC_RELAXED); //dependent transaction waiting for this one
 }
 
 
@@ -157,12 +193,10 @@ void trans_add_dependency(TRANSACTION *tp, TRANSACTION *dtp){
  */
 TRANS_STATUS trans_commit(TRANSACTION *tp){
 	TRANS_STATUS return_status;
-	while(tp->waitcnt){	//for the amount of dependencies this transaction is apart of
+	while(__atomic_load_n(&tp->waitcnt, __ATOMIC_RELAXED)){	//for the amount of dependencies this transaction is apart of
 		P(&tp->sem); //wait for another transaction from the list of depends to commit or abort
 		//another trans has unlocked us with a V message
-		pthread_mutex_lock(&tp->mutex);
-		tp->waitcnt--;
-		pthread_mutex_unlock(&tp->mutex);
+		__atomic_fetch_sub(&tp->waitcnt, 1, __ATOMIC_RELAXED);
 		//check if we aborted
 		if(trans_get_status(tp) == TRANS_ABORTED){
 			//we aborted, which means our depends list must abort too
@@ -177,23 +211,65 @@ TRANS_STATUS trans_commit(TRANSACTION *tp){
 
 	//we must commit
 	//LOCK
+	//the status only changes under the lock, so that trans_add_dependency()
+	//sees it together with the depends list, but it is read without one
 	pthread_mutex_lock(&tp->mutex);
 	//CRITICAL CODE
-	tp->status = TRANS_COMMITTED;
+	__atomic_store_n(&tp->status, TRANS_COMMITTED, __ATOMIC_RELEASE);
+	//nothing can be added to the list any more, so it is ours to take
+	DEPENDENCY *depends = tp->depends;
+	tp->depends = NULL;
 	//UNLOCK
 	pthread_mutex_unlock(&tp->mutex);
 	//we should let everyone in our depends list that we commited
-	DEPENDENCY *index_ptr = tp->depends;//get the first dependency
+	DEPENDENCY *index_ptr = depends;//get the first dependency
 	while(index_ptr != NULL){
 		V(&index_ptr->trans->sem);//ALERT THE TRANSACTIONS SEMAPHORE TO WAKE UP
 		index_ptr = index_ptr->next; //Onto the next dependency
 	}
+	//the list is done with now, rather than when the last version goes
+	release_dependencies(depends);
 	//consume a single reference
 	return_status = trans_get_status(tp);
 	trans_unref(tp, "trans unref from [trans_commit]");
 	return return_status;
 }
 
+/*
+ * trans_commit() that gives up if the transactions it depends on keep
+ * it waiting, so that a thread committing for others can move on to
+ * another transaction and come back to this one later.  The waiting
+ * already done counts towards the next call.
+ *
+ * @param tp  The transaction to be committed.
+ * @param usec  Longest time to wait for each of its dependencies.
+ * @return  TRANS_PENDING if it is still waiting, in which case the
+ *   reference is kept, and otherwise the final status, as for
+ *   trans_commit(), with the reference consumed.
+ */
+TRANS_STATUS trans_commit_timed(TRANSACTION *tp, long usec){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += (usec % 1000000) * 1000;
+	deadline.tv_sec += usec / 1000000 + deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	while(__atomic_load_n(&tp->waitcnt, __ATOMIC_RELAXED)){
+		if(sem_timedwait(&tp->sem, &deadline) < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno == ETIMEDOUT)
+				return TRANS_PENDING;
+			unix_error("sem_timedwait error");
+		}
+		__atomic_fetch_sub(&tp->waitcnt, 1, __ATOMIC_RELAXED);
+		if(trans_get_status(tp) == TRANS_ABORTED){
+			return trans_abort(tp);
+		}
+	}
+	//nothing left to wait for, so this does not block
+	return trans_commit(tp);
+}
+
 /*
  * Abort a transaction.  If the transaction has already committed, it is
  * a fatal error and the program crashes.  If the transaction has already
@@ -208,32 +284,37 @@ TRANS_STATUS trans_commit(TRANSACTION *tp){
  * @return  TRANS_ABORTED.
  */
 TRANS_STATUS trans_abort(TRANSACTION *tp){
-	TRANS_STATUS return_status = trans_get_status(tp);
-	if(return_status == TRANS_ABORTED){
-		//already aborted
-	}
-	else {
-		//Set the transaction to aborted
-		//LOCK
-		pthread_mutex_lock(&tp->mutex);
-		//CRITICAL CODE
-		tp->status = TRANS_ABORTED;
-		//UNLOCK
-		pthread_mutex_unlock(&tp->mutex);
+	TRANS_STATUS return_status;
+	DEPENDENCY *depends;
+	//LOCK
+	pthread_mutex_lock(&tp->mutex);
+	//CRITICAL CODE
+	//Set the transaction to aborted, unless it already is
+	if(tp->status != TRANS_ABORTED){
+		__atomic_store_n(&tp->status, TRANS_ABORTED, __ATOMIC_RELEASE);
 	}
+	//the list is taken by whoever aborts first, the transaction may be
+	//aborted by its own thread and by another at the same time
+	depends = tp->depends;
+	tp->depends = NULL;
+	//UNLOCK
+	pthread_mutex_unlock(&tp->mutex);
 	//alert tp's dependency list that an abort occured
-	DEPENDENCY *index_ptr = tp->depends;//get the first depends
+	DEPENDENCY *index_ptr = depends;//get the first depends
 	while(index_ptr != NULL){ //while its not null
 		if(trans_get_status(index_ptr->trans) == TRANS_PENDING){//For each transaction that is pending
 			//Change the trans status to abort
 			pthread_mutex_lock(&index_ptr->trans->mutex);
-			index_ptr->trans->status = TRANS_ABORTED; //SET THE DEPENDENT TO ABORTED
+			__atomic_store_n(&index_ptr->trans->status, TRANS_ABORTED, __ATOMIC_RELEASE); //SET THE DEPENDENT TO ABORTED
 			pthread_mutex_unlock(&index_ptr->trans->mutex);
-			V(&index_ptr->trans->sem);//ALERT THE TRANSACTIONS SEMAPHORE TO WAKE UP
 		}
+		//a dependent that something else already aborted may still be
+		//waiting in trans_commit() for us, so it is woken regardless
+		V(&index_ptr->trans->sem);//ALERT THE TRANSACTIONS SEMAPHORE TO WAKE UP
 		index_ptr = index_ptr->next; //Onto the next dependency
 
 	}
+	release_dependencies(depends);
 	//We have set the transaction to aborted
 	//consume a single reference
 	return_status = trans_get_status(tp);
@@ -253,14 +334,9 @@ TRANS_STATUS trans_abort(TRANSACTION *tp){
  * @return  The status of the transaction, as it was at the time of call.
  */
 TRANS_STATUS trans_get_status(TRANSACTION *tp){
-	TRANS_STATUS current_status;
-	//LOCK
-	pthread_mutex_lock(&tp->mutex);
-	//CRITICAL CODE
-	current_status = tp->status;
-	//UNLOCK
-	pthread_mutex_unlock(&tp->mutex);
-	return current_status;
+	//a single word, written with release ordering, so no lock is needed
+	//to read it; a final status comes with everything done before it
+	return __atomic_load_n(&tp->status, __ATOMIC_ACQUIRE);
 }
 
 /*
@@ -0,0 +1,312 @@
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include "uring.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Per-operation state.  The gather list is kept here so that it stays
+ * valid however late the kernel reads it.
+ */
+typedef struct uring_op {
+	struct iovec iov[URING_MAXIOV];
+	int res;
+} URING_OP;
+
+struct uring {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned queued;            // Operations in the current batch
+	int submitted;              // The current batch has been submitted
+	int broken;                 // A submission failed, stop using the ring
+	int can_recv;               // The kernel has IORING_OP_RECV
+	char *bufs;                 // URING_ENTRIES registered buffers, or NULL
+	URING_OP ops[URING_ENTRIES];
+};
+
+static __thread URING *thread_ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Check whether the running kernel supports io_uring.
+ *
+ * @return  0 if it does, -1 otherwise (errno is set from io_uring_setup).
+ */
+int uring_probe(void){
+	struct io_uring_params p;
+	int fd;
+	memset(&p, 0, sizeof(p));
+	if((fd = sys_io_uring_setup(1, &p)) < 0)
+		return -1;
+	close(fd);
+	return 0;
+}
+
+static void uring_destroy(URING *ur){
+	if(ur->sqes != NULL && ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqes_size);
+	if(ur->cq_ring != NULL && ur->cq_ring != MAP_FAILED)
+		munmap(ur->cq_ring, ur->cq_ring_size);
+	if(ur->sq_ring != NULL && ur->sq_ring != MAP_FAILED)
+		munmap(ur->sq_ring, ur->sq_ring_size);
+	if(ur->fd >= 0)
+		close(ur->fd);
+	free(ur->bufs);
+	free(ur);
+}
+
+/*
+ * @return  Nonzero if the kernel behind a ring supports an operation.
+ */
+static int uring_supports(URING *ur, int opcode){
+	struct io_uring_probe *probe;
+	int ok;
+	//kernels from before probing was added have no IORING_OP_RECV either
+	probe = Calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	ok = sys_io_uring_register(ur->fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+static URING *uring_create(void){
+	struct io_uring_params p;
+	struct iovec reg[URING_ENTRIES];
+	URING *ur = calloc(1, sizeof(URING));
+	memset(&p, 0, sizeof(p));
+	if((ur->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0){
+		free(ur);
+		return NULL;
+	}
+	ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if(ur->sq_ring == MAP_FAILED || ur->cq_ring == MAP_FAILED || ur->sqes == MAP_FAILED){
+		uring_destroy(ur);
+		return NULL;
+	}
+	ur->sq_tail = (unsigned *)((char *)ur->sq_ring + p.sq_off.tail);
+	ur->sq_mask = (unsigned *)((char *)ur->sq_ring + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)((char *)ur->sq_ring + p.sq_off.array);
+	ur->cq_head = (unsigned *)((char *)ur->cq_ring + p.cq_off.head);
+	ur->cq_tail = (unsigned *)((char *)ur->cq_ring + p.cq_off.tail);
+	ur->cq_mask = (unsigned *)((char *)ur->cq_ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ur->cq_ring + p.cq_off.cqes);
+	//registered buffers are an optimization, a low memlock limit just means going without
+	ur->bufs = aligned_alloc(4096, URING_ENTRIES * URING_BUFSIZE);
+	for(int i = 0; i < URING_ENTRIES; i++){
+		reg[i].iov_base = ur->bufs + i * URING_BUFSIZE;
+		reg[i].iov_len = URING_BUFSIZE;
+	}
+	if(sys_io_uring_register(ur->fd, IORING_REGISTER_BUFFERS, reg, URING_ENTRIES) < 0){
+		debug("io_uring buffer registration failed: %s", strerror(errno));
+		free(ur->bufs);
+		ur->bufs = NULL;
+	}
+	ur->can_recv = uring_supports(ur, IORING_OP_RECV);
+	return ur;
+}
+
+/*
+ * Set up a ring for the calling thread.  Does nothing if the thread
+ * already has one.
+ *
+ * @return  0 if the thread has a ring, -1 if one could not be set up.
+ */
+int uring_thread_init(void){
+	if(thread_ring == NULL)
+		thread_ring = uring_create();
+	return thread_ring != NULL ? 0 : -1;
+}
+
+/*
+ * Tear down the calling thread's ring, if any.
+ */
+void uring_thread_fini(void){
+	if(thread_ring != NULL)
+		uring_destroy(thread_ring);
+	thread_ring = NULL;
+}
+
+/*
+ * @return  The calling thread's ring, or NULL if it has none.
+ */
+URING *uring_thread(void){
+	if(thread_ring != NULL && thread_ring->broken)
+		return NULL;
+	return thread_ring;
+}
+
+/*
+ * Take the next submission queue entry for an operation on a file
+ * descriptor, starting a new batch if the last one was submitted.
+ *
+ * @return  The entry, or NULL if the ring is full.
+ */
+static struct io_uring_sqe *uring_claim(URING *ur, int fd){
+	struct io_uring_sqe *sqe;
+	if(ur->submitted){
+		ur->queued = 0;
+		ur->submitted = 0;
+	}
+	if(ur->queued == URING_ENTRIES)
+		return NULL;
+	sqe = &ur->sqes[*ur->sq_tail & *ur->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->user_data = ur->queued;
+	return sqe;
+}
+
+/*
+ * Publish the entry taken by uring_claim() to the kernel.
+ *
+ * @return  Its operation number.
+ */
+static int uring_push(URING *ur){
+	unsigned tail = *ur->sq_tail, idx = tail & *ur->sq_mask;
+	ur->sq_array[idx] = idx;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ur->ops[ur->queued].res = -EINPROGRESS;
+	return ur->queued++;
+}
+
+/*
+ * Queue a send of a gather list as a single write operation.
+ * The memory the list refers to must stay valid until uring_submit()
+ * returns; the list itself is copied.
+ *
+ * @return  An operation number to pass to uring_result(), or -1 if the
+ *   ring is full (submit first) or the list is too long.
+ */
+int uring_queue_send(URING *ur, int fd, struct iovec *iov, int iovcnt){
+	struct io_uring_sqe *sqe;
+	URING_OP *op;
+	size_t total = 0;
+	if(iovcnt > URING_MAXIOV || (sqe = uring_claim(ur, fd)) == NULL)
+		return -1;
+	for(int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	op = &ur->ops[ur->queued];
+	if(ur->bufs != NULL && total <= URING_BUFSIZE){
+		//gather into this operation's registered buffer
+		char *buf = ur->bufs + ur->queued * URING_BUFSIZE;
+		size_t off = 0;
+		for(int i = 0; i < iovcnt; i++){
+			memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = total;
+		sqe->buf_index = ur->queued;
+	}
+	else{
+		memcpy(op->iov, iov, iovcnt * sizeof(struct iovec));
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (unsigned long)op->iov;
+		sqe->len = iovcnt;
+	}
+	return uring_push(ur);
+}
+
+/*
+ * Queue a receive into a buffer.  The buffer must stay valid until
+ * uring_submit() returns.
+ *
+ * @return  An operation number to pass to uring_result(), or -1 if the
+ *   ring is full (submit first) or the kernel cannot receive through it.
+ */
+int uring_queue_recv(URING *ur, int fd, void *buf, size_t len){
+	struct io_uring_sqe *sqe;
+	if(!ur->can_recv || (sqe = uring_claim(ur, fd)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->addr = (unsigned long)buf;
+	//a single operation moves at most this much, the rest waits for the next
+	sqe->len = len < 0x7ffff000 ? len : 0x7ffff000;
+	return uring_push(ur);
+}
+
+/*
+ * Move completions from the completion queue into the operations.
+ *
+ * @return  Number of completions reaped.
+ */
+static unsigned uring_reap(URING *ur){
+	unsigned head = *ur->cq_head, count = 0;
+	while(head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)){
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+		if(cqe->user_data < URING_ENTRIES)
+			ur->ops[cqe->user_data].res = cqe->res;
+		head++;
+		count++;
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/*
+ * Submit every queued operation and wait for all of them to complete,
+ * using a single system call in the normal case.
+ *
+ * @return  0 on success, -1 if the submission itself failed (errno set);
+ *   in that case every operation reports -errno as its result.
+ */
+int uring_submit(URING *ur){
+	unsigned to_submit, pending;
+	int n;
+	if(ur->submitted || ur->queued == 0){
+		ur->submitted = 1;
+		return 0;
+	}
+	to_submit = pending = ur->queued;
+	while(pending > 0){
+		if((n = sys_io_uring_enter(ur->fd, to_submit, pending, IORING_ENTER_GETEVENTS)) < 0){
+			if(errno == EINTR)
+				continue;
+			for(unsigned i = 0; i < ur->queued; i++)
+				if(ur->ops[i].res == -EINPROGRESS)
+					ur->ops[i].res = -errno;
+			//unconsumed entries are still in the ring, so it cannot be reused
+			ur->submitted = 1;
+			ur->broken = 1;
+			return -1;
+		}
+		to_submit -= n;
+		pending -= uring_reap(ur);
+	}
+	ur->submitted = 1;
+	return 0;
+}
+
+/*
+ * Result of an operation from the last submission.
+ *
+ * @return  Number of bytes sent or received, or a negated errno value.
+ */
+int uring_result(URING *ur, int op){
+	return ur->ops[op].res;
+}
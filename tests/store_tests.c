@@ -0,0 +1,298 @@
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include "store.h"
+#include "transaction.h"
+#include "helper.h"
+#include "config.h"
+#include "epoch.h"
+#include "map.h"
+
+#define NKEYS 64
+#define NREADERS 4
+#define NWRITERS 2
+#define ROUNDS 2000
+
+static void store_setup(TABLE_KIND table, int sweep) {
+    server_config.table = table;
+    server_config.sweep = sweep;
+    server_config.buckets = 16;
+    server_config.stripes = 16;
+    trans_init();
+    store_init();
+}
+
+static void store_teardown(void) {
+    store_fini();
+    trans_fini();
+}
+
+static KEY *make_key(int i) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "key%d", i);
+    return key_create(blob_create(buf, n));
+}
+
+static BLOB *make_value(int i, int gen) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "key%d=%d", i, gen);
+    return blob_create(buf, n);
+}
+
+/*
+ * @return  The generation in a value made by make_value() for key i,
+ *   or -1 if the value is not one of those.
+ */
+static int value_gen(BLOB *bp, int i) {
+    int key, gen;
+    if(bp == NULL || bp->content == NULL || sscanf(bp->content, "key%d=%d", &key, &gen) != 2 || key != i)
+        return -1;
+    return gen;
+}
+
+/*
+ * Put a value in a transaction of its own.
+ *
+ * @return  The final status of the transaction.
+ */
+static TRANS_STATUS put_one(int i, int gen) {
+    TRANSACTION *tp = trans_create();
+    if(store_put(tp, make_key(i), make_value(i, gen)) == TRANS_ABORTED)
+        return trans_abort(tp);
+    return trans_commit(tp);
+}
+
+/*
+ * Read a key in a transaction of its own.
+ *
+ * @return  The generation of its value, or -1.
+ */
+static int read_one(int i) {
+    TRANSACTION *tp = trans_create();
+    BLOB *bp;
+    int gen = -1;
+    if(store_get(tp, make_key(i), &bp) == TRANS_ABORTED) {
+        trans_abort(tp);
+        return -1;
+    }
+    gen = value_gen(bp, i);
+    blob_unref(bp, "read_one");
+    if(trans_commit(tp) != TRANS_COMMITTED)
+        return -1;
+    return gen;
+}
+
+static atomic_int bad_reads;
+static int last_gen[NKEYS];
+
+/*
+ * Writes new generations of the keys i with i % NWRITERS == id, one
+ * transaction at a time, remembering the last one that committed.
+ */
+static void *writer_thread(void *arg) {
+    int id = (int)(long)arg;
+    for(int r = 1; r <= ROUNDS; r++) {
+        int i = (r * NWRITERS + id) % NKEYS;
+        if(put_one(i, r) == TRANS_COMMITTED)
+            last_gen[i] = r;
+    }
+    return NULL;
+}
+
+/*
+ * Reads a few keys per transaction, most of which take the lock-free
+ * path, and counts values that are not what some writer wrote.
+ */
+static void *reader_thread(void *arg) {
+    unsigned int seed = (unsigned int)(long)arg;
+    BLOB *bp;
+    for(int r = 0; r < ROUNDS; r++) {
+        TRANSACTION *tp = trans_create();
+        TRANS_STATUS status = TRANS_PENDING;
+        for(int j = 0; j < 4 && status != TRANS_ABORTED; j++) {
+            int i = rand_r(&seed) % NKEYS;
+            if((status = store_get(tp, make_key(i), &bp)) != TRANS_ABORTED) {
+                if(value_gen(bp, i) < 0)
+                    atomic_fetch_add(&bad_reads, 1);
+                blob_unref(bp, "reader_thread");
+            }
+        }
+        if(status == TRANS_ABORTED)
+            trans_abort(tp);
+        else
+            trans_commit(tp);
+    }
+    return NULL;
+}
+
+/*
+ * Committed reads racing with writers and the sweeper: every value read
+ * is one that was written, and each key ends up with the last value
+ * committed to it.
+ */
+static void concurrent_reads(TABLE_KIND table) {
+    pthread_t readers[NREADERS], writers[NWRITERS];
+    store_setup(table, 200);
+    for(int i = 0; i < NKEYS; i++)
+        cr_assert_eq(put_one(i, 0), TRANS_COMMITTED);
+    for(int i = 0; i < NREADERS; i++)
+        pthread_create(&readers[i], NULL, reader_thread, (void *)(long)(i + 1));
+    for(int i = 0; i < NWRITERS; i++)
+        pthread_create(&writers[i], NULL, writer_thread, (void *)(long)i);
+    for(int i = 0; i < NWRITERS; i++)
+        pthread_join(writers[i], NULL);
+    for(int i = 0; i < NREADERS; i++)
+        pthread_join(readers[i], NULL);
+    cr_assert_eq(atomic_load(&bad_reads), 0, "%d reads returned a value nobody wrote", atomic_load(&bad_reads));
+    for(int i = 0; i < NKEYS; i++)
+        cr_assert_eq(read_one(i), last_gen[i], "key%d: read %d, last committed %d", i, read_one(i), last_gen[i]);
+    store_teardown();
+}
+
+/*
+ * A writer older than a transaction that read the committed value
+ * without the lock must abort; a newer one goes through.
+ */
+static void reader_watermark(TABLE_KIND table) {
+    TRANSACTION *older, *newer, *later;
+    MAP_ENTRY *mp;
+    KEY *kp = make_key(0);
+    BLOB *bp;
+    store_setup(table, 0);
+    cr_assert_eq(put_one(0, 1), TRANS_COMMITTED);
+    older = trans_create();
+    newer = trans_create();
+    cr_assert_eq(store_get(newer, make_key(0), &bp), TRANS_PENDING);
+    cr_assert_eq(value_gen(bp, 0), 1);
+    blob_unref(bp, "reader_watermark");
+    //the read left its ID on the entry rather than a version
+    epoch_enter();
+    mp = map_find_entry(kp);
+    cr_assert_not_null(mp);
+    cr_assert_eq(map_last_reader(mp), newer->id);
+    cr_assert_eq(SLOT(mp)->nversions, 1, "the read added a version");
+    epoch_exit();
+    key_dispose(kp);
+    cr_assert_eq(store_put(older, make_key(0), make_value(0, 2)), TRANS_ABORTED,
+        "an older writer after a newer lock-free reader must abort");
+    cr_assert_eq(trans_abort(older), TRANS_ABORTED);
+    cr_assert_eq(trans_commit(newer), TRANS_COMMITTED);
+    cr_assert_eq(read_one(0), 1);
+    later = trans_create();
+    cr_assert_eq(store_put(later, make_key(0), make_value(0, 3)), TRANS_PENDING);
+    cr_assert_eq(trans_commit(later), TRANS_COMMITTED);
+    cr_assert_eq(read_one(0), 3);
+    store_teardown();
+}
+
+Test(store_suite, concurrent_committed_reads, .timeout = 60) {
+    concurrent_reads(TABLE_CHAINED);
+}
+
+Test(store_suite, reader_watermark_aborts_older_writer, .timeout = 10) {
+    reader_watermark(TABLE_CHAINED);
+}
+
+Test(store_suite, concurrent_committed_reads_open, .timeout = 60) {
+    concurrent_reads(TABLE_OPEN);
+}
+
+Test(store_suite, reader_watermark_aborts_older_writer_open, .timeout = 10) {
+    reader_watermark(TABLE_OPEN);
+}
+
+#define HOT_KEYS 16
+#define COLD_KEYS 8192
+
+static atomic_int writing;
+
+/*
+ * Reads the hot keys, which nobody writes, over and over while their
+ * shards are rebuilt under it.
+ */
+static void *hot_reader_thread(void *arg) {
+    while(atomic_load(&writing)) {
+        for(int i = 0; i < HOT_KEYS; i++) {
+            if(read_one(i) != 0)
+                atomic_fetch_add(&bad_reads, 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Lock-free reads while the open-addressing shards fill up and are
+ * rebuilt: new keys force the shards to grow, and keys whose only put
+ * is aborted are left unused once the sweeper gets to them, so that
+ * rebuilds after that drop them.
+ */
+Test(store_suite, rebuild_while_reading, .timeout = 60) {
+    pthread_t readers[NREADERS];
+    store_setup(TABLE_OPEN, 200);
+    for(int i = 0; i < HOT_KEYS; i++)
+        cr_assert_eq(put_one(i, 0), TRANS_COMMITTED);
+    atomic_store(&writing, 1);
+    for(int i = 0; i < NREADERS; i++)
+        pthread_create(&readers[i], NULL, hot_reader_thread, NULL);
+    for(int i = HOT_KEYS; i < HOT_KEYS + COLD_KEYS; i++) {
+        TRANSACTION *tp = trans_create();
+        if(store_put(tp, make_key(i), make_value(i, 0)) == TRANS_ABORTED || i % 2)
+            trans_abort(tp);
+        else
+            cr_assert_eq(trans_commit(tp), TRANS_COMMITTED);
+    }
+    atomic_store(&writing, 0);
+    for(int i = 0; i < NREADERS; i++)
+        pthread_join(readers[i], NULL);
+    cr_assert_eq(atomic_load(&bad_reads), 0, "%d reads of a hot key went wrong", atomic_load(&bad_reads));
+    for(int i = HOT_KEYS; i < HOT_KEYS + COLD_KEYS; i += 2)
+        cr_assert_eq(read_one(i), 0, "key%d: read %d", i, read_one(i));
+    store_teardown();
+}
+
+static atomic_int freed;
+static pthread_barrier_t reading;
+
+static void count_free(void *arg) {
+    atomic_fetch_add(&freed, 1);
+}
+
+/*
+ * Stays in a read section from one barrier to the next.
+ */
+static void *epoch_reader(void *arg) {
+    epoch_enter();
+    pthread_barrier_wait(&reading);
+    pthread_barrier_wait(&reading);
+    epoch_exit();
+    return NULL;
+}
+
+Test(epoch_suite, reclaim_after_fini, .timeout = 10) {
+    pthread_t tid;
+    int n = 4 * EPOCH_BATCH;
+    epoch_init();
+    pthread_barrier_init(&reading, NULL, 2);
+    pthread_create(&tid, NULL, epoch_reader, NULL);
+    pthread_barrier_wait(&reading);
+    for(int i = 0; i < n; i++)
+        epoch_defer(count_free, NULL);
+    epoch_poll();
+    epoch_poll();
+    cr_assert_eq(atomic_load(&freed), 0, "%d freed under a reader that could still see them", atomic_load(&freed));
+    pthread_barrier_wait(&reading);
+    pthread_join(tid, NULL);
+    epoch_fini();
+    cr_assert_eq(atomic_load(&freed), n, "%d of %d freed by epoch_fini()", atomic_load(&freed), n);
+    //and it starts over after that
+    epoch_init();
+    for(int i = 0; i < n; i++)
+        epoch_defer(count_free, NULL);
+    epoch_poll();
+    epoch_poll();
+    cr_assert_eq(atomic_load(&freed), 2 * n, "%d of %d freed with no readers", atomic_load(&freed) - n, n);
+    epoch_fini();
+    pthread_barrier_destroy(&reading);
+}
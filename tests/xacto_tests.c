@@ -5,6 +5,10 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include "csapp.h"
+#include "protocol.h"
+#include "proto_io.h"
+#include "transaction.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -70,4 +74,198 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     fprintf(stderr, "server_suite/01_connect\n");
     int ret = system("util/client -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
-}
\ No newline at end of file
+}
+
+/*
+ * Connect to the server started by 00_start_server.
+ */
+static int connect_server() {
+    int fd = open_clientfd("localhost", "9999");
+    cr_assert_neq(fd, -1, "Could not connect to server");
+    return fd;
+}
+
+static void send_packet(int fd, int type, void *data, size_t size) {
+    XACTO_PACKET pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = type;
+    pkt.size = size;
+    cr_assert_eq(proto_send_packet(fd, &pkt, data), 0, "Send failed");
+}
+
+static void send_string(int fd, char *s) {
+    send_packet(fd, XACTO_DATA_PKT, s, strlen(s));
+}
+
+/*
+ * Send a MULTI_GET or MULTI_PUT header for a batch of a given size.
+ */
+static void send_batch(int fd, int type, uint32_t count) {
+    count = htonl(count);
+    send_packet(fd, type, &count, sizeof(count));
+}
+
+/*
+ * Receive a REPLY packet and return its status.
+ */
+static int recv_reply(int fd) {
+    XACTO_PACKET pkt;
+    void *data = NULL;
+    cr_assert_eq(proto_recv_packet(fd, &pkt, &data), 0, "Receive failed");
+    cr_assert_eq(pkt.type, XACTO_REPLY_PKT, "expected REPLY, was type %d", pkt.type);
+    free(data);
+    return pkt.status;
+}
+
+/*
+ * Receive a DATA packet and return its payload (NULL for a null value),
+ * which the caller must free.
+ */
+static char *recv_data(int fd) {
+    XACTO_PACKET pkt;
+    void *data = NULL;
+    cr_assert_eq(proto_recv_packet(fd, &pkt, &data), 0, "Receive failed");
+    cr_assert_eq(pkt.type, XACTO_DATA_PKT, "expected DATA, was type %d", pkt.type);
+    cr_assert_eq(pkt.null, data == NULL, "null flag %d with a payload of %u bytes", pkt.null, pkt.size);
+    return data;
+}
+
+static void expect_value(int fd, char *value) {
+    char *data = recv_data(fd);
+    if(value == NULL)
+        cr_assert_null(data, "expected a null value, was \"%s\"", data);
+    else
+        cr_assert(data != NULL && strcmp(data, value) == 0, "expected \"%s\", was \"%s\"", value, data);
+    free(data);
+}
+
+static void expect_closed(int fd) {
+    XACTO_PACKET pkt;
+    void *data = NULL;
+    cr_assert_eq(proto_recv_packet(fd, &pkt, &data), -1, "Server did not close the connection");
+    close(fd);
+}
+
+static void commit(int fd) {
+    send_packet(fd, XACTO_COMMIT_PKT, NULL, 0);
+    cr_assert_eq(recv_reply(fd), TRANS_COMMITTED, "Transaction did not commit");
+    close(fd);
+}
+
+Test(student_suite, 02_multi_put_get, .init = init, .fini = fini, .timeout = 10) {
+    fprintf(stderr, "server_suite/02_multi_put_get\n");
+    int fd = connect_server();
+    send_batch(fd, XACTO_MULTI_PUT_PKT, 2);
+    send_string(fd, "multi_k1");
+    send_string(fd, "v1");
+    send_string(fd, "multi_k2");
+    send_string(fd, "v2");
+    cr_assert_eq(recv_reply(fd), TRANS_PENDING);
+    commit(fd);
+    fd = connect_server();
+    send_batch(fd, XACTO_MULTI_GET_PKT, 3);
+    send_string(fd, "multi_k1");
+    send_string(fd, "multi_k2");
+    send_string(fd, "multi_missing");
+    cr_assert_eq(recv_reply(fd), TRANS_PENDING);
+    expect_value(fd, "v1");
+    expect_value(fd, "v2");
+    expect_value(fd, NULL);
+    commit(fd);
+}
+
+Test(student_suite, 03_multi_empty, .init = init, .fini = fini, .timeout = 10) {
+    fprintf(stderr, "server_suite/03_multi_empty\n");
+    int fd = connect_server();
+    //an empty MULTI_GET is answered by the REPLY alone
+    send_batch(fd, XACTO_MULTI_GET_PKT, 0);
+    cr_assert_eq(recv_reply(fd), TRANS_PENDING);
+    send_batch(fd, XACTO_MULTI_PUT_PKT, 0);
+    cr_assert_eq(recv_reply(fd), TRANS_PENDING);
+    commit(fd);
+}
+
+Test(student_suite, 04_multi_max, .init = init, .fini = fini, .timeout = 20) {
+    fprintf(stderr, "server_suite/04_multi_max\n");
+    char key[32];
+    int fd = connect_server();
+    send_batch(fd, XACTO_MULTI_GET_PKT, XACTO_MULTI_MAX);
+    for(int i = 0; i < XACTO_MULTI_MAX; i++) {
+        sprintf(key, "multi_max%d", i);
+        send_string(fd, key);
+    }
+    cr_assert_eq(recv_reply(fd), TRANS_PENDING);
+    for(int i = 0; i < XACTO_MULTI_MAX; i++)
+        expect_value(fd, NULL);
+    commit(fd);
+    //one more is refused, and there is no telling where the next request starts
+    fd = connect_server();
+    send_batch(fd, XACTO_MULTI_GET_PKT, XACTO_MULTI_MAX + 1);
+    expect_closed(fd);
+}
+
+Test(student_suite, 05_multi_malformed, .init = init, .fini = fini, .timeout = 10) {
+    fprintf(stderr, "server_suite/05_multi_malformed\n");
+    uint16_t count = htons(1);
+    int fd = connect_server();
+    //the count must be a 32-bit payload
+    send_packet(fd, XACTO_MULTI_GET_PKT, &count, sizeof(count));
+    expect_closed(fd);
+    fd = connect_server();
+    send_packet(fd, XACTO_MULTI_PUT_PKT, NULL, 0);
+    expect_closed(fd);
+}
+
+Test(student_suite, 06_multi_abort, .init = init, .fini = fini, .timeout = 10) {
+    fprintf(stderr, "server_suite/06_multi_abort\n");
+    //the first request starts the older transaction
+    int older = connect_server();
+    send_packet(older, XACTO_GET_PKT, NULL, 0);
+    send_string(older, "multi_abort_first");
+    cr_assert_eq(recv_reply(older), TRANS_PENDING);
+    expect_value(older, NULL);
+    int newer = connect_server();
+    send_packet(newer, XACTO_PUT_PKT, NULL, 0);
+    send_string(newer, "multi_abort_mid");
+    send_string(newer, "newer");
+    cr_assert_eq(recv_reply(newer), TRANS_PENDING);
+    //the batch aborts at its second key, after its first was put
+    send_batch(older, XACTO_MULTI_PUT_PKT, 3);
+    send_string(older, "multi_abort_k1");
+    send_string(older, "a1");
+    send_string(older, "multi_abort_mid");
+    send_string(older, "a2");
+    send_string(older, "multi_abort_k3");
+    send_string(older, "a3");
+    cr_assert_eq(recv_reply(older), TRANS_ABORTED, "older writer after a newer one did not abort");
+    expect_closed(older);
+    commit(newer);
+    //nothing of the aborted batch is to be seen
+    int fd = connect_server();
+    send_batch(fd, XACTO_MULTI_GET_PKT, 3);
+    send_string(fd, "multi_abort_k1");
+    send_string(fd, "multi_abort_mid");
+    send_string(fd, "multi_abort_k3");
+    cr_assert_eq(recv_reply(fd), TRANS_PENDING);
+    expect_value(fd, NULL);
+    expect_value(fd, "newer");
+    expect_value(fd, NULL);
+    commit(fd);
+    //an aborted MULTI_GET is answered by the REPLY alone
+    older = connect_server();
+    send_packet(older, XACTO_GET_PKT, NULL, 0);
+    send_string(older, "multi_abort_first");
+    cr_assert_eq(recv_reply(older), TRANS_PENDING);
+    expect_value(older, NULL);
+    newer = connect_server();
+    send_packet(newer, XACTO_PUT_PKT, NULL, 0);
+    send_string(newer, "multi_abort_get");
+    send_string(newer, "newer");
+    cr_assert_eq(recv_reply(newer), TRANS_PENDING);
+    send_batch(older, XACTO_MULTI_GET_PKT, 2);
+    send_string(older, "multi_abort_k1");
+    send_string(older, "multi_abort_get");
+    cr_assert_eq(recv_reply(older), TRANS_ABORTED, "older reader after a newer writer did not abort");
+    expect_closed(older);
+    commit(newer);
+}